@@ -0,0 +1,58 @@
+#
+# Micro-benchmark of the C layer (libAzStorage) against a local mock endpoint (the mock server in
+# `benchmark/mockserver.jl`, or Azurite), so that the library overhead (handle reuse, threading, copies)
+# is measured without the network.  Each case is timed for a number of repetitions, and the per-request
+# latencies are taken from `AzStorage.stats`.
+#
+# usage:
+#   julia --project=benchmark benchmark/mockserver.jl 10000 &
+#   julia --project=benchmark benchmark/bench_c.jl [endpoint="http://127.0.0.1:10000/%s"]
+#
+using AzSessions, AzStorage, Printf, Statistics
+
+struct MockSession <: AzSessions.AzSessionAbstract end
+AzSessions.token(::MockSession; kwargs...) = "mock"
+Base.copy(session::MockSession) = session
+
+AzStorage.set_endpoint!(length(ARGS) > 0 ? ARGS[1] : "http://127.0.0.1:10000/%s")
+
+function bench(f, name, nbytes; nrepeat=10)
+    f() # warm-up (connections, handles and the OpenMP thread pool)
+    AzStorage.reset_stats!()
+    t = [@elapsed(f()) for i = 1:nrepeat]
+    s = AzStorage.stats()
+    @printf("%-44s %10.3f %12.1f %14.3f %14.3f\n", name, nbytes/median(t)/1e9, s.nrequests/sum(t),
+        s.nrequests > 0 ? 1000*s.ttfbtime/s.nrequests : 0.0, s.nrequests > 0 ? 1000*s.totaltime/s.nrequests : 0.0)
+end
+
+c = AzContainer("bench-c"; storageaccount="devstoreaccount1", session=MockSession())
+mkpath(c)
+
+@printf("%-44s %10s %12s %14s %14s\n", "case", "GB/s", "requests/s", "ttfb (ms/req)", "total (ms/req)")
+for nbytes in (1_000_000, 100_000_000), nthreads in (1, 4, Sys.CPU_THREADS)
+    x = rand(UInt8, nbytes)
+    _c = AzContainer("bench-c"; storageaccount="devstoreaccount1", session=MockSession(), nthreads=nthreads)
+    _nblocks = max(nthreads, 2)
+    bench(() -> AzStorage.writebytes_block(_c, "x", x, _nblocks), "write blocks, nbytes=$nbytes, nthreads=$nthreads", nbytes)
+    bench(() -> read!(_c, "x", x; chunksize=max(div(nbytes, 4*nthreads), 1)), "read chunks, nbytes=$nbytes, nthreads=$nthreads", nbytes)
+    __c = AzContainer("bench-c"; storageaccount="devstoreaccount1", session=MockSession(), nthreads=nthreads, nrequests=4*nthreads)
+    bench(() -> read!(__c, "x", x; chunksize=max(div(nbytes, 4*nthreads), 1)), "read chunks (curl_multi), nbytes=$nbytes, nthreads=$nthreads", nbytes)
+end
+
+# small range reads (one request per range, since maxgap=0 and the ranges are not adjacent), where the per-request
+# setup in libAzStorage is a large part of the cost, so requests/s is the figure of merit
+x = rand(UInt8, 100_000_000)
+write(c, "x", x)
+for rangesize in (512, 4096, 65536), nthreads in (1, 4, Sys.CPU_THREADS)
+    _c = AzContainer("bench-c"; storageaccount="devstoreaccount1", session=MockSession(), nthreads=nthreads)
+    offsets = [2*rangesize*(i-1) for i = 1:1000]
+    buffers = [Vector{UInt8}(undef, rangesize) for i = 1:1000]
+    bench(() -> readv!(_c, "x", offsets, buffers; maxgap=0), "small reads, 1000 x $rangesize B, nthreads=$nthreads", 1000*rangesize)
+end
+
+names = ["small$i" for i = 1:1000]
+datas = [rand(UInt8, 1000) for i = 1:1000]
+bench(() -> write(c, names, datas), "batched write, 1000 x 1 KB", 1_000_000)
+bench(() -> read!(c, names, datas), "batched read, 1000 x 1 KB", 1_000_000)
+
+rm(c)
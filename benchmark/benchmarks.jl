@@ -0,0 +1,99 @@
+#
+# Throughput benchmarks for AzStorage, in the PkgBenchmark layout (`SUITE` is a BenchmarkTools.BenchmarkGroup).
+# The suite sweeps the object size, `nthreads` and the block size of the streaming writer, for `write`, `read!`,
+# `serialize`, `readdir` and `cp`, and the range size of small (one request per range) `readv!` reads.  With
+# `nthreads=1`, `read!` uses the serial (HTTP.jl) path, and otherwise the threaded path of libAzStorage.  Use `benchmark/run.jl` to run the suite and report GB/s, requests/s and
+# p50/p99 latencies.
+#
+# Environment:
+# * AZSTORAGE_BENCHMARK_STORAGEACCOUNT storage account to benchmark against (the container is created and removed)
+# * AZSTORAGE_BENCHMARK_MOCK=true use the mock server in `benchmark/mockserver.jl` instead (no credentials needed)
+# * AZSTORAGE_BENCHMARK_PORT=10000 port of the mock server
+# * AZSTORAGE_BENCHMARK_SIZES=1000,1000000,100000000 object sizes in bytes (e.g. up to 100_000_000_000)
+# * AZSTORAGE_BENCHMARK_NTHREADS=1,4,<CPU_THREADS> values of `nthreads`
+# * AZSTORAGE_BENCHMARK_BLOCKSIZES=8000000,32000000,128000000 block sizes for the streaming writer
+#
+using AzSessions, AzStorage, BenchmarkTools, Serialization
+
+_list(name, default) = parse.(Int, split(get(ENV, name, default), ','))
+
+const SIZES = _list("AZSTORAGE_BENCHMARK_SIZES", "1000,1000000,100000000")
+const NTHREADS = _list("AZSTORAGE_BENCHMARK_NTHREADS", "1,4,$(Sys.CPU_THREADS)")
+const BLOCKSIZES = _list("AZSTORAGE_BENCHMARK_BLOCKSIZES", "8000000,32000000,128000000")
+const MOCK = get(ENV, "AZSTORAGE_BENCHMARK_MOCK", "false") == "true"
+
+struct MockSession <: AzSessions.AzSessionAbstract end
+AzSessions.token(::MockSession; kwargs...) = "mock"
+Base.copy(session::MockSession) = session
+
+if MOCK
+    AzStorage.set_endpoint!("http://127.0.0.1:$(get(ENV, "AZSTORAGE_BENCHMARK_PORT", "10000"))/%s")
+    const STORAGEACCOUNT = "devstoreaccount1"
+    const SESSION = MockSession()
+else
+    const STORAGEACCOUNT = ENV["AZSTORAGE_BENCHMARK_STORAGEACCOUNT"]
+    const SESSION = AzSession(;lazy=false, scope="offline_access+openid+https://storage.azure.com/user_impersonation")
+end
+
+const PREFIX = "azstorage-benchmark-$(string(rand(UInt32); base=16))"
+container(name; kwargs...) = AzContainer("$PREFIX-$name"; storageaccount=STORAGEACCOUNT, session=SESSION, kwargs...)
+
+# bytes moved per evaluation, used by run.jl to compute GB/s
+const NBYTES = Dict{Tuple{String,String},Int}()
+
+const SUITE = BenchmarkGroup()
+
+SUITE["write"] = BenchmarkGroup()
+SUITE["read!"] = BenchmarkGroup()
+SUITE["serialize"] = BenchmarkGroup()
+for nbytes in SIZES, nthreads in NTHREADS
+    name = "nbytes=$nbytes,nthreads=$nthreads"
+    c = container("rw"; nthreads=nthreads)
+    x = rand(UInt8, nbytes)
+    SUITE["write"][name] = @benchmarkable write($c, "x", $x) setup=mkpath($c) evals=1
+    SUITE["read!"][name] = @benchmarkable read!($c, "x", $x) setup=(mkpath($c); write($c, "x", $x)) evals=1
+    SUITE["serialize"][name] = @benchmarkable serialize($c, "x", $x) setup=mkpath($c) evals=1
+    NBYTES[("write",name)] = NBYTES[("read!",name)] = NBYTES[("serialize",name)] = nbytes
+end
+
+SUITE["open(write=true)"] = BenchmarkGroup()
+for nbytes in SIZES, blocksize in BLOCKSIZES
+    nbytes > blocksize || continue
+    name = "nbytes=$nbytes,blocksize=$blocksize"
+    c = container("stream")
+    x = rand(UInt8, nbytes)
+    SUITE["open(write=true)"][name] = @benchmarkable open(io->write(io, $x), $c, "x"; write=true, blocksize=$blocksize) setup=mkpath($c) evals=1
+    NBYTES[("open(write=true)",name)] = nbytes
+end
+
+# small range reads, one request per range, to measure the per-request overhead (requests/s)
+SUITE["readv!"] = BenchmarkGroup()
+for rangesize in (512, 4096, 65536), nthreads in NTHREADS
+    name = "nranges=1000,rangesize=$rangesize,nthreads=$nthreads"
+    c = container("readv"; nthreads=nthreads)
+    offsets = [2*rangesize*(i-1) for i = 1:1000]
+    buffers = [Vector{UInt8}(undef, rangesize) for i = 1:1000]
+    o = "x$rangesize"
+    SUITE["readv!"][name] = @benchmarkable readv!($c, $o, $offsets, $buffers; maxgap=0) setup=(mkpath($c); isfile($c, $o) || write($c, $o, rand(UInt8, 2*$rangesize*1000))) evals=1
+    NBYTES[("readv!",name)] = 1000*rangesize
+end
+
+function populate(c, nblobs)
+    mkpath(c)
+    isempty(readdir(c)) && write(c, ["x$i" for i=1:nblobs], [rand(UInt8,100) for i=1:nblobs])
+end
+
+SUITE["readdir"] = BenchmarkGroup()
+SUITE["cp"] = BenchmarkGroup()
+for nblobs in (10, 1000)
+    name = "nblobs=$nblobs"
+    c = container("dir$nblobs")
+    _c = container("cp$nblobs")
+    SUITE["readdir"][name] = @benchmarkable readdir($c) setup=populate($c, $nblobs) evals=1
+    SUITE["cp"][name] = @benchmarkable cp($c, $_c) setup=populate($c, $nblobs) teardown=rm($_c) evals=1
+    NBYTES[("readdir",name)] = 0
+    NBYTES[("cp",name)] = 100*nblobs
+end
+
+cleanup() = foreach(name->rm(AzContainer(name; storageaccount=STORAGEACCOUNT, session=SESSION)),
+    filter(name->startswith(name, PREFIX), containers(;storageaccount=STORAGEACCOUNT, session=SESSION)))
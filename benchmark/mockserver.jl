@@ -0,0 +1,137 @@
+#
+# An in-memory mock of the parts of the blob service that AzStorage uses (containers, Put Blob, Put Block,
+# Put Block List, Get Block List, ranged Get Blob, Get Blob Properties, List Blobs/Containers, Copy Blob,
+# Put Block From URL and Delete).  Authorization is not checked.  It is meant to separate the overhead of
+# AzStorage (and libAzStorage) from the network, and not to test conformance with the service.  For the
+# latter, use Azurite.
+#
+# usage: julia --project=benchmark benchmark/mockserver.jl [port=10000]
+#
+# and then, from the client, `AzStorage.set_endpoint!("http://127.0.0.1:10000/%s")`.
+#
+using HTTP
+
+const BLOBS = Dict{Tuple{String,String},Dict{String,Vector{UInt8}}}()
+const CONTENTTYPES = Dict{Tuple{String,String,String},String}()
+const UNCOMMITTED = Dict{Tuple{String,String,String},Dict{String,Vector{UInt8}}}()
+const LOCK = ReentrantLock()
+
+xmlescape(s) = replace(replace(replace(s, "&"=>"&amp;"), "<"=>"&lt;"), ">"=>"&gt;")
+
+function listblobs(account, container, query)
+    prefix = get(query, "prefix", "")
+    delimiter = get(query, "delimiter", "")
+    names = String[]
+    for name in sort(collect(keys(BLOBS[(account,container)])))
+        startswith(name, prefix) || continue
+        i = delimiter == "" ? nothing : findnext(delimiter, name, length(prefix)+1)
+        _name = i === nothing ? name : name[1:last(i)]
+        (isempty(names) || names[end] != _name) && push!(names, _name)
+    end
+    io = IOBuffer()
+    write(io, """<?xml version="1.0" encoding="utf-8"?><EnumerationResults><Blobs>""")
+    for name in names
+        write(io, "<Blob><Name>$(xmlescape(name))</Name></Blob>")
+    end
+    write(io, "</Blobs><NextMarker /></EnumerationResults>")
+    HTTP.Response(200, ["Content-Type"=>"application/xml"], take!(io))
+end
+
+function listcontainers(account)
+    io = IOBuffer()
+    write(io, """<?xml version="1.0" encoding="utf-8"?><EnumerationResults><Containers>""")
+    for (_account,container) in sort(collect(keys(BLOBS)))
+        _account == account && write(io, "<Container><Name>$(xmlescape(container))</Name></Container>")
+    end
+    write(io, "</Containers><NextMarker /></EnumerationResults>")
+    HTTP.Response(200, ["Content-Type"=>"application/xml"], take!(io))
+end
+
+function source(req)
+    uri = HTTP.URI(HTTP.header(req, "x-ms-copy-source"))
+    account,container,name = split(HTTP.unescapeuri(uri.path), '/'; keepempty=false, limit=3)
+    data = BLOBS[(account,container)][name]
+    r = HTTP.header(req, "x-ms-source-range")
+    r == "" && return data, get(CONTENTTYPES, (account,container,name), "application/octet-stream")
+    firstbyte,lastbyte = parse.(Int, split(replace(r, "bytes="=>""), '-'))
+    data[firstbyte+1:lastbyte+1], ""
+end
+
+function blob(req, account, container, name, query)
+    blobs = BLOBS[(account,container)]
+    key = (account,container,name)
+    if req.method == "PUT" && get(query, "comp", "") == "block"
+        data = HTTP.header(req, "x-ms-copy-source") == "" ? req.body : source(req)[1]
+        get!(UNCOMMITTED, key, Dict{String,Vector{UInt8}}())[query["blockid"]] = data
+        return HTTP.Response(201)
+    elseif req.method == "PUT" && get(query, "comp", "") == "blocklist"
+        blocks = UNCOMMITTED[key]
+        ids = [m.captures[1] for m in eachmatch(r"<(?:Uncommitted|Latest)>([^<]*)</", String(req.body))]
+        blobs[name] = vcat([blocks[id] for id in ids]...)
+        CONTENTTYPES[key] = HTTP.header(req, "x-ms-blob-content-type", "application/octet-stream")
+        delete!(UNCOMMITTED, key)
+        return HTTP.Response(201)
+    elseif req.method == "PUT" && HTTP.header(req, "x-ms-copy-source") != ""
+        blobs[name],CONTENTTYPES[key] = source(req)
+        return HTTP.Response(202, ["x-ms-copy-status"=>"success"])
+    elseif req.method == "PUT"
+        blobs[name] = req.body
+        CONTENTTYPES[key] = HTTP.header(req, "Content-Type", "application/octet-stream")
+        return HTTP.Response(201)
+    elseif req.method == "GET" && get(query, "comp", "") == "blocklist"
+        io = IOBuffer()
+        write(io, """<?xml version="1.0" encoding="utf-8"?><BlockList><UncommittedBlocks>""")
+        for (id,data) in get(UNCOMMITTED, key, Dict{String,Vector{UInt8}}())
+            write(io, "<Block><Name>$id</Name><Size>$(length(data))</Size></Block>")
+        end
+        write(io, "</UncommittedBlocks></BlockList>")
+        return HTTP.Response(200, ["Content-Type"=>"application/xml"], take!(io))
+    end
+
+    haskey(blobs, name) || return HTTP.Response(404)
+    data = blobs[name]
+    contenttype = get(CONTENTTYPES, key, "application/octet-stream")
+    if req.method == "HEAD"
+        return HTTP.Response(200, ["Content-Length"=>"$(length(data))", "Content-Type"=>contenttype, "ETag"=>"\"$(hash(data))\""])
+    elseif req.method == "GET"
+        r = HTTP.header(req, "Range", HTTP.header(req, "x-ms-range"))
+        r == "" && return HTTP.Response(200, ["Content-Type"=>contenttype], data)
+        firstbyte,lastbyte = parse.(Int, split(replace(r, "bytes="=>""), '-'))
+        firstbyte >= length(data) && return HTTP.Response(416)
+        lastbyte = min(lastbyte, length(data)-1)
+        return HTTP.Response(206, ["Content-Type"=>contenttype, "Content-Range"=>"bytes $firstbyte-$lastbyte/$(length(data))", "ETag"=>"\"$(hash(data))\""], data[firstbyte+1:lastbyte+1])
+    elseif req.method == "DELETE"
+        delete!(blobs, name)
+        return HTTP.Response(202)
+    end
+    HTTP.Response(400)
+end
+
+function handle(req::HTTP.Request)
+    uri = HTTP.URI(req.target)
+    query = HTTP.queryparams(uri)
+    parts = split(HTTP.unescapeuri(uri.path), '/'; keepempty=false, limit=3)
+    lock(LOCK) do
+        length(parts) == 1 && return listcontainers(parts[1])
+        key = (String(parts[1]), String(parts[2]))
+        if length(parts) == 2
+            if req.method == "PUT"
+                get!(BLOBS, key, Dict{String,Vector{UInt8}}())
+                return HTTP.Response(201)
+            end
+            haskey(BLOBS, key) || return HTTP.Response(404)
+            if req.method == "DELETE"
+                delete!(BLOBS, key)
+                return HTTP.Response(202)
+            end
+            get(query, "comp", "") == "list" && return listblobs(key..., query)
+            return HTTP.Response(200)
+        end
+        haskey(BLOBS, key) || return HTTP.Response(404)
+        blob(req, key..., String(parts[3]), query)
+    end
+end
+
+port = length(ARGS) > 0 ? parse(Int, ARGS[1]) : 10000
+@info "mock blob service listening on http://127.0.0.1:$port"
+HTTP.serve(handle, "127.0.0.1", port)
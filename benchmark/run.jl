@@ -0,0 +1,26 @@
+#
+# Run the benchmark suite in `benchmark/benchmarks.jl`, and report, for each benchmark, the throughput (GB/s),
+# the requests per second made by libAzStorage (from `AzStorage.stats`, so the requests of the serial HTTP.jl
+# path are not included), and the p50/p99 of the time per call.
+#
+# usage: julia --project=benchmark benchmark/run.jl [seconds per benchmark=10]
+#
+using AzStorage, BenchmarkTools, Printf, Statistics
+
+include(joinpath(@__DIR__, "benchmarks.jl"))
+
+seconds = length(ARGS) > 0 ? parse(Float64, ARGS[1]) : 10.0
+
+@printf("%-18s %-42s %10s %12s %12s %12s\n", "benchmark", "parameters", "GB/s", "requests/s", "p50 (ms)", "p99 (ms)")
+try
+    for group in sort(collect(keys(SUITE))), name in sort(collect(keys(SUITE[group])))
+        AzStorage.reset_stats!()
+        trial = run(SUITE[group][name]; seconds=seconds)
+        s = AzStorage.stats()
+        t = trial.times ./ 1e9
+        @printf("%-18s %-42s %10.3f %12.1f %12.2f %12.2f\n", group, name,
+            NBYTES[(group,name)] / median(t) / 1e9, s.nrequests / sum(t), 1000*quantile(t, 0.5), 1000*quantile(t, 0.99))
+    end
+finally
+    cleanup()
+end
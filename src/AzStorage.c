@@ -1,191 +1,4217 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* sched_getcpu, pthread_setaffinity_np */
+#endif
 #include <curl/curl.h>
 #include <math.h>
 #include <omp.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if LIBCURL_VERSION_NUM < 0x074200
+#error "libAzStorage requires libcurl >= 7.66 (curl_multi_poll)"
+#endif
 
 #define BUFFER_SIZE 16000 // this needs to be large to accomodate large OAuth2 tokens
 #define API_HEADER_BUFFER_SIZE 512
+#define REQUEST_MAXHEADERS 6
+#define REQUEST_HEADER_SIZE 128 /* the per-request headers (range, content length, CRC64) are short */
 #define MAXIMUM_BACKOFF 256.0
 #define CURLE_TIMEOUT 600L /* 5 hours */
 
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
-int
-exponential_backoff(
-        int i)
+/*
+Transfer statistics.  Each thread counts into its own slot (so that the hot path has no shared writes), and
+the slots are summed on demand by curl_stats.  A slot is registered on the first count of its thread, and is
+released for reuse (keeping its counts) when the thread exits.  Resetting the statistics records a baseline
+(per slot) that is subtracted from the counts, so that it does not race with the counting threads.  Times are in
+microseconds.  The latency histogram has power-of-two bins of the total request time, in milliseconds.  The slots are
+also reported one by one (see curl_stats_threads), along with the cpu of the last request of their thread.
+*/
+#define STATS_NHISTOGRAM 24
+#define STATS_NHTTP 600
+#define STATS_NCURL 100
+
+#define STATS_NREQUESTS 0
+#define STATS_NBYTESUP 1
+#define STATS_NBYTESDOWN 2
+#define STATS_NRETRIES 3
+#define STATS_BACKOFF 4
+#define STATS_DNS 5
+#define STATS_CONNECT 6
+#define STATS_TLS 7
+#define STATS_TTFB 8
+#define STATS_TOTAL 9
+#define STATS_HISTOGRAM 10
+#define STATS_RETRIES_HTTP (STATS_HISTOGRAM + STATS_NHISTOGRAM)
+#define STATS_RETRIES_CURL (STATS_RETRIES_HTTP + STATS_NHTTP)
+#define STATS_LENGTH (STATS_RETRIES_CURL + STATS_NCURL)
+
+struct StatsSlot {
+    long              counters[STATS_LENGTH];
+    long              baseline[STATS_LENGTH];
+    int               cpu;
+    int               inuse;
+    struct StatsSlot *next;
+};
+
+struct StatsSlot *STATS_SLOTS = NULL;
+pthread_mutex_t STATS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t STATS_KEY;
+pthread_once_t STATS_ONCE = PTHREAD_ONCE_INIT;
+__thread struct StatsSlot *STATS_SLOT = NULL;
+
+void
+stats_slot_release(
+        void *slotvoid)
 {
-    double sleeptime = MIN(pow(2.0, (double)i), MAXIMUM_BACKOFF) + 1.0*rand()/RAND_MAX;
-    double sleeptime_seconds = floor(sleeptime);
-    double sleeptime_nanoseconds = (long)((sleeptime - sleeptime_seconds) * 1000000000.0);
+    pthread_mutex_lock(&STATS_LOCK);
+    ((struct StatsSlot*)slotvoid)->inuse = 0;
+    pthread_mutex_unlock(&STATS_LOCK);
+}
 
-    struct timespec ts_sleeptime, ts_remainingtime;
+void
+stats_init_key()
+{
+    pthread_key_create(&STATS_KEY, stats_slot_release);
+}
 
-    ts_sleeptime.tv_sec = (long)sleeptime_seconds;
-    ts_sleeptime.tv_nsec = (long)sleeptime_nanoseconds;
+struct StatsSlot *
+stats_slot()
+{
+    if (STATS_SLOT != NULL) {
+        return STATS_SLOT;
+    }
+    pthread_once(&STATS_ONCE, stats_init_key);
 
-    return nanosleep(&ts_sleeptime, &ts_remainingtime);
+    pthread_mutex_lock(&STATS_LOCK);
+    struct StatsSlot *slot;
+    for (slot = STATS_SLOTS; slot != NULL; slot = slot->next) {
+        if (slot->inuse == 0) {
+            break;
+        }
+    }
+    if (slot == NULL) {
+        slot = (struct StatsSlot*)calloc(1, sizeof(struct StatsSlot));
+        if (slot == NULL) {
+            pthread_mutex_unlock(&STATS_LOCK);
+            return NULL;
+        }
+        slot->cpu = -1;
+        slot->next = STATS_SLOTS;
+        STATS_SLOTS = slot;
+    }
+    slot->inuse = 1;
+    pthread_mutex_unlock(&STATS_LOCK);
+
+    pthread_setspecific(STATS_KEY, (void*)slot);
+    STATS_SLOT = slot;
+    return slot;
 }
 
-int N_HTTP_RETRY_CODES = 0;
-int N_CURL_RETRY_CODES = 0;
-long *HTTP_RETRY_CODES = NULL;
-long *CURL_RETRY_CODES = NULL;
-char API_HEADER[API_HEADER_BUFFER_SIZE];
+void
+stats_add(
+        int  counter,
+        long value)
+{
+    struct StatsSlot *slot = stats_slot();
+    if (slot != NULL) {
+        __atomic_fetch_add(&slot->counters[counter], value, __ATOMIC_RELAXED);
+    }
+}
 
+/*
+count a retry of a request that returned the response codes (http, curl)
+*/
 void
-curl_init(
-        int   n_http_retry_codes,
-        int   n_curl_retry_codes,
-        long *http_retry_codes,
-        long *curl_retry_codes,
-        char *api_version)
+stats_retry(
+        long http,
+        long curl)
 {
-    HTTP_RETRY_CODES = http_retry_codes;
-    N_HTTP_RETRY_CODES = n_http_retry_codes;
+    stats_add(STATS_NRETRIES, 1);
+    if (http >= 0 && http < STATS_NHTTP) {
+        stats_add(STATS_RETRIES_HTTP + (int)http, 1);
+    }
+    if (curl >= 0 && curl < STATS_NCURL) {
+        stats_add(STATS_RETRIES_CURL + (int)curl, 1);
+    }
+}
 
-    CURL_RETRY_CODES = curl_retry_codes;
-    N_CURL_RETRY_CODES = n_curl_retry_codes;
+/*
+count a completed request, with its phase timings and bytes moved
+*/
+void
+stats_request(
+        CURL *curlhandle)
+{
+    curl_off_t dns = 0, connect = 0, tls = 0, ttfb = 0, total = 0, up = 0, down = 0;
+    curl_easy_getinfo(curlhandle, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(curlhandle, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curlhandle, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curlhandle, CURLINFO_STARTTRANSFER_TIME_T, &ttfb);
+    curl_easy_getinfo(curlhandle, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(curlhandle, CURLINFO_SIZE_UPLOAD_T, &up);
+    curl_easy_getinfo(curlhandle, CURLINFO_SIZE_DOWNLOAD_T, &down);
 
-    snprintf(API_HEADER, API_HEADER_BUFFER_SIZE, "x-ms-version: %s", api_version);
+    stats_add(STATS_NREQUESTS, 1);
+    stats_add(STATS_NBYTESUP, (long)up);
+    stats_add(STATS_NBYTESDOWN, (long)down);
+    stats_add(STATS_DNS, (long)dns);
+    stats_add(STATS_CONNECT, (long)MAX(connect - dns, 0));
+    stats_add(STATS_TLS, (long)(tls > 0 ? MAX(tls - connect, 0) : 0));
+    stats_add(STATS_TTFB, (long)ttfb);
+    stats_add(STATS_TOTAL, (long)total);
 
-    curl_global_init(CURL_GLOBAL_ALL);
-}
+    int ibin = 0;
+    long milliseconds = (long)(total/1000);
+    while (milliseconds > 0 && ibin < STATS_NHISTOGRAM-1) {
+        milliseconds >>= 1;
+        ibin++;
+    }
+    stats_add(STATS_HISTOGRAM + ibin, 1);
 
-struct ResponseCodes {
-    long http;
-    long curl;
-};
+#ifdef __linux__
+    struct StatsSlot *slot = stats_slot();
+    if (slot != NULL) {
+        __atomic_store_n(&slot->cpu, sched_getcpu(), __ATOMIC_RELAXED);
+    }
+#endif
+}
 
 /*
-https://docs.microsoft.com/en-us/rest/api/storageservices/common-rest-api-error-codes
-https://curl.haxx.se/libcurl/c/libcurl-errors.html
+the statistics since the last reset, stats must have room for STATS_LENGTH values
 */
 int
-isrestretrycode(
-        struct ResponseCodes responsecodes)
+curl_stats(
+        long *stats)
 {
     int i;
+    pthread_mutex_lock(&STATS_LOCK);
+    for (i = 0; i < STATS_LENGTH; i++) {
+        stats[i] = 0;
+    }
+    struct StatsSlot *slot;
+    for (slot = STATS_SLOTS; slot != NULL; slot = slot->next) {
+        for (i = 0; i < STATS_LENGTH; i++) {
+            stats[i] += __atomic_load_n(&slot->counters[i], __ATOMIC_RELAXED) - slot->baseline[i];
+        }
+    }
+    pthread_mutex_unlock(&STATS_LOCK);
+    return STATS_LENGTH;
+}
 
-    for (i = 0; i < N_HTTP_RETRY_CODES; i++) {
-        if (responsecodes.http == HTTP_RETRY_CODES[i]) {
-            return 1;
+void
+curl_stats_reset()
+{
+    int i;
+    pthread_mutex_lock(&STATS_LOCK);
+    struct StatsSlot *slot;
+    for (slot = STATS_SLOTS; slot != NULL; slot = slot->next) {
+        for (i = 0; i < STATS_LENGTH; i++) {
+            slot->baseline[i] = __atomic_load_n(&slot->counters[i], __ATOMIC_RELAXED);
         }
     }
+    pthread_mutex_unlock(&STATS_LOCK);
+}
 
-    for (i = 0; i < N_CURL_RETRY_CODES; i++) {
-        if (responsecodes.curl == CURL_RETRY_CODES[i]) {
-            return 1;
+/*
+Thread placement (Linux only).  With an affinity node, each thread that makes requests (the OpenMP threads, including
+the asynchronous transfer drivers and the pipeline workers) pins itself to the cpus of that NUMA node before its next
+request.  A thread that does not belong to this library (i.e. the caller of a threaded transfer that runs its OpenMP
+region on the calling thread, e.g. a Julia thread) is never pinned, so that the affinity of the caller is left alone;
+the library threads mark themselves as owned (see affinity_owned).  So, the threads stay near the NIC (see curl_nic_node), and the pages
+that they touch first (e.g. the destination of a read into fresh memory, and their scratch buffers) are allocated on that
+node.  The affinity is versioned, a thread re-pins itself when the version changes, and, with node -1, it returns to the
+cpu set that the process had at curl_init.
+*/
+pthread_mutex_t AFFINITY_LOCK = PTHREAD_MUTEX_INITIALIZER;
+int AFFINITY_NODE = -1;
+int AFFINITY_VERSION = 0;
+__thread int AFFINITY_THREAD_VERSION = 0;
+__thread int AFFINITY_OWNED = 0;
+#ifdef __linux__
+cpu_set_t AFFINITY_CPUSET;
+cpu_set_t AFFINITY_PROCESS_CPUSET;
+#endif
+
+/*
+read the first line of the (sysfs) file at path into buffer, and return 0 on success
+*/
+int
+affinity_readline(
+        const char *path,
+        char       *buffer,
+        size_t      buffersize)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char *line = fgets(buffer, (int)buffersize, file);
+    fclose(file);
+    if (line == NULL) {
+        return -1;
+    }
+    buffer[strcspn(buffer, "\n")] = '\0';
+    return 0;
+}
+
+#ifdef __linux__
+/*
+parse a cpu list (e.g. "0-15,32-47") into the cpu set, and return the number of cpus
+*/
+int
+affinity_cpulist(
+        const char *cpulist,
+        cpu_set_t  *cpuset)
+{
+    CPU_ZERO(cpuset);
+    const char *p = cpulist;
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p+1, &end, 10);
+            p = end;
+        }
+        long cpu;
+        for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET((int)cpu, cpuset);
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return CPU_COUNT(cpuset);
+}
+
+int
+affinity_nodecpus(
+        int        node,
+        cpu_set_t *cpuset)
+{
+    char path[128];
+    char cpulist[BUFFER_SIZE];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (affinity_readline(path, cpulist, sizeof(cpulist)) != 0) {
+        return 0;
+    }
+    return affinity_cpulist(cpulist, cpuset);
+}
+#endif
+
+/*
+the NUMA node of the network interface nic (e.g. "eth0"), or -1 if it is not known
+*/
+int
+curl_nic_node(
+        char *nic)
+{
+    char path[256];
+    char line[64];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", nic);
+    if (affinity_readline(path, line, sizeof(line)) != 0) {
+        return -1;
+    }
+    return atoi(line);
+}
+
+/*
+the NUMA node of cpu, or -1 if it is not known
+*/
+int
+curl_cpu_node(
+        int cpu)
+{
+#ifdef __linux__
+    int node;
+    cpu_set_t cpuset;
+    for (node = 0; cpu >= 0 && cpu < CPU_SETSIZE && node < CPU_SETSIZE; node++) {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d", node);
+        if (access(path, F_OK) != 0) {
+            break;
+        }
+        if (affinity_nodecpus(node, &cpuset) > 0 && CPU_ISSET(cpu, &cpuset)) {
+            return node;
         }
     }
+#endif
+    return -1;
+}
 
+/*
+Set the affinity node of the transfer threads, where node -1 unpins them.  Returns 0 on success, and -1 if the node has no
+cpus that this process may run on (or on platforms other than Linux).
+*/
+int
+curl_affinity(
+        int node)
+{
+#ifdef __linux__
+    cpu_set_t cpuset;
+    if (node >= 0) {
+        cpu_set_t nodecpus;
+        if (affinity_nodecpus(node, &nodecpus) == 0) {
+            return -1;
+        }
+        CPU_AND(&cpuset, &nodecpus, &AFFINITY_PROCESS_CPUSET);
+        if (CPU_COUNT(&cpuset) == 0) {
+            return -1;
+        }
+    } else {
+        cpuset = AFFINITY_PROCESS_CPUSET;
+    }
+    pthread_mutex_lock(&AFFINITY_LOCK);
+    AFFINITY_CPUSET = cpuset;
+    AFFINITY_NODE = node < 0 ? -1 : node;
+    __atomic_add_fetch(&AFFINITY_VERSION, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&AFFINITY_LOCK);
     return 0;
+#else
+    return node < 0 ? 0 : -1;
+#endif
 }
 
-size_t
-write_callback_null(
-        char   *ptr,
-        size_t  size,
-        size_t  nmemb,
-        void   *userdata)
+int
+curl_affinity_node()
 {
-    return nmemb;
+    return __atomic_load_n(&AFFINITY_NODE, __ATOMIC_RELAXED);
 }
 
+/*
+mark the calling thread as a thread of this library (that may be pinned)
+*/
 void
-curl_authorization(
-        char *token,
-        char *authorization)
+affinity_owned()
 {
-    snprintf(authorization, BUFFER_SIZE, "Authorization: Bearer %s", token);
+    AFFINITY_OWNED = 1;
 }
 
+/*
+pin the calling thread to the current affinity, if it changed since the last call of this thread, and unless it is the
+caller's thread (the master of an OpenMP region that is not run by a library thread)
+*/
 void
-curl_byterange(
-        char   *byterange,
-        size_t  dataoffset,
-        size_t  datasize)
+affinity_apply()
+{
+    if (AFFINITY_OWNED == 0 && omp_get_thread_num() == 0) {
+        return;
+    }
+    int version = __atomic_load_n(&AFFINITY_VERSION, __ATOMIC_ACQUIRE);
+    if (version == AFFINITY_THREAD_VERSION) {
+        return;
+    }
+#ifdef __linux__
+    pthread_mutex_lock(&AFFINITY_LOCK);
+    cpu_set_t cpuset = AFFINITY_CPUSET;
+    version = AFFINITY_VERSION;
+    pthread_mutex_unlock(&AFFINITY_LOCK);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+        printf("Warning, unable to set the affinity of a transfer thread.\n");
+    }
+#endif
+    AFFINITY_THREAD_VERSION = version;
+}
+
+/*
+Reusable per-thread scratch buffers (e.g. for the codec).  A buffer is allocated, and first touched, by the thread that
+uses it, so that it is local to the NUMA node of that thread.  With an affinity node, the buffers are kept across
+transfers (by the pinned threads that reuse them), and otherwise they are freed at the end of each transfer (see
+thread_buffers_done).  After the thread is re-pinned, its buffers are allocated (and touched) again, on its new node.
+The buffers of a thread are freed when it exits.
+*/
+#define THREAD_NBUFFERS 3
+
+struct ThreadBuffers {
+    char   *data[THREAD_NBUFFERS];
+    size_t  capacity[THREAD_NBUFFERS];
+    int     version;
+};
+
+__thread struct ThreadBuffers THREAD_BUFFERS;
+pthread_key_t THREAD_BUFFERS_KEY;
+pthread_once_t THREAD_BUFFERS_ONCE = PTHREAD_ONCE_INIT;
+
+void
+thread_buffers_release(
+        void *buffersvoid)
+{
+    struct ThreadBuffers *buffers = (struct ThreadBuffers*)buffersvoid;
+    int i;
+    for (i = 0; i < THREAD_NBUFFERS; i++) {
+        free(buffers->data[i]);
+        buffers->data[i] = NULL;
+        buffers->capacity[i] = 0;
+    }
+}
+
+void
+thread_buffers_init_key()
+{
+    pthread_key_create(&THREAD_BUFFERS_KEY, thread_buffers_release);
+}
+
+/*
+buffer ibuffer of the calling thread, with room for at least size bytes (or NULL if it can not be allocated)
+*/
+char *
+thread_buffer(
+        int    ibuffer,
+        size_t size)
+{
+    struct ThreadBuffers *buffers = &THREAD_BUFFERS;
+    if (buffers->version != AFFINITY_THREAD_VERSION) {
+        thread_buffers_release((void*)buffers);
+        buffers->version = AFFINITY_THREAD_VERSION;
+    }
+    if (buffers->capacity[ibuffer] < size) {
+        free(buffers->data[ibuffer]);
+        buffers->data[ibuffer] = (char*)malloc(size);
+        buffers->capacity[ibuffer] = buffers->data[ibuffer] == NULL ? 0 : size;
+        pthread_once(&THREAD_BUFFERS_ONCE, thread_buffers_init_key);
+        pthread_setspecific(THREAD_BUFFERS_KEY, (void*)buffers);
+    }
+    return buffers->data[ibuffer];
+}
+
+void
+thread_buffers_free()
+{
+    thread_buffers_release((void*)&THREAD_BUFFERS);
+}
+
+/*
+end of a transfer on the calling thread (the buffers are only kept by the threads that are pinned)
+*/
+void
+thread_buffers_done()
+{
+    if (curl_affinity_node() < 0 || (AFFINITY_OWNED == 0 && omp_get_thread_num() == 0)) {
+        thread_buffers_free();
+    }
+}
+
+/*
+Per-thread statistics: STATS_THREAD_LENGTH values per stats slot (i.e. per thread that made requests), that are the
+number of requests, the bytes up and down, the summed request time (microseconds), the cpu of its last request and
+the NUMA node of that cpu (-1 if not known).  At most nslots slots are reported, and the number of slots is returned.
+*/
+#define STATS_THREAD_LENGTH 6
+
+int
+curl_stats_threads(
+        long *stats,
+        int   nslots)
+{
+    int islot = 0;
+    int cpu[nslots > 0 ? nslots : 1];
+    pthread_mutex_lock(&STATS_LOCK);
+    struct StatsSlot *slot;
+    for (slot = STATS_SLOTS; slot != NULL; slot = slot->next, islot++) {
+        if (islot >= nslots) {
+            continue;
+        }
+        long *row = stats + islot*STATS_THREAD_LENGTH;
+        row[0] = __atomic_load_n(&slot->counters[STATS_NREQUESTS], __ATOMIC_RELAXED) - slot->baseline[STATS_NREQUESTS];
+        row[1] = __atomic_load_n(&slot->counters[STATS_NBYTESUP], __ATOMIC_RELAXED) - slot->baseline[STATS_NBYTESUP];
+        row[2] = __atomic_load_n(&slot->counters[STATS_NBYTESDOWN], __ATOMIC_RELAXED) - slot->baseline[STATS_NBYTESDOWN];
+        row[3] = __atomic_load_n(&slot->counters[STATS_TOTAL], __ATOMIC_RELAXED) - slot->baseline[STATS_TOTAL];
+        cpu[islot] = __atomic_load_n(&slot->cpu, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&STATS_LOCK);
+
+    /* the cpu to node lookup reads sysfs, so it is done outside of the lock */
+    int i;
+    for (i = 0; i < MIN(islot, nslots); i++) {
+        stats[i*STATS_THREAD_LENGTH+4] = cpu[i];
+        stats[i*STATS_THREAD_LENGTH+5] = curl_cpu_node(cpu[i]);
+    }
+    return islot;
+}
+
+/*
+rand() is not thread-safe, and, when seeded identically, makes the threads retry in lockstep.  So, each
+thread draws its jitter from its own rand_r state.
+*/
+__thread unsigned int BACKOFF_SEED = 0;
+
+double
+backoff_jitter()
+{
+    if (BACKOFF_SEED == 0) {
+        BACKOFF_SEED = (unsigned int)time(NULL) ^ (unsigned int)(size_t)pthread_self() ^ (unsigned int)(size_t)&BACKOFF_SEED;
+        BACKOFF_SEED = BACKOFF_SEED == 0 ? 1 : BACKOFF_SEED;
+    }
+    return 1.0*rand_r(&BACKOFF_SEED)/RAND_MAX;
+}
+
+double
+backoff_time(
+        int i)
+{
+    return MIN(pow(2.0, (double)i), MAXIMUM_BACKOFF) + backoff_jitter();
+}
+
+int
+exponential_backoff(
+        int i)
+{
+    double sleeptime = backoff_time(i);
+    stats_add(STATS_BACKOFF, (long)(sleeptime*1000000.0));
+    double sleeptime_seconds = floor(sleeptime);
+    double sleeptime_nanoseconds = (long)((sleeptime - sleeptime_seconds) * 1000000000.0);
+
+    struct timespec ts_sleeptime, ts_remainingtime;
+
+    ts_sleeptime.tv_sec = (long)sleeptime_seconds;
+    ts_sleeptime.tv_nsec = (long)sleeptime_nanoseconds;
+
+    return nanosleep(&ts_sleeptime, &ts_remainingtime);
+}
+
+double
+walltime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9*(double)ts.tv_nsec;
+}
+
+/*
+Rate controller, shared by all threads and transfers.  It is AIMD over the number of requests that are
+allowed to be in flight: a throttling response (429 or 503) halves the window (at most once per
+RATE_DECREASE_INTERVAL, so that a burst of throttled responses counts as one congestion event), and each
+successful response grows it by 1/window (i.e. by about one request per window of responses).  If the service
+sends a Retry-After header, then no new requests are started until it passes.  Hence, when the account is
+throttling, the threads back off together instead of each on its own, and they do not all come back at once.
+*/
+#define RATE_MAXIMUM_WINDOW 4096.0
+#define RATE_DECREASE_INTERVAL 1.0
+
+pthread_mutex_t RATE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t RATE_COND = PTHREAD_COND_INITIALIZER;
+double RATE_WINDOW = RATE_MAXIMUM_WINDOW;
+int RATE_INFLIGHT = 0;
+double RATE_PAUSE_UNTIL = 0.0;
+double RATE_LAST_DECREASE = 0.0;
+long RATE_NTHROTTLED = 0;
+
+int
+rate_isthrottled(
+        long responsecode_http)
+{
+    return (responsecode_http == 429 || responsecode_http == 503) ? 1 : 0;
+}
+
+/*
+returns 1 and takes a slot in the window if a request can be started now, and  0 otherwise.
+Must be called with RATE_LOCK held.
+*/
+int
+rate_tryacquire_locked(
+        double now)
+{
+    if (now < RATE_PAUSE_UNTIL || (double)RATE_INFLIGHT >= floor(RATE_WINDOW)) {
+        return 0;
+    }
+    RATE_INFLIGHT++;
+    return 1;
+}
+
+int
+rate_tryacquire()
 {
-    snprintf(byterange, BUFFER_SIZE, "Range: bytes=%ld-%ld", dataoffset, dataoffset+datasize-1);
+    pthread_mutex_lock(&RATE_LOCK);
+    int acquired = rate_tryacquire_locked(walltime());
+    pthread_mutex_unlock(&RATE_LOCK);
+    return acquired;
 }
 
-void
-curl_contentlength(
-        size_t  datasize,
-        char   *contentlength)
-{
-    snprintf(contentlength, BUFFER_SIZE, "Content-Length: %lu", (unsigned long)datasize);
-}
+void
+rate_acquire()
+{
+    pthread_mutex_lock(&RATE_LOCK);
+    double now = walltime();
+    while (rate_tryacquire_locked(now) == 0) {
+        if (now < RATE_PAUSE_UNTIL) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            double wait = RATE_PAUSE_UNTIL - now;
+            ts.tv_sec += (time_t)floor(wait);
+            ts.tv_nsec += (long)((wait - floor(wait))*1000000000.0);
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec += 1;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&RATE_COND, &RATE_LOCK, &ts);
+        } else {
+            pthread_cond_wait(&RATE_COND, &RATE_LOCK);
+        }
+        now = walltime();
+    }
+    pthread_mutex_unlock(&RATE_LOCK);
+}
+
+/*
+seconds until a request may be started (a hint for non-blocking callers, e.g. the curl_multi engine)
+*/
+double
+rate_delay()
+{
+    pthread_mutex_lock(&RATE_LOCK);
+    double delay = MAX(RATE_PAUSE_UNTIL - walltime(), 0.01);
+    pthread_mutex_unlock(&RATE_LOCK);
+    return delay;
+}
+
+void
+rate_release(
+        CURL *curlhandle,
+        long  responsecode_http)
+{
+    double retryafter = 0.0;
+#if LIBCURL_VERSION_NUM >= 0x074200
+    curl_off_t _retryafter = 0;
+    if (curlhandle != NULL && curl_easy_getinfo(curlhandle, CURLINFO_RETRY_AFTER, &_retryafter) == CURLE_OK) {
+        retryafter = (double)_retryafter;
+    }
+#endif
+
+    pthread_mutex_lock(&RATE_LOCK);
+    double now = walltime();
+    RATE_INFLIGHT = MAX(RATE_INFLIGHT - 1, 0);
+    if (rate_isthrottled(responsecode_http) == 1) {
+        RATE_NTHROTTLED++;
+        if (now - RATE_LAST_DECREASE > RATE_DECREASE_INTERVAL) {
+            RATE_WINDOW = MAX(floor(MIN(RATE_WINDOW, (double)RATE_INFLIGHT + 1.0)/2.0), 1.0);
+            RATE_LAST_DECREASE = now;
+        }
+        if (retryafter > 0.0) {
+            RATE_PAUSE_UNTIL = MAX(RATE_PAUSE_UNTIL, now + MIN(retryafter, MAXIMUM_BACKOFF));
+        }
+    } else if (responsecode_http < 300) {
+        RATE_WINDOW = MIN(RATE_WINDOW + 1.0/RATE_WINDOW, RATE_MAXIMUM_WINDOW);
+    }
+    pthread_cond_broadcast(&RATE_COND);
+    pthread_mutex_unlock(&RATE_LOCK);
+}
+
+/*
+release a slot that was acquired for a request that could not be started (the window is left as is)
+*/
+void
+rate_cancel()
+{
+    pthread_mutex_lock(&RATE_LOCK);
+    RATE_INFLIGHT = MAX(RATE_INFLIGHT - 1, 0);
+    pthread_cond_broadcast(&RATE_COND);
+    pthread_mutex_unlock(&RATE_LOCK);
+}
+
+/*
+curl_easy_perform within the window of the rate controller
+*/
+CURLcode
+curl_perform(
+        CURL *curlhandle,
+        long *responsecode_http)
+{
+    rate_acquire();
+    CURLcode responsecode_curl = curl_easy_perform(curlhandle);
+    curl_easy_getinfo(curlhandle, CURLINFO_RESPONSE_CODE, responsecode_http);
+    rate_release(curlhandle, *responsecode_http);
+    stats_request(curlhandle);
+    return responsecode_curl;
+}
+
+/*
+the current window, requests in flight and number of throttled responses (for diagnostics and testing)
+*/
+void
+curl_rate_state(
+        double *window,
+        int    *inflight,
+        long   *nthrottled)
+{
+    pthread_mutex_lock(&RATE_LOCK);
+    *window = RATE_WINDOW;
+    *inflight = RATE_INFLIGHT;
+    *nthrottled = RATE_NTHROTTLED;
+    pthread_mutex_unlock(&RATE_LOCK);
+}
+
+void
+curl_rate_reset()
+{
+    pthread_mutex_lock(&RATE_LOCK);
+    RATE_WINDOW = RATE_MAXIMUM_WINDOW;
+    RATE_PAUSE_UNTIL = 0.0;
+    RATE_LAST_DECREASE = 0.0;
+    RATE_NTHROTTLED = 0;
+    pthread_cond_broadcast(&RATE_COND);
+    pthread_mutex_unlock(&RATE_LOCK);
+}
+
+int N_HTTP_RETRY_CODES = 0;
+int N_CURL_RETRY_CODES = 0;
+long *HTTP_RETRY_CODES = NULL;
+long *CURL_RETRY_CODES = NULL;
+char API_HEADER[API_HEADER_BUFFER_SIZE];
+
+/*
+The blob service endpoint, where "%s" is replaced by the storage account name.  This can be set to a local
+endpoint (e.g. Azurite or a mock server, "http://127.0.0.1:10000/%s") for testing and benchmarking.
+*/
+char ENDPOINT[API_HEADER_BUFFER_SIZE] = "https://%s.blob.core.windows.net";
+
+int
+curl_endpoint(
+        char *endpoint)
+{
+    char *p = strstr(endpoint, "%s");
+    if (p == NULL || strstr(p+2, "%s") != NULL || strlen(endpoint) >= API_HEADER_BUFFER_SIZE) {
+        return -1;
+    }
+    strcpy(ENDPOINT, endpoint);
+    return 0;
+}
+
+void
+curl_accounturl(
+        char *accounturl,
+        char *storageaccount)
+{
+    char *p = strstr(ENDPOINT, "%s");
+    snprintf(accounturl, BUFFER_SIZE, "%.*s%s%s", (int)(p - ENDPOINT), ENDPOINT, storageaccount, p+2);
+}
+
+/*
+Share object for the DNS cache and TLS session ids.  All handles in the pool are attached to it so
+that concurrent workers hitting the same storage account do one DNS lookup and resume TLS sessions
+rather than each doing a full handshake.  The connection cache is not shared (libcurl does not support
+sharing it between concurrently used handles), connections are reused through the pooled easy handles.
+*/
+CURLSH *CURL_SHARE = NULL;
+omp_lock_t CURL_SHARE_LOCKS[CURL_LOCK_DATA_LAST];
+
+/*
+CRC64 used by the storage service for the x-ms-content-crc64 header (the reflected polynomial 0x9A6C9329AC4BC9B5,
+with an initial value and final xor of ~0, also known as CRC-64/NVME).  The update consumes 8 bytes per step using
+8 tables (slice-by-8).  The CRC of a concatenation is computed from the CRCs of its parts (crc64_combine, as in zlib),
+so that the CRCs of the blocks, computed by the transfer threads, give the CRC of the blob without a second pass.
+The service returns the CRC of a ranged read only for ranges of at most CRC64_MAXIMUM_RANGE bytes.
+*/
+#define CRC64_POLY 0x9A6C9329AC4BC9B5ULL
+#define CRC64_MAXIMUM_RANGE 4194304
+#define CRC64_MISMATCH CURLE_BAD_CONTENT_ENCODING
+
+uint64_t CRC64_TABLE[8][256];
+
+void
+crc64_init()
+{
+    int n, k;
+    for (n = 0; n < 256; n++) {
+        uint64_t crc = (uint64_t)n;
+        for (k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC64_POLY : crc >> 1;
+        }
+        CRC64_TABLE[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++) {
+        uint64_t crc = CRC64_TABLE[0][n];
+        for (k = 1; k < 8; k++) {
+            crc = CRC64_TABLE[0][crc & 0xff] ^ (crc >> 8);
+            CRC64_TABLE[k][n] = crc;
+        }
+    }
+}
+
+uint64_t
+curl_crc64(
+        uint64_t    crc,
+        const char *data,
+        size_t      datasize)
+{
+    const unsigned char *p = (const unsigned char*)data;
+    crc = ~crc;
+    while (datasize >= 8) {
+        crc ^= (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)
+            | ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+        crc = CRC64_TABLE[7][crc & 0xff] ^ CRC64_TABLE[6][(crc >> 8) & 0xff] ^ CRC64_TABLE[5][(crc >> 16) & 0xff] ^ CRC64_TABLE[4][(crc >> 24) & 0xff]
+            ^ CRC64_TABLE[3][(crc >> 32) & 0xff] ^ CRC64_TABLE[2][(crc >> 40) & 0xff] ^ CRC64_TABLE[1][(crc >> 48) & 0xff] ^ CRC64_TABLE[0][crc >> 56];
+        p += 8;
+        datasize -= 8;
+    }
+    while (datasize-- > 0) {
+        crc = CRC64_TABLE[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+uint64_t
+crc64_matrix_times(
+        const uint64_t *matrix,
+        uint64_t        vector)
+{
+    uint64_t sum = 0;
+    while (vector != 0) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+        vector >>= 1;
+        matrix++;
+    }
+    return sum;
+}
+
+void
+crc64_matrix_square(
+        uint64_t       *square,
+        const uint64_t *matrix)
+{
+    int n;
+    for (n = 0; n < 64; n++) {
+        square[n] = crc64_matrix_times(matrix, matrix[n]);
+    }
+}
+
+/*
+CRC of the concatenation of a (with CRC crc1) and b (with CRC crc2 and length datasize2)
+*/
+uint64_t
+curl_crc64_combine(
+        uint64_t crc1,
+        uint64_t crc2,
+        size_t   datasize2)
+{
+    if (datasize2 == 0) {
+        return crc1;
+    }
+
+    /* operator for one zero bit, then squared to get the operators for two and four zero bits */
+    uint64_t even[64], odd[64];
+    int n;
+    odd[0] = CRC64_POLY;
+    for (n = 1; n < 64; n++) {
+        odd[n] = (uint64_t)1 << (n - 1);
+    }
+    crc64_matrix_square(even, odd);
+    crc64_matrix_square(odd, even);
+
+    /* apply datasize2 zero bytes to crc1, the first square below puts the operator for one zero byte in even */
+    do {
+        crc64_matrix_square(even, odd);
+        if (datasize2 & 1) {
+            crc1 = crc64_matrix_times(even, crc1);
+        }
+        datasize2 >>= 1;
+        if (datasize2 == 0) {
+            break;
+        }
+        crc64_matrix_square(odd, even);
+        if (datasize2 & 1) {
+            crc1 = crc64_matrix_times(odd, crc1);
+        }
+        datasize2 >>= 1;
+    } while (datasize2 != 0);
+
+    return crc1 ^ crc2;
+}
+
+static const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+the header value for a CRC64 is the base64 encoding of its 8 (little-endian) bytes
+*/
+void
+crc64_header(
+        char     *header,
+        uint64_t  crc)
+{
+    unsigned char bytes[9];
+    char encoded[13];
+    int i;
+    for (i = 0; i < 8; i++) {
+        bytes[i] = (unsigned char)(crc >> (8*i));
+    }
+    bytes[8] = 0;
+    for (i = 0; i < 3; i++) {
+        uint32_t x = ((uint32_t)bytes[3*i] << 16) | ((uint32_t)bytes[3*i+1] << 8) | (uint32_t)bytes[3*i+2];
+        encoded[4*i] = BASE64_ALPHABET[(x >> 18) & 63];
+        encoded[4*i+1] = BASE64_ALPHABET[(x >> 12) & 63];
+        encoded[4*i+2] = BASE64_ALPHABET[(x >> 6) & 63];
+        encoded[4*i+3] = BASE64_ALPHABET[x & 63];
+    }
+    encoded[11] = '=';
+    encoded[12] = 0;
+    snprintf(header, REQUEST_HEADER_SIZE, "x-ms-content-crc64: %s", encoded);
+}
+
+struct Crc64Header {
+    int      found;
+    uint64_t crc;
+};
+
+/*
+parse the x-ms-content-crc64 response header (whose value is 12 base64 characters)
+*/
+size_t
+header_callback_crc64(
+        char   *buffer,
+        size_t  size,
+        size_t  nitems,
+        void   *userdata)
+{
+    struct Crc64Header *crcheader = (struct Crc64Header*)userdata;
+    size_t n = size*nitems;
+    const char *name = "x-ms-content-crc64:";
+    size_t namesize = strlen(name);
+    if (n < namesize + 12 || strncasecmp(buffer, name, namesize) != 0) {
+        return n;
+    }
+    size_t i = namesize;
+    while (i < n && buffer[i] == ' ') {
+        i++;
+    }
+    if (n - i < 12) {
+        return n;
+    }
+    unsigned char bytes[9];
+    int igroup, j;
+    for (igroup = 0; igroup < 3; igroup++) {
+        uint32_t x = 0;
+        for (j = 0; j < 4; j++) {
+            char c = buffer[i+4*igroup+j];
+            const char *digit = c == '=' ? BASE64_ALPHABET : strchr(BASE64_ALPHABET, c);
+            if (c == 0 || digit == NULL) {
+                return n;
+            }
+            x = (x << 6) | (uint32_t)(digit - BASE64_ALPHABET);
+        }
+        bytes[3*igroup] = (unsigned char)(x >> 16);
+        bytes[3*igroup+1] = (unsigned char)(x >> 8);
+        bytes[3*igroup+2] = (unsigned char)x;
+    }
+    uint64_t value = 0;
+    for (j = 0; j < 8; j++) {
+        value |= (uint64_t)bytes[j] << (8*j);
+    }
+    crcheader->crc = value;
+    crcheader->found = 1;
+    return n;
+}
+
+void
+curl_share_lock(
+        CURL               *curlhandle,
+        curl_lock_data      data,
+        curl_lock_access    access,
+        void               *userptr)
+{
+    omp_set_lock(&CURL_SHARE_LOCKS[data]);
+}
+
+void
+curl_share_unlock(
+        CURL            *curlhandle,
+        curl_lock_data   data,
+        void            *userptr)
+{
+    omp_unset_lock(&CURL_SHARE_LOCKS[data]);
+}
+
+CURL *
+curl_handle_new()
+{
+    CURL *curlhandle = curl_easy_init();
+    if (curlhandle != NULL && CURL_SHARE != NULL) {
+        curl_easy_setopt(curlhandle, CURLOPT_SHARE, CURL_SHARE);
+    }
+    return curlhandle;
+}
+
+/*
+Pool of curl easy handles.  A handle keeps its live connections, DNS cache and TLS session
+cache across curl_easy_reset, so re-using handles across blocks and retries avoids a fresh
+TCP connect and TLS handshake per request.
+*/
+omp_lock_t CURL_HANDLE_POOL_LOCK;
+CURL **CURL_HANDLE_POOL = NULL;
+int CURL_HANDLE_POOL_CAPACITY = 0;
+int CURL_HANDLE_POOL_NFREE = 0;
+
+CURL *
+curl_handle_acquire()
+{
+    affinity_apply();
+
+    CURL *curlhandle = NULL;
+
+    omp_set_lock(&CURL_HANDLE_POOL_LOCK);
+    if (CURL_HANDLE_POOL_NFREE > 0) {
+        curlhandle = CURL_HANDLE_POOL[--CURL_HANDLE_POOL_NFREE];
+    }
+    omp_unset_lock(&CURL_HANDLE_POOL_LOCK);
+
+    if (curlhandle == NULL) {
+        curlhandle = curl_handle_new();
+    }
+    return curlhandle;
+}
+
+void
+curl_handle_release(
+        CURL *curlhandle)
+{
+    curl_easy_reset(curlhandle);
+
+    omp_set_lock(&CURL_HANDLE_POOL_LOCK);
+    if (CURL_HANDLE_POOL_NFREE == CURL_HANDLE_POOL_CAPACITY) {
+        int capacity = MAX(2*CURL_HANDLE_POOL_CAPACITY, 16);
+        CURL **pool = (CURL**)realloc(CURL_HANDLE_POOL, capacity*sizeof(CURL*));
+        if (pool == NULL) {
+            omp_unset_lock(&CURL_HANDLE_POOL_LOCK);
+            curl_easy_cleanup(curlhandle);
+            return;
+        }
+        CURL_HANDLE_POOL = pool;
+        CURL_HANDLE_POOL_CAPACITY = capacity;
+    }
+    CURL_HANDLE_POOL[CURL_HANDLE_POOL_NFREE++] = curlhandle;
+    omp_unset_lock(&CURL_HANDLE_POOL_LOCK);
+}
+
+void
+curl_init(
+        int   n_http_retry_codes,
+        int   n_curl_retry_codes,
+        long *http_retry_codes,
+        long *curl_retry_codes,
+        char *api_version,
+        int   nhandles)
+{
+    HTTP_RETRY_CODES = http_retry_codes;
+    N_HTTP_RETRY_CODES = n_http_retry_codes;
+
+    CURL_RETRY_CODES = curl_retry_codes;
+    N_CURL_RETRY_CODES = n_curl_retry_codes;
+
+    snprintf(API_HEADER, API_HEADER_BUFFER_SIZE, "x-ms-version: %s", api_version);
+
+    crc64_init();
+
+#ifdef __linux__
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &AFFINITY_PROCESS_CPUSET) != 0) {
+        CPU_ZERO(&AFFINITY_PROCESS_CPUSET);
+    }
+#endif
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    int ilock;
+    for (ilock = 0; ilock < CURL_LOCK_DATA_LAST; ilock++) {
+        omp_init_lock(&CURL_SHARE_LOCKS[ilock]);
+    }
+    CURL_SHARE = curl_share_init();
+    curl_share_setopt(CURL_SHARE, CURLSHOPT_LOCKFUNC, curl_share_lock);
+    curl_share_setopt(CURL_SHARE, CURLSHOPT_UNLOCKFUNC, curl_share_unlock);
+    curl_share_setopt(CURL_SHARE, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(CURL_SHARE, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    omp_init_lock(&CURL_HANDLE_POOL_LOCK);
+    int ihandle;
+    for (ihandle = 0; ihandle < nhandles; ihandle++) {
+        curl_handle_release(curl_handle_new());
+    }
+}
+
+void
+curl_cleanup()
+{
+    int ihandle;
+    omp_set_lock(&CURL_HANDLE_POOL_LOCK);
+    for (ihandle = 0; ihandle < CURL_HANDLE_POOL_NFREE; ihandle++) {
+        curl_easy_cleanup(CURL_HANDLE_POOL[ihandle]);
+    }
+    free(CURL_HANDLE_POOL);
+    CURL_HANDLE_POOL = NULL;
+    CURL_HANDLE_POOL_CAPACITY = 0;
+    CURL_HANDLE_POOL_NFREE = 0;
+    omp_unset_lock(&CURL_HANDLE_POOL_LOCK);
+
+    curl_share_cleanup(CURL_SHARE);
+    CURL_SHARE = NULL;
+
+    curl_global_cleanup();
+}
+
+struct ResponseCodes {
+    long http;
+    long curl;
+};
+
+/*
+https://docs.microsoft.com/en-us/rest/api/storageservices/common-rest-api-error-codes
+https://curl.haxx.se/libcurl/c/libcurl-errors.html
+*/
+int
+isrestretrycode(
+        struct ResponseCodes responsecodes)
+{
+    int i;
+
+    for (i = 0; i < N_HTTP_RETRY_CODES; i++) {
+        if (responsecodes.http == HTTP_RETRY_CODES[i]) {
+            return 1;
+        }
+    }
+
+    for (i = 0; i < N_CURL_RETRY_CODES; i++) {
+        if (responsecodes.curl == CURL_RETRY_CODES[i]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+size_t
+write_callback_null(
+        char   *ptr,
+        size_t  size,
+        size_t  nmemb,
+        void   *userdata)
+{
+    return nmemb;
+}
+
+/*
+Token slot.  A transfer of a large blob can outlive its OAuth2 token, so the requests of a transfer take their
+Authorization header from a slot that the caller refreshes while the transfer runs (curl_token_set).  A request that
+fails with 401 or 403 marks the token as stale, and waits (for at most TOKEN_MAXIMUM_WAIT seconds) for the caller to set
+the token again before it is retried, so that only the requests that were in flight when the token expired are
+repeated.  The headers of the earlier tokens are kept until the slot is freed, since requests in flight may still use
+them.  A slot that is made for a fixed token (token_slot_new with refreshable=0) is never refreshed.  The slot of a
+server-side copy also holds the (OAuth2) token that authorizes the service to read the copy source (sourcetoken, which is
+NULL or empty otherwise), so that both tokens are refreshed together.
+*/
+#define TOKEN_MAXIMUM_WAIT 60 /* seconds */
+
+struct TokenSlot {
+    pthread_mutex_t     lock;
+    pthread_cond_t      refreshed;
+    struct curl_slist  *headers;
+    struct curl_slist **retired;
+    int                 nretired;
+    long                generation;
+    int                 stale;
+    int                 refreshable;
+};
+
+/*
+append the header "<name>: Bearer <token>" to headers (which is freed on failure)
+*/
+struct curl_slist *
+token_headers_append(
+        struct curl_slist *headers,
+        const char        *name,
+        char              *token)
+{
+    size_t headersize = strlen(name) + strlen(token) + 32;
+    char *header = (char*)malloc(headersize);
+    if (header == NULL) {
+        curl_slist_free_all(headers);
+        return NULL;
+    }
+    snprintf(header, headersize, "%s: Bearer %s", name, token);
+    struct curl_slist *_headers = curl_slist_append(headers, header);
+    free(header);
+    if (_headers == NULL) {
+        curl_slist_free_all(headers);
+    }
+    return _headers;
+}
+
+/*
+the Authorization and x-ms-version headers for token, and the x-ms-copy-source-authorization header for sourcetoken (if
+it is not NULL or empty)
+*/
+struct curl_slist *
+token_headers_new(
+        char *token,
+        char *sourcetoken)
+{
+    struct curl_slist *headers = token_headers_append(NULL, "Authorization", token);
+    if (headers != NULL) {
+        struct curl_slist *_headers = curl_slist_append(headers, API_HEADER);
+        if (_headers == NULL) {
+            curl_slist_free_all(headers);
+        }
+        headers = _headers;
+    }
+    if (headers != NULL && sourcetoken != NULL && strlen(sourcetoken) > 0) {
+        headers = token_headers_append(headers, "x-ms-copy-source-authorization", sourcetoken);
+    }
+    return headers;
+}
+
+struct TokenSlot *
+token_slot_new(
+        char *token,
+        char *sourcetoken,
+        int   refreshable)
+{
+    struct TokenSlot *slot = (struct TokenSlot*)malloc(sizeof(struct TokenSlot));
+    if (slot == NULL) {
+        return NULL;
+    }
+    slot->headers = token_headers_new(token, sourcetoken);
+    if (slot->headers == NULL) {
+        free(slot);
+        return NULL;
+    }
+    pthread_mutex_init(&slot->lock, NULL);
+    pthread_cond_init(&slot->refreshed, NULL);
+    slot->retired = NULL;
+    slot->nretired = 0;
+    slot->generation = 0;
+    slot->stale = 0;
+    slot->refreshable = refreshable;
+    return slot;
+}
+
+struct TokenSlot *
+curl_token_new(
+        char *token,
+        char *sourcetoken)
+{
+    return token_slot_new(token, sourcetoken, 1);
+}
+
+/*
+Set the token of the slot.  This also wakes the requests that are waiting for a refresh, even if the token did not
+change, so that a request that is rejected for another reason fails (after its retries) rather than waiting.
+*/
+int
+curl_token_set(
+        struct TokenSlot *slot,
+        char             *token,
+        char             *sourcetoken)
+{
+    struct curl_slist *headers = token_headers_new(token, sourcetoken);
+    if (headers == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&slot->lock);
+    struct curl_slist **retired = (struct curl_slist**)realloc(slot->retired, (slot->nretired+1)*sizeof(struct curl_slist*));
+    if (retired == NULL) {
+        pthread_mutex_unlock(&slot->lock);
+        curl_slist_free_all(headers);
+        return -1;
+    }
+    slot->retired = retired;
+    slot->retired[slot->nretired++] = slot->headers;
+    slot->headers = headers;
+    slot->generation++;
+    slot->stale = 0;
+    pthread_cond_broadcast(&slot->refreshed);
+    pthread_mutex_unlock(&slot->lock);
+    return 0;
+}
+
+/*
+1 if a request asked for the token to be refreshed (since it was last set), and 0 otherwise
+*/
+int
+curl_token_stale(
+        struct TokenSlot *slot)
+{
+    pthread_mutex_lock(&slot->lock);
+    int stale = slot->stale;
+    pthread_mutex_unlock(&slot->lock);
+    return stale;
+}
+
+void
+curl_token_free(
+        struct TokenSlot *slot)
+{
+    if (slot == NULL) {
+        return;
+    }
+    int i;
+    for (i = 0; i < slot->nretired; i++) {
+        curl_slist_free_all(slot->retired[i]);
+    }
+    free(slot->retired);
+    curl_slist_free_all(slot->headers);
+    pthread_mutex_destroy(&slot->lock);
+    pthread_cond_destroy(&slot->refreshed);
+    free(slot);
+}
+
+struct curl_slist *
+token_headers(
+        struct TokenSlot *slot)
+{
+    pthread_mutex_lock(&slot->lock);
+    struct curl_slist *headers = slot->headers;
+    pthread_mutex_unlock(&slot->lock);
+    return headers;
+}
+
+long
+token_generation(
+        struct TokenSlot *slot)
+{
+    pthread_mutex_lock(&slot->lock);
+    long generation = slot->generation;
+    pthread_mutex_unlock(&slot->lock);
+    return generation;
+}
+
+void
+token_mark_stale(
+        struct TokenSlot *slot)
+{
+    pthread_mutex_lock(&slot->lock);
+    slot->stale = 1;
+    pthread_mutex_unlock(&slot->lock);
+}
+
+/*
+Mark the token as stale, and wait for it to be set again (if it is still of the given generation).  Returns 1 if the
+token was set, and 0 if the wait timed out.
+*/
+int
+token_wait(
+        struct TokenSlot *slot,
+        long              generation)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += TOKEN_MAXIMUM_WAIT;
+
+    pthread_mutex_lock(&slot->lock);
+    slot->stale = 1;
+    int status = 0;
+    while (slot->generation == generation && status == 0) {
+        status = pthread_cond_timedwait(&slot->refreshed, &slot->lock, &deadline);
+    }
+    int refreshed = slot->generation != generation ? 1 : 0;
+    pthread_mutex_unlock(&slot->lock);
+    return refreshed;
+}
+
+int
+isauthcode(
+        struct ResponseCodes responsecodes)
+{
+    return responsecodes.curl == (long)CURLE_OK && (responsecodes.http == 401 || responsecodes.http == 403) ? 1 : 0;
+}
+
+/*
+Prepared request context.  The url of the blob is built once per (container, blob), and the Authorization and
+x-ms-version headers once per token (in the token slot), and they are shared (read-only) by all requests of a transfer,
+including their retries.  The headers that change per request (range, content length, CRC64) are formatted into a
+RequestHeaders struct on the stack of the request, and are chained in front of the shared headers, so that a request
+neither allocates its header list nor needs BUFFER_SIZE (token sized) buffers.  If tokenslot is NULL, then the context
+owns a (fixed) slot for token.
+*/
+struct RequestContext {
+    struct TokenSlot *tokenslot;
+    int               owntokenslot;
+    char             *url;
+    size_t            urlsize;
+};
+
+int
+curl_request_context_init(
+        struct RequestContext *context,
+        char                  *token,
+        struct TokenSlot      *tokenslot,
+        char                  *storageaccount,
+        char                  *containername,
+        char                  *blobname)
+{
+    char accounturl[BUFFER_SIZE];
+    curl_accounturl(accounturl, storageaccount);
+    context->urlsize = strlen(accounturl) + strlen(containername) + strlen(blobname) + 3;
+    context->url = (char*)malloc(context->urlsize);
+    if (context->url != NULL) {
+        snprintf(context->url, context->urlsize, "%s/%s/%s", accounturl, containername, blobname);
+    }
+
+    context->owntokenslot = tokenslot == NULL ? 1 : 0;
+    context->tokenslot = tokenslot == NULL ? token_slot_new(token, NULL, 0) : tokenslot;
+
+    return context->url == NULL || context->tokenslot == NULL ? -1 : 0;
+}
+
+void
+curl_request_context_free(
+        struct RequestContext *context)
+{
+    if (context->owntokenslot != 0) {
+        curl_token_free(context->tokenslot);
+    }
+    free(context->url);
+    context->tokenslot = NULL;
+    context->url = NULL;
+}
+
+/*
+free the context of a request that could not be prepared, and return the response codes for the failure
+*/
+struct ResponseCodes
+curl_request_context_error(
+        struct RequestContext *context)
+{
+    printf("Error, unable to allocate the request context.\n");
+    curl_request_context_free(context);
+    struct ResponseCodes responsecodes;
+    responsecodes.http = 200;
+    responsecodes.curl = (long)CURLE_OUT_OF_MEMORY;
+    return responsecodes;
+}
+
+/*
+1 if a request that failed with responsecodes, and that was sent with the token of the given generation, should be
+retried with a refreshed token (after waiting for the refresh), and 0 otherwise
+*/
+int
+curl_request_context_reauthorize(
+        const struct RequestContext *context,
+        struct ResponseCodes         responsecodes,
+        long                         generation,
+        int                          verbose)
+{
+    if (context->tokenslot->refreshable == 0 || isauthcode(responsecodes) == 0) {
+        return 0;
+    }
+    if (verbose > 0) {
+        printf("Warning, authorization failed (http response code=%ld), waiting for a new token.\n", responsecodes.http);
+    }
+    stats_retry(responsecodes.http, responsecodes.curl);
+    return token_wait(context->tokenslot, generation);
+}
+
+struct RequestHeaders {
+    struct curl_slist nodes[REQUEST_MAXHEADERS];
+    char              buffers[REQUEST_MAXHEADERS][REQUEST_HEADER_SIZE];
+    int               n;
+};
+
+/*
+Add a header to the request, and return its buffer (of REQUEST_HEADER_SIZE bytes).  If header is not NULL, then it is
+used as is (and must outlive the request), and otherwise the caller formats the header into the returned buffer.
+*/
+char *
+request_header(
+        struct RequestHeaders *headers,
+        const char            *header)
+{
+    int i = headers->n++;
+    headers->nodes[i].data = header == NULL ? headers->buffers[i] : (char*)header;
+    return headers->buffers[i];
+}
+
+/*
+the header list of the request: its own headers followed by the shared headers of the context
+*/
+struct curl_slist *
+request_headers_link(
+        struct RequestHeaders       *headers,
+        const struct RequestContext *context)
+{
+    struct curl_slist *shared = token_headers(context->tokenslot);
+    int i;
+    for (i = 0; i < headers->n; i++) {
+        headers->nodes[i].next = i+1 < headers->n ? &headers->nodes[i+1] : shared;
+    }
+    return headers->n > 0 ? &headers->nodes[0] : shared;
+}
+
+void
+curl_byterange(
+        struct RequestHeaders *headers,
+        size_t                 dataoffset,
+        size_t                 datasize)
+{
+    snprintf(request_header(headers, NULL), REQUEST_HEADER_SIZE, "Range: bytes=%lu-%lu", (unsigned long)dataoffset, (unsigned long)(dataoffset+datasize-1));
+}
+
+void
+curl_contentlength(
+        struct RequestHeaders *headers,
+        size_t                 datasize)
+{
+    snprintf(request_header(headers, NULL), REQUEST_HEADER_SIZE, "Content-Length: %lu", (unsigned long)datasize);
+}
+
+struct DataStruct {
+    char *data;
+    size_t datasize;
+    size_t currentsize;
+};
+
+size_t
+write_callback_readdata(
+        char   *ptr,
+        size_t  size,
+        size_t  nmemb,
+        void   *datavoid)
+{
+    struct DataStruct *datastruct = (struct DataStruct*)datavoid;
+    size_t n = size*nmemb;
+    size_t newsize = datastruct->currentsize + n;
+    if (newsize > datastruct->datasize) {
+        printf("error: read too many bytes, %d in %s\n", __LINE__, __FILE__);
+        return 0;
+    }
+    memcpy(datastruct->data+datastruct->currentsize, ptr, n);
+    datastruct->currentsize = newsize;
+    return n;
+}
+
+/*
+headers, url and options of a Put Block request, the body is set by the caller
+*/
+void
+curl_putblock_setup(
+        CURL                        *curlhandle,
+        const struct RequestContext *context,
+        struct RequestHeaders       *headers,
+        char                        *blockid,
+        size_t                       datasize,
+        const uint64_t              *crc,
+        int                          verbose,
+        char                        *errbuf)
+{
+    headers->n = 0;
+    request_header(headers, "Content-Type: application/octet-stream");
+    curl_contentlength(headers, datasize);
+    if (crc != NULL) {
+        crc64_header(request_header(headers, NULL), *crc);
+    }
+
+    char url[context->urlsize + strlen(blockid) + 32];
+    snprintf(url, sizeof(url), "%s?comp=block&blockid=%s", context->url, blockid);
+
+    curl_easy_setopt(curlhandle, CURLOPT_URL, url);
+    curl_easy_setopt(curlhandle, CURLOPT_HTTPHEADER, request_headers_link(headers, context));
+    curl_easy_setopt(curlhandle, CURLOPT_CUSTOMREQUEST, "PUT");
+    curl_easy_setopt(curlhandle, CURLOPT_SSL_VERIFYPEER, 0L); /* TODO */
+    curl_easy_setopt(curlhandle, CURLOPT_VERBOSE, (long)verbose);
+    curl_easy_setopt(curlhandle, CURLOPT_TIMEOUT, CURLE_TIMEOUT);
+    curl_easy_setopt(curlhandle, CURLOPT_WRITEFUNCTION, write_callback_null);
+    curl_easy_setopt(curlhandle, CURLOPT_ERRORBUFFER, errbuf);
+}
+
+void
+curl_writebytes_block_setup(
+        CURL                        *curlhandle,
+        const struct RequestContext *context,
+        struct RequestHeaders       *headers,
+        char                        *blockid,
+        char                        *data,
+        size_t                       datasize,
+        const uint64_t              *crc,
+        int                          verbose,
+        char                        *errbuf)
+{
+    curl_putblock_setup(curlhandle, context, headers, blockid, datasize, crc, verbose, errbuf);
+    curl_easy_setopt(curlhandle, CURLOPT_POSTFIELDSIZE, datasize);
+    curl_easy_setopt(curlhandle, CURLOPT_POSTFIELDS, data);
+}
+
+/*
+Do not reuse the connection of the pooled handle (nor leave the new connection in it).  This is used for the
+second-chance pass over failed blocks, so that they are not retried on the same (e.g. stalled) connection.
+*/
+void
+curl_fresh_connect(
+        CURL *curlhandle,
+        int   fresh)
+{
+    if (fresh != 0) {
+        curl_easy_setopt(curlhandle, CURLOPT_FRESH_CONNECT, 1L);
+        curl_easy_setopt(curlhandle, CURLOPT_FORBID_REUSE, 1L);
+    }
+}
+
+struct ResponseCodes
+curl_writebytes_block(
+        const struct RequestContext *context,
+        char                        *blockid,
+        char                        *data,
+        size_t                       datasize,
+        const uint64_t              *crc,
+        int                          fresh,
+        int                          verbose)
+{
+    CURL *curlhandle = curl_handle_acquire();
+
+    char errbuf[CURL_ERROR_SIZE];
+    struct RequestHeaders headers;
+    curl_writebytes_block_setup(curlhandle, context, &headers, blockid, data, datasize, crc, verbose, errbuf);
+    curl_fresh_connect(curlhandle, fresh);
+
+    long responsecode_http = 200;
+    CURLcode responsecode_curl = curl_perform(curlhandle, &responsecode_http);
+
+    if ( (responsecode_curl != CURLE_OK || responsecode_http >= 300) && verbose > 0) {
+        printf("Warning, curl response=%s, http response code=%ld\n", errbuf, responsecode_http);
+    }
+
+    curl_handle_release(curlhandle);
+
+    struct ResponseCodes responsecodes;
+    responsecodes.http = responsecode_http;
+    responsecodes.curl = (long)responsecode_curl;
+
+    return responsecodes;
+}
+
+/*
+If crc is not NULL, then the CRC64 of the block is computed (while the block is hot in the cache of the
+thread that uploads it), sent with the block so that the service can verify it, and returned in crc.
+*/
+struct ResponseCodes
+curl_writebytes_block_retry(
+        const struct RequestContext *context,
+        char                        *blockid,
+        char                        *data,
+        size_t                       datasize,
+        uint64_t                    *crc,
+        int                          fresh,
+        int                          nretry,
+        int                          verbose)
+{
+    if (crc != NULL) {
+        *crc = curl_crc64(0, data, datasize);
+    }
+    int iretry;
+    struct ResponseCodes responsecodes;
+    for (iretry = 0; iretry < nretry; iretry++) {
+        long generation = token_generation(context->tokenslot);
+        responsecodes = curl_writebytes_block(context, blockid, data, datasize, crc, fresh, verbose);
+        if (curl_request_context_reauthorize(context, responsecodes, generation, verbose) == 1) {
+            continue;
+        }
+        if (isrestretrycode(responsecodes) == 0) {
+            break;
+        }
+        if (verbose > 0) {
+            printf("Warning, bad write, retrying, %d/%d, http_responsecode=%ld, curl_responsecode=%ld.\n", iretry+1, nretry, responsecodes.http, responsecodes.curl);
+        }
+        stats_retry(responsecodes.http, responsecodes.curl);
+        if (exponential_backoff(iretry) != 0) {
+            printf("Warning, unable to sleep in exponential backoff due to failed nanosleep call.\n");
+            break;
+        }
+    }
+    return responsecodes;
+}
+
+/*
+Optional codec for block uploads.  Each block is compressed independently (by the thread that uploads it), such
+that a range of the uncompressed data can be read by fetching and decompressing only the blocks that overlap it.
+The compressor is given by function pointers with the signatures of the zstd simple API (ZSTD_compress,
+ZSTD_decompress, ZSTD_compressBound and ZSTD_isError), so that the codec library is loaded by the caller.  If
+elsize > 1, then the bytes of each block are shuffled (byte k of every element is stored contiguously, as in
+blosc) before compression, which helps for (e.g. floating point) arrays whose elements are elsize bytes.
+*/
+#define CODEC_ERROR CURLE_BAD_CONTENT_ENCODING
+
+typedef size_t (*codec_compress_callback)(void *dst, size_t dstcapacity, const void *src, size_t srcsize, int level);
+typedef size_t (*codec_decompress_callback)(void *dst, size_t dstcapacity, const void *src, size_t srcsize);
+typedef size_t (*codec_bound_callback)(size_t srcsize);
+typedef unsigned (*codec_iserror_callback)(size_t code);
+
+struct Codec {
+    codec_compress_callback   compress;
+    codec_decompress_callback decompress;
+    codec_bound_callback      bound;
+    codec_iserror_callback    iserror;
+    int                       level;
+    int                       elsize;
+};
+
+void
+codec_shuffle(
+        char       *dst,
+        const char *src,
+        size_t      datasize,
+        int         elsize)
+{
+    size_t nelements = datasize/elsize;
+    size_t ielement;
+    int ibyte;
+    for (ibyte = 0; ibyte < elsize; ibyte++) {
+        for (ielement = 0; ielement < nelements; ielement++) {
+            dst[ibyte*nelements+ielement] = src[ielement*elsize+ibyte];
+        }
+    }
+    memcpy(dst+nelements*elsize, src+nelements*elsize, datasize-nelements*elsize);
+}
+
+void
+codec_unshuffle(
+        char       *dst,
+        const char *src,
+        size_t      datasize,
+        int         elsize)
+{
+    size_t nelements = datasize/elsize;
+    size_t ielement;
+    int ibyte;
+    for (ibyte = 0; ibyte < elsize; ibyte++) {
+        for (ielement = 0; ielement < nelements; ielement++) {
+            dst[ielement*elsize+ibyte] = src[ibyte*nelements+ielement];
+        }
+    }
+    memcpy(dst+nelements*elsize, src+nelements*elsize, datasize-nelements*elsize);
+}
+
+/*
+Compress (and shuffle) the block into compressed (of size compressedcapacity), returning the compressed size,
+or 0 on error.  shuffled is scratch space of (at least) datasize bytes when elsize > 1.
+*/
+size_t
+codec_compress(
+        struct Codec *codec,
+        const char   *data,
+        size_t        datasize,
+        char         *shuffled,
+        char         *compressed,
+        size_t        compressedcapacity)
+{
+    if (codec->elsize > 1) {
+        codec_shuffle(shuffled, data, datasize, codec->elsize);
+        data = shuffled;
+    }
+    size_t n = codec->compress(compressed, compressedcapacity, data, datasize, codec->level);
+    return codec->iserror(n) ? 0 : n;
+}
+
+/*
+Decompress (and unshuffle) the block into data (of size datasize), returning 0 on success.  shuffled is scratch
+space of (at least) datasize bytes when elsize > 1.
+*/
+int
+codec_decompress(
+        struct Codec *codec,
+        char         *data,
+        size_t        datasize,
+        char         *shuffled,
+        const char   *compressed,
+        size_t        compressedsize)
+{
+    char *dst = codec->elsize > 1 ? shuffled : data;
+    size_t n = codec->decompress(dst, datasize, compressed, compressedsize);
+    if (codec->iserror(n) || n != datasize) {
+        return -1;
+    }
+    if (codec->elsize > 1) {
+        codec_unshuffle(data, shuffled, datasize, codec->elsize);
+    }
+    return 0;
+}
+
+struct ResponseCodes
+curl_writebytes_block_retry_threaded(
+        char    *token,
+        struct TokenSlot *tokenslot,
+        char    *storageaccount,
+        char    *containername,
+        char    *blobname,
+        char   **blockids,
+        char    *data,
+        size_t  datasize,
+        int     nthreads,
+        int     nblocks,
+        char    *skip,
+        struct ResponseCodes *blockcodes,
+        uint64_t *blockcrcs,
+        struct Codec *codec,
+        int     fresh,
+        int     nretry,
+        int     verbose)
+{
+    struct RequestContext context;
+    if (curl_request_context_init(&context, token, tokenslot, storageaccount, containername, blobname) != 0) {
+        return curl_request_context_error(&context);
+    }
+
+    size_t block_datasize = datasize/nblocks;
+    size_t block_dataremainder = datasize%nblocks;
+
+    int threadid;
+    long thread_responsecode_http[nthreads];
+    long thread_responsecode_curl[nthreads];
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        thread_responsecode_http[threadid] = 200;
+        thread_responsecode_curl[threadid] = (long)CURLE_OK;
+    }
+
+#pragma omp parallel num_threads(nthreads) default(shared)
+{
+    int threadid = omp_get_thread_num();
+    int iblock;
+
+    /* per-thread scratch space for the codec (pinned before it is touched) */
+    char *shuffled = NULL;
+    char *compressed = NULL;
+    size_t compressedcapacity = 0;
+    if (codec != NULL) {
+        affinity_apply();
+        size_t maximum_datasize = block_datasize + (block_dataremainder > 0 ? 1 : 0);
+        shuffled = codec->elsize > 1 ? thread_buffer(0, maximum_datasize) : NULL;
+        compressedcapacity = codec->bound(maximum_datasize);
+        compressed = thread_buffer(1, compressedcapacity);
+    }
+    int outofmemory = codec != NULL && (compressed == NULL || (codec->elsize > 1 && shuffled == NULL));
+
+#pragma omp for
+    for (iblock = 0; iblock < nblocks; iblock++) {
+        size_t block_firstbyte = iblock*block_datasize;
+        size_t _block_datasize = block_datasize;
+        if (iblock < block_dataremainder) {
+            block_firstbyte += iblock;
+            _block_datasize += 1;
+        } else {
+            block_firstbyte += block_dataremainder;
+        }
+
+        if (skip != NULL && skip[iblock] != 0) {
+            if (blockcodes != NULL) {
+                blockcodes[iblock].http = 200;
+                blockcodes[iblock].curl = (long)CURLE_OK;
+            }
+            /* the CRC of a block that is already uploaded is still needed for the CRC of the blob */
+            if (blockcrcs != NULL) {
+                blockcrcs[iblock] = curl_crc64(0, data+block_firstbyte, _block_datasize);
+            }
+            continue;
+        }
+
+        char *block_data = data+block_firstbyte;
+        struct ResponseCodes responsecodes;
+        if (outofmemory) {
+            printf("Error, unable to allocate the codec buffers for block %d.\n", iblock);
+            responsecodes.http = 200;
+            responsecodes.curl = (long)CURLE_OUT_OF_MEMORY;
+            if (blockcodes != NULL) {
+                blockcodes[iblock] = responsecodes;
+            }
+            thread_responsecode_curl[threadid] = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+            continue;
+        }
+        if (codec != NULL) {
+            _block_datasize = codec_compress(codec, block_data, _block_datasize, shuffled, compressed, compressedcapacity);
+            block_data = compressed;
+        }
+        if (_block_datasize == 0) {
+            printf("Error, unable to compress block %d.\n", iblock);
+            responsecodes.http = 200;
+            responsecodes.curl = (long)CODEC_ERROR;
+        } else {
+            responsecodes = curl_writebytes_block_retry(&context, blockids[iblock], block_data, _block_datasize, blockcrcs == NULL ? NULL : &blockcrcs[iblock], fresh, nretry, verbose);
+        }
+        if (blockcodes != NULL) {
+            blockcodes[iblock] = responsecodes;
+        }
+        thread_responsecode_http[threadid] = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        thread_responsecode_curl[threadid] = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+
+    if (codec != NULL) {
+        thread_buffers_done();
+    }
+} // end #pragma omp
+    curl_request_context_free(&context);
+
+    struct ResponseCodes responsecodes;
+    responsecodes.http = (long)200;
+    responsecodes.curl = (long)CURLE_OK;
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        responsecodes.http = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        responsecodes.curl = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+    return responsecodes;
+}
+
+/*
+headers, url and options of a ranged Get Blob request.  If integrity is not 0, then the service is asked for the CRC64 of
+the range.
+*/
+void
+curl_readrange_setup(
+        CURL                        *curlhandle,
+        const struct RequestContext *context,
+        struct RequestHeaders       *headers,
+        size_t                       dataoffset,
+        size_t                       datasize,
+        int                          integrity,
+        curl_write_callback          writefunction,
+        void                        *writedata,
+        int                          verbose,
+        char                        *errbuf)
+{
+    headers->n = 0;
+    curl_byterange(headers, dataoffset, datasize);
+    if (integrity != 0) {
+        request_header(headers, "x-ms-range-get-content-crc64: true");
+    }
+
+    curl_easy_setopt(curlhandle, CURLOPT_URL, context->url);
+    curl_easy_setopt(curlhandle, CURLOPT_HTTPHEADER, request_headers_link(headers, context));
+    curl_easy_setopt(curlhandle, CURLOPT_SSL_VERIFYPEER, 0L); /* TODO */
+    curl_easy_setopt(curlhandle, CURLOPT_TIMEOUT, CURLE_TIMEOUT);
+    curl_easy_setopt(curlhandle, CURLOPT_VERBOSE, (long)verbose);
+    curl_easy_setopt(curlhandle, CURLOPT_WRITEFUNCTION, writefunction);
+    curl_easy_setopt(curlhandle, CURLOPT_WRITEDATA, writedata);
+    curl_easy_setopt(curlhandle, CURLOPT_ERRORBUFFER, errbuf);
+}
+
+void
+curl_readbytes_setup(
+        CURL                        *curlhandle,
+        const struct RequestContext *context,
+        struct RequestHeaders       *headers,
+        struct DataStruct           *datastruct,
+        size_t                       dataoffset,
+        int                          integrity,
+        int                          verbose,
+        char                        *errbuf)
+{
+    curl_readrange_setup(curlhandle, context, headers, dataoffset, datastruct->datasize, integrity, write_callback_readdata, (void*)datastruct, verbose, errbuf);
+}
+
+/*
+If integrity is not 0, then the service is asked for the CRC64 of the range (which must be at most
+CRC64_MAXIMUM_RANGE bytes), and a range with a missing or mismatched CRC64 is reported as CRC64_MISMATCH.
+*/
+struct ResponseCodes
+curl_readbytes(
+        const struct RequestContext *context,
+        char                        *data,
+        size_t                       dataoffset,
+        size_t                       datasize,
+        int                          integrity,
+        int                          fresh,
+        int                          verbose)
+{
+    struct DataStruct datastruct;
+    datastruct.data = data;
+    datastruct.datasize = datasize;
+    datastruct.currentsize = 0;
+
+    CURL *curlhandle = curl_handle_acquire();
+
+    char errbuf[CURL_ERROR_SIZE];
+    struct RequestHeaders headers;
+    curl_readbytes_setup(curlhandle, context, &headers, &datastruct, dataoffset, integrity, verbose, errbuf);
+    curl_fresh_connect(curlhandle, fresh);
+
+    struct Crc64Header crcheader;
+    crcheader.found = 0;
+    crcheader.crc = 0;
+    if (integrity != 0) {
+        curl_easy_setopt(curlhandle, CURLOPT_HEADERFUNCTION, header_callback_crc64);
+        curl_easy_setopt(curlhandle, CURLOPT_HEADERDATA, (void*)&crcheader);
+    }
+
+    long responsecode_http = 200;
+    CURLcode responsecode_curl = curl_perform(curlhandle, &responsecode_http);
+
+    if ( (responsecode_curl != CURLE_OK || responsecode_http >= 300) && verbose > 0) {
+        printf("Error, bad read, http response code=%ld, curl response=%s\n", responsecode_http, errbuf);
+    }
+
+    if (integrity != 0 && responsecode_curl == CURLE_OK && responsecode_http < 300) {
+        if (crcheader.found == 0 || crcheader.crc != curl_crc64(0, data, datastruct.currentsize)) {
+            if (verbose > 0) {
+                printf("Warning, CRC64 of range %lu-%lu is %s.\n", (unsigned long)dataoffset, (unsigned long)(dataoffset+datasize-1), crcheader.found == 0 ? "missing" : "mismatched");
+            }
+            responsecode_curl = CRC64_MISMATCH;
+        }
+    }
+
+    curl_handle_release(curlhandle);
+
+    struct ResponseCodes responsecodes;
+    responsecodes.http = responsecode_http;
+    responsecodes.curl = (long)responsecode_curl;
+
+    return responsecodes;
+}
+
+/*
+With integrity checking, a range that is larger than CRC64_MAXIMUM_RANGE is read as a sequence of smaller ranges,
+and a range that fails verification is retried.
+*/
+struct ResponseCodes
+curl_readbytes_retry(
+        const struct RequestContext *context,
+        char                        *data,
+        size_t                       dataoffset,
+        size_t                       datasize,
+        int                          integrity,
+        int                          fresh,
+        int                          nretry,
+        int                          verbose)
+{
+    struct ResponseCodes responsecodes;
+    if (integrity != 0 && datasize > CRC64_MAXIMUM_RANGE) {
+        size_t firstbyte;
+        responsecodes.http = 200;
+        responsecodes.curl = (long)CURLE_OK;
+        for (firstbyte = 0; firstbyte < datasize; firstbyte += CRC64_MAXIMUM_RANGE) {
+            struct ResponseCodes _responsecodes = curl_readbytes_retry(context, data+firstbyte, dataoffset+firstbyte, MIN(datasize-firstbyte, CRC64_MAXIMUM_RANGE), integrity, fresh, nretry, verbose);
+            responsecodes.http = MAX(responsecodes.http, _responsecodes.http);
+            responsecodes.curl = MAX(responsecodes.curl, _responsecodes.curl);
+            if (responsecodes.http >= 300 || responsecodes.curl != CURLE_OK) {
+                break;
+            }
+        }
+        return responsecodes;
+    }
+
+    int iretry;
+    for (iretry = 0; iretry < nretry; iretry++) {
+        long generation = token_generation(context->tokenslot);
+        responsecodes = curl_readbytes(context, data, dataoffset, datasize, integrity, fresh, verbose);
+        if (curl_request_context_reauthorize(context, responsecodes, generation, verbose) == 1) {
+            continue;
+        }
+        if (isrestretrycode(responsecodes) == 0 && responsecodes.curl != CRC64_MISMATCH) {
+            break;
+        }
+        if (verbose > 0) {
+            printf("Warning, bad read, retrying, %d/%d, http responsecode=%ld, curl responsecode=%ld.\n", iretry+1, nretry, responsecodes.http, responsecodes.curl);
+        }
+        stats_retry(responsecodes.http, responsecodes.curl);
+        if (exponential_backoff(iretry) != 0) {
+            printf("Warning, exponential backoff failed\n");
+            break;
+        }
+    }
+    return responsecodes;
+}
+
+/*
+The range is cut into chunks of (about) chunksize bytes that are handed out to the threads
+dynamically, so that a slow or retried chunk only delays the thread that owns it while the
+other threads keep pulling the remaining chunks.
+*/
+struct ResponseCodes
+curl_readbytes_retry_threaded(
+        char   *token,
+        struct TokenSlot *tokenslot,
+        char   *storageaccount,
+        char   *containername,
+        char   *blobname,
+        char   *data,
+        size_t  dataoffset,
+        size_t  datasize,
+        size_t  chunksize,
+        int     nthreads,
+        struct ResponseCodes *chunkcodes,
+        int     integrity,
+        int     nretry,
+        int     verbose)
+{
+    struct RequestContext context;
+    if (curl_request_context_init(&context, token, tokenslot, storageaccount, containername, blobname) != 0) {
+        return curl_request_context_error(&context);
+    }
+
+    size_t nchunks = MAX(datasize/MAX(chunksize, 1), (size_t)nthreads);
+    size_t chunk_datasize = datasize/nchunks;
+    size_t chunk_dataremainder = datasize%nchunks;
+
+    int threadid;
+    long thread_responsecode_http[nthreads];
+    long thread_responsecode_curl[nthreads];
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        thread_responsecode_http[threadid] = 200;
+        thread_responsecode_curl[threadid] = (long)CURLE_OK;
+    }
+
+#pragma omp parallel num_threads(nthreads) default(shared)
+{
+    int threadid = omp_get_thread_num();
+    size_t ichunk;
+#pragma omp for schedule(dynamic,1)
+    for (ichunk = 0; ichunk < nchunks; ichunk++) {
+        size_t chunk_firstbyte = ichunk*chunk_datasize;
+        size_t _chunk_datasize = chunk_datasize;
+        if (ichunk < chunk_dataremainder) {
+            chunk_firstbyte += ichunk;
+            _chunk_datasize += 1;
+        } else {
+            chunk_firstbyte += chunk_dataremainder;
+        }
+
+        struct ResponseCodes responsecodes = curl_readbytes_retry(&context, data+chunk_firstbyte, dataoffset+chunk_firstbyte, _chunk_datasize, integrity, 0, nretry, verbose);
+        if (chunkcodes != NULL) {
+            chunkcodes[ichunk] = responsecodes;
+        }
+        thread_responsecode_http[threadid] = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        thread_responsecode_curl[threadid] = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+} /* end pragma omp */
+    curl_request_context_free(&context);
+    long responsecode_http = 200;
+    long responsecode_curl = (long)CURLE_OK;
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        responsecode_http = MAX(responsecode_http, thread_responsecode_http[threadid]);
+        responsecode_curl = MAX(responsecode_curl, thread_responsecode_curl[threadid]);
+    }
+    struct ResponseCodes responsecodes;
+    responsecodes.http = responsecode_http;
+    responsecodes.curl = responsecode_curl;
+
+    return responsecodes;
+}
+
+/*
+Read the bytes [dataoffset, dataoffset+datasize) of the uncompressed data of a blob that is written with a codec
+(see curl_writebytes_block_retry_threaded).  The uncompressed data (of nbytes bytes) has the block layout of
+curl_writebytes_block_retry_threaded with nblocks blocks, and block i is stored in the bytes
+[blockoffsets[i], blockoffsets[i+1]) of the blob.  Only the blocks that overlap the range are read and
+decompressed, and they are handed out to the threads dynamically.
+*/
+size_t
+codec_blockindex(
+        size_t offset,
+        size_t block_datasize,
+        size_t block_dataremainder)
+{
+    size_t n = block_dataremainder*(block_datasize+1);
+    return offset < n ? offset/(block_datasize+1) : block_dataremainder + (offset-n)/block_datasize;
+}
+
+struct ResponseCodes
+curl_readbytes_codec_threaded(
+        char         *token,
+        struct TokenSlot *tokenslot,
+        char         *storageaccount,
+        char         *containername,
+        char         *blobname,
+        char         *data,
+        size_t        dataoffset,
+        size_t        datasize,
+        size_t        nbytes,
+        int           nblocks,
+        size_t       *blockoffsets,
+        struct Codec *codec,
+        int           nthreads,
+        int           integrity,
+        int           nretry,
+        int           verbose)
+{
+    struct ResponseCodes responsecodes;
+    responsecodes.http = 200;
+    responsecodes.curl = (long)CURLE_OK;
+    if (datasize == 0) {
+        return responsecodes;
+    }
+
+    size_t block_datasize = nbytes/nblocks;
+    size_t block_dataremainder = nbytes%nblocks;
+    size_t firstblock = codec_blockindex(dataoffset, block_datasize, block_dataremainder);
+    size_t lastblock = codec_blockindex(dataoffset+datasize-1, block_datasize, block_dataremainder);
+    size_t maximum_datasize = block_datasize + (block_dataremainder > 0 ? 1 : 0);
+    size_t maximum_compressedsize = 0;
+    size_t iblock;
+    for (iblock = firstblock; iblock <= lastblock; iblock++) {
+        maximum_compressedsize = MAX(maximum_compressedsize, blockoffsets[iblock+1]-blockoffsets[iblock]);
+    }
+    nthreads = MAX(MIN((size_t)nthreads, lastblock-firstblock+1), 1);
+
+    struct RequestContext context;
+    if (curl_request_context_init(&context, token, tokenslot, storageaccount, containername, blobname) != 0) {
+        return curl_request_context_error(&context);
+    }
+
+    int threadid;
+    long thread_responsecode_http[nthreads];
+    long thread_responsecode_curl[nthreads];
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        thread_responsecode_http[threadid] = 200;
+        thread_responsecode_curl[threadid] = (long)CURLE_OK;
+    }
+
+#pragma omp parallel num_threads(nthreads) default(shared)
+{
+    int threadid = omp_get_thread_num();
+    affinity_apply();
+    char *compressed = thread_buffer(0, maximum_compressedsize);
+    char *uncompressed = thread_buffer(1, maximum_datasize);
+    char *shuffled = codec->elsize > 1 ? thread_buffer(2, maximum_datasize) : NULL;
+    int outofmemory = compressed == NULL || uncompressed == NULL || (codec->elsize > 1 && shuffled == NULL);
+    size_t iblock;
+#pragma omp for schedule(dynamic,1)
+    for (iblock = firstblock; iblock <= lastblock; iblock++) {
+        size_t block_firstbyte = iblock*block_datasize + MIN(iblock, block_dataremainder);
+        size_t _block_datasize = block_datasize + (iblock < block_dataremainder ? 1 : 0);
+        size_t compressedsize = blockoffsets[iblock+1]-blockoffsets[iblock];
+
+        if (outofmemory) {
+            printf("Error, unable to allocate the codec buffers for block %lu.\n", (unsigned long)iblock);
+            thread_responsecode_curl[threadid] = MAX((long)CURLE_OUT_OF_MEMORY, thread_responsecode_curl[threadid]);
+            continue;
+        }
+
+        struct ResponseCodes responsecodes = curl_readbytes_retry(&context, compressed, blockoffsets[iblock], compressedsize, integrity, 0, nretry, verbose);
+        if (responsecodes.http < 300 && responsecodes.curl == CURLE_OK) {
+            if (codec_decompress(codec, uncompressed, _block_datasize, shuffled, compressed, compressedsize) == 0) {
+                size_t firstbyte = MAX(block_firstbyte, dataoffset);
+                size_t lastbyte = MIN(block_firstbyte+_block_datasize, dataoffset+datasize);
+                memcpy(data+firstbyte-dataoffset, uncompressed+firstbyte-block_firstbyte, lastbyte-firstbyte);
+            } else {
+                printf("Error, unable to decompress block %lu.\n", (unsigned long)iblock);
+                responsecodes.curl = (long)CODEC_ERROR;
+            }
+        }
+        thread_responsecode_http[threadid] = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        thread_responsecode_curl[threadid] = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+    thread_buffers_done();
+} /* end pragma omp */
+    curl_request_context_free(&context);
+
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        responsecodes.http = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        responsecodes.curl = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+    return responsecodes;
+}
+
+/*
+Transfers between a blob and a file (descriptor).  For uploads, curl reads the body of each Put Block straight from the
+file (pread at the offset of the block), and, for downloads, the body of each ranged Get Blob is written straight to the
+file (pwrite at the offset of the chunk).  So, the data does not pass through an intermediate buffer, and a retry simply
+re-reads or re-writes its range of the file.
+*/
+#ifdef _WIN32
+long long
+file_pread(
+        int     fd,
+        void   *buffer,
+        size_t  n,
+        size_t  offset)
+{
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(OVERLAPPED));
+    overlapped.Offset = (DWORD)(offset & 0xffffffff);
+    overlapped.OffsetHigh = (DWORD)((unsigned long long)offset >> 32);
+    DWORD nread = 0;
+    if (ReadFile((HANDLE)_get_osfhandle(fd), buffer, (DWORD)MIN(n, (size_t)0x40000000), &nread, &overlapped) == 0) {
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    }
+    return (long long)nread;
+}
+
+long long
+file_pwrite(
+        int         fd,
+        const void *buffer,
+        size_t      n,
+        size_t      offset)
+{
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(OVERLAPPED));
+    overlapped.Offset = (DWORD)(offset & 0xffffffff);
+    overlapped.OffsetHigh = (DWORD)((unsigned long long)offset >> 32);
+    DWORD nwritten = 0;
+    if (WriteFile((HANDLE)_get_osfhandle(fd), buffer, (DWORD)MIN(n, (size_t)0x40000000), &nwritten, &overlapped) == 0) {
+        return -1;
+    }
+    return (long long)nwritten;
+}
+#else
+long long
+file_pread(
+        int     fd,
+        void   *buffer,
+        size_t  n,
+        size_t  offset)
+{
+    return (long long)pread(fd, buffer, n, (off_t)offset);
+}
+
+long long
+file_pwrite(
+        int         fd,
+        const void *buffer,
+        size_t      n,
+        size_t      offset)
+{
+    return (long long)pwrite(fd, buffer, n, (off_t)offset);
+}
+#endif
+
+struct FileStruct {
+    int    fd;
+    size_t offset;
+    size_t datasize;
+    size_t currentsize;
+};
+
+size_t
+read_callback_pread(
+        char   *ptr,
+        size_t  size,
+        size_t  nmemb,
+        void   *filevoid)
+{
+    struct FileStruct *filestruct = (struct FileStruct*)filevoid;
+    size_t n = MIN(size*nmemb, filestruct->datasize - filestruct->currentsize);
+    size_t m = 0;
+    while (m < n) {
+        long long _m = file_pread(filestruct->fd, ptr+m, n-m, filestruct->offset+filestruct->currentsize+m);
+        if (_m <= 0) {
+            printf("error: unable to read from file, %d in %s\n", __LINE__, __FILE__);
+            return CURL_READFUNC_ABORT;
+        }
+        m += (size_t)_m;
+    }
+    filestruct->currentsize += n;
+    return n;
+}
+
+/*
+rewind (or seek) the upload, so that libcurl can resend the body of a request (e.g. when a reused connection fails
+while the body is sent)
+*/
+int
+seek_callback_pread(
+        void       *filevoid,
+        curl_off_t  offset,
+        int         origin)
+{
+    struct FileStruct *filestruct = (struct FileStruct*)filevoid;
+    if (origin != SEEK_SET || offset < 0 || (size_t)offset > filestruct->datasize) {
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+    filestruct->currentsize = (size_t)offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+size_t
+write_callback_pwrite(
+        char   *ptr,
+        size_t  size,
+        size_t  nmemb,
+        void   *filevoid)
+{
+    struct FileStruct *filestruct = (struct FileStruct*)filevoid;
+    size_t n = size*nmemb;
+    if (filestruct->currentsize + n > filestruct->datasize) {
+        printf("error: read too many bytes, %d in %s\n", __LINE__, __FILE__);
+        return 0;
+    }
+    size_t m = 0;
+    while (m < n) {
+        long long _m = file_pwrite(filestruct->fd, ptr+m, n-m, filestruct->offset+filestruct->currentsize+m);
+        if (_m <= 0) {
+            printf("error: unable to write to file, %d in %s\n", __LINE__, __FILE__);
+            return 0;
+        }
+        m += (size_t)_m;
+    }
+    filestruct->currentsize += n;
+    return n;
+}
+
+struct ResponseCodes
+curl_writebytes_block_fd(
+        const struct RequestContext *context,
+        char                        *blockid,
+        int                          fd,
+        size_t                       fileoffset,
+        size_t                       datasize,
+        int                          fresh,
+        int                          verbose)
+{
+    struct FileStruct filestruct;
+    filestruct.fd = fd;
+    filestruct.offset = fileoffset;
+    filestruct.datasize = datasize;
+    filestruct.currentsize = 0;
+
+    CURL *curlhandle = curl_handle_acquire();
+
+    char errbuf[CURL_ERROR_SIZE];
+    struct RequestHeaders headers;
+    curl_putblock_setup(curlhandle, context, &headers, blockid, datasize, NULL, verbose, errbuf);
+    curl_easy_setopt(curlhandle, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(curlhandle, CURLOPT_INFILESIZE_LARGE, (curl_off_t)datasize);
+    curl_easy_setopt(curlhandle, CURLOPT_READFUNCTION, read_callback_pread);
+    curl_easy_setopt(curlhandle, CURLOPT_READDATA, (void*)&filestruct);
+    curl_easy_setopt(curlhandle, CURLOPT_SEEKFUNCTION, seek_callback_pread);
+    curl_easy_setopt(curlhandle, CURLOPT_SEEKDATA, (void*)&filestruct);
+    curl_fresh_connect(curlhandle, fresh);
+
+    long responsecode_http = 200;
+    CURLcode responsecode_curl = curl_perform(curlhandle, &responsecode_http);
+
+    if ( (responsecode_curl != CURLE_OK || responsecode_http >= 300) && verbose > 0) {
+        printf("Warning, curl response=%s, http response code=%ld\n", errbuf, responsecode_http);
+    }
+
+    curl_handle_release(curlhandle);
+
+    struct ResponseCodes responsecodes;
+    responsecodes.http = responsecode_http;
+    responsecodes.curl = (long)responsecode_curl;
+
+    return responsecodes;
+}
+
+struct ResponseCodes
+curl_writebytes_block_fd_retry(
+        const struct RequestContext *context,
+        char                        *blockid,
+        int                          fd,
+        size_t                       fileoffset,
+        size_t                       datasize,
+        int                          fresh,
+        int                          nretry,
+        int                          verbose)
+{
+    int iretry;
+    struct ResponseCodes responsecodes;
+    for (iretry = 0; iretry < nretry; iretry++) {
+        long generation = token_generation(context->tokenslot);
+        responsecodes = curl_writebytes_block_fd(context, blockid, fd, fileoffset, datasize, fresh, verbose);
+        if (curl_request_context_reauthorize(context, responsecodes, generation, verbose) == 1) {
+            continue;
+        }
+        if (isrestretrycode(responsecodes) == 0) {
+            break;
+        }
+        if (verbose > 0) {
+            printf("Warning, bad write, retrying, %d/%d, http_responsecode=%ld, curl_responsecode=%ld.\n", iretry+1, nretry, responsecodes.http, responsecodes.curl);
+        }
+        stats_retry(responsecodes.http, responsecodes.curl);
+        if (exponential_backoff(iretry) != 0) {
+            printf("Warning, unable to sleep in exponential backoff due to failed nanosleep call.\n");
+            break;
+        }
+    }
+    return responsecodes;
+}
+
+/*
+Upload the datasize bytes of the file fd as nblocks blocks (with the block layout of curl_writebytes_block_retry_threaded).
+tokenslot may be NULL.
+*/
+struct ResponseCodes
+curl_writebytes_block_fd_threaded(
+        char    *token,
+        struct TokenSlot *tokenslot,
+        char    *storageaccount,
+        char    *containername,
+        char    *blobname,
+        char   **blockids,
+        int      fd,
+        size_t   datasize,
+        int      nthreads,
+        int      nblocks,
+        char    *skip,
+        struct ResponseCodes *blockcodes,
+        int      fresh,
+        int      nretry,
+        int      verbose)
+{
+    struct RequestContext context;
+    if (curl_request_context_init(&context, token, tokenslot, storageaccount, containername, blobname) != 0) {
+        return curl_request_context_error(&context);
+    }
+
+    size_t block_datasize = datasize/nblocks;
+    size_t block_dataremainder = datasize%nblocks;
+
+    int threadid;
+    long thread_responsecode_http[nthreads];
+    long thread_responsecode_curl[nthreads];
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        thread_responsecode_http[threadid] = 200;
+        thread_responsecode_curl[threadid] = (long)CURLE_OK;
+    }
+
+#pragma omp parallel num_threads(nthreads) default(shared)
+{
+    int threadid = omp_get_thread_num();
+    int iblock;
+#pragma omp for schedule(dynamic,1)
+    for (iblock = 0; iblock < nblocks; iblock++) {
+        struct ResponseCodes responsecodes;
+        if (skip != NULL && skip[iblock] != 0) {
+            responsecodes.http = 200;
+            responsecodes.curl = (long)CURLE_OK;
+        } else {
+            size_t block_firstbyte = iblock*block_datasize + MIN((size_t)iblock, block_dataremainder);
+            size_t _block_datasize = block_datasize + ((size_t)iblock < block_dataremainder ? 1 : 0);
+            responsecodes = curl_writebytes_block_fd_retry(&context, blockids[iblock], fd, block_firstbyte, _block_datasize, fresh, nretry, verbose);
+        }
+        if (blockcodes != NULL) {
+            blockcodes[iblock] = responsecodes;
+        }
+        thread_responsecode_http[threadid] = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        thread_responsecode_curl[threadid] = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+} // end #pragma omp
+    curl_request_context_free(&context);
+
+    struct ResponseCodes responsecodes;
+    responsecodes.http = (long)200;
+    responsecodes.curl = (long)CURLE_OK;
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        responsecodes.http = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        responsecodes.curl = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+    return responsecodes;
+}
+
+struct ResponseCodes
+curl_readbytes_fd(
+        const struct RequestContext *context,
+        int                          fd,
+        size_t                       fileoffset,
+        size_t                       dataoffset,
+        size_t                       datasize,
+        int                          fresh,
+        int                          verbose)
+{
+    struct FileStruct filestruct;
+    filestruct.fd = fd;
+    filestruct.offset = fileoffset;
+    filestruct.datasize = datasize;
+    filestruct.currentsize = 0;
+
+    CURL *curlhandle = curl_handle_acquire();
+
+    char errbuf[CURL_ERROR_SIZE];
+    struct RequestHeaders headers;
+    curl_readrange_setup(curlhandle, context, &headers, dataoffset, datasize, 0, write_callback_pwrite, (void*)&filestruct, verbose, errbuf);
+    curl_fresh_connect(curlhandle, fresh);
+
+    long responsecode_http = 200;
+    CURLcode responsecode_curl = curl_perform(curlhandle, &responsecode_http);
+
+    if ( (responsecode_curl != CURLE_OK || responsecode_http >= 300) && verbose > 0) {
+        printf("Error, bad read, http response code=%ld, curl response=%s\n", responsecode_http, errbuf);
+    }
+
+    curl_handle_release(curlhandle);
+
+    struct ResponseCodes responsecodes;
+    responsecodes.http = responsecode_http;
+    responsecodes.curl = (long)responsecode_curl;
+
+    return responsecodes;
+}
+
+struct ResponseCodes
+curl_readbytes_fd_retry(
+        const struct RequestContext *context,
+        int                          fd,
+        size_t                       fileoffset,
+        size_t                       dataoffset,
+        size_t                       datasize,
+        int                          fresh,
+        int                          nretry,
+        int                          verbose)
+{
+    struct ResponseCodes responsecodes;
+    int iretry;
+    for (iretry = 0; iretry < nretry; iretry++) {
+        long generation = token_generation(context->tokenslot);
+        responsecodes = curl_readbytes_fd(context, fd, fileoffset, dataoffset, datasize, fresh, verbose);
+        if (curl_request_context_reauthorize(context, responsecodes, generation, verbose) == 1) {
+            continue;
+        }
+        if (isrestretrycode(responsecodes) == 0) {
+            break;
+        }
+        if (verbose > 0) {
+            printf("Warning, bad read, retrying, %d/%d, http responsecode=%ld, curl responsecode=%ld.\n", iretry+1, nretry, responsecodes.http, responsecodes.curl);
+        }
+        stats_retry(responsecodes.http, responsecodes.curl);
+        if (exponential_backoff(iretry) != 0) {
+            printf("Warning, exponential backoff failed\n");
+            break;
+        }
+    }
+    return responsecodes;
+}
+
+/*
+Download the datasize bytes of the blob to the file fd, in chunks (with the chunk layout of curl_readbytes_retry_threaded)
+that the threads pull dynamically.  The chunks with a non-zero skip are not downloaded.  tokenslot may be NULL.
+*/
+struct ResponseCodes
+curl_readbytes_fd_threaded(
+        char   *token,
+        struct TokenSlot *tokenslot,
+        char   *storageaccount,
+        char   *containername,
+        char   *blobname,
+        int     fd,
+        size_t  datasize,
+        size_t  chunksize,
+        int     nthreads,
+        char   *skip,
+        struct ResponseCodes *chunkcodes,
+        int     fresh,
+        int     nretry,
+        int     verbose)
+{
+    struct RequestContext context;
+    if (curl_request_context_init(&context, token, tokenslot, storageaccount, containername, blobname) != 0) {
+        return curl_request_context_error(&context);
+    }
+
+    size_t nchunks = MAX(datasize/MAX(chunksize, 1), (size_t)nthreads);
+    size_t chunk_datasize = datasize/nchunks;
+    size_t chunk_dataremainder = datasize%nchunks;
+
+    int threadid;
+    long thread_responsecode_http[nthreads];
+    long thread_responsecode_curl[nthreads];
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        thread_responsecode_http[threadid] = 200;
+        thread_responsecode_curl[threadid] = (long)CURLE_OK;
+    }
+
+#pragma omp parallel num_threads(nthreads) default(shared)
+{
+    int threadid = omp_get_thread_num();
+    size_t ichunk;
+#pragma omp for schedule(dynamic,1)
+    for (ichunk = 0; ichunk < nchunks; ichunk++) {
+        struct ResponseCodes responsecodes;
+        if (skip != NULL && skip[ichunk] != 0) {
+            responsecodes.http = 200;
+            responsecodes.curl = (long)CURLE_OK;
+        } else {
+            size_t chunk_firstbyte = ichunk*chunk_datasize + MIN(ichunk, chunk_dataremainder);
+            size_t _chunk_datasize = chunk_datasize + (ichunk < chunk_dataremainder ? 1 : 0);
+            responsecodes = curl_readbytes_fd_retry(&context, fd, chunk_firstbyte, chunk_firstbyte, _chunk_datasize, fresh, nretry, verbose);
+        }
+        if (chunkcodes != NULL) {
+            chunkcodes[ichunk] = responsecodes;
+        }
+        thread_responsecode_http[threadid] = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        thread_responsecode_curl[threadid] = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+} /* end pragma omp */
+    curl_request_context_free(&context);
+
+    struct ResponseCodes responsecodes;
+    responsecodes.http = 200;
+    responsecodes.curl = (long)CURLE_OK;
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        responsecodes.http = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        responsecodes.curl = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+    return responsecodes;
+}
+
+/*
+Server-side copy.  Each block of the destination is filled by the service from a byte range of the source blob with Put
+Block From URL, so that the data does not pass through this host.  copysource is the url of the source blob, and the
+token that authorizes the service to read it is held by the token slot (see token_slot_new), so that it is refreshed
+with the token of the destination.  The copy-source header is built once per transfer, and is shared by all requests.
+*/
+struct CopySource {
+    char *copysource;
+};
+
+int
+curl_copysource_init(
+        struct CopySource *source,
+        char              *copysource)
+{
+    size_t n = strlen(copysource) + 32;
+    source->copysource = (char*)malloc(n);
+    if (source->copysource != NULL) {
+        snprintf(source->copysource, n, "x-ms-copy-source: %s", copysource);
+    }
+    return source->copysource == NULL ? -1 : 0;
+}
+
+void
+curl_copysource_free(
+        struct CopySource *source)
+{
+    free(source->copysource);
+    source->copysource = NULL;
+}
+
+void
+curl_copyblock_setup(
+        CURL                        *curlhandle,
+        const struct RequestContext *context,
+        struct RequestHeaders       *headers,
+        const struct CopySource     *source,
+        char                        *blockid,
+        size_t                       sourceoffset,
+        size_t                       datasize,
+        int                          verbose,
+        char                        *errbuf)
+{
+    headers->n = 0;
+    curl_contentlength(headers, 0);
+    request_header(headers, source->copysource);
+    snprintf(request_header(headers, NULL), REQUEST_HEADER_SIZE, "x-ms-source-range: bytes=%lu-%lu", (unsigned long)sourceoffset, (unsigned long)(sourceoffset+datasize-1));
+
+    char url[context->urlsize + strlen(blockid) + 32];
+    snprintf(url, sizeof(url), "%s?comp=block&blockid=%s", context->url, blockid);
+
+    curl_easy_setopt(curlhandle, CURLOPT_URL, url);
+    curl_easy_setopt(curlhandle, CURLOPT_HTTPHEADER, request_headers_link(headers, context));
+    curl_easy_setopt(curlhandle, CURLOPT_CUSTOMREQUEST, "PUT");
+    curl_easy_setopt(curlhandle, CURLOPT_POSTFIELDSIZE, 0L);
+    curl_easy_setopt(curlhandle, CURLOPT_POSTFIELDS, "");
+    curl_easy_setopt(curlhandle, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(curlhandle, CURLOPT_VERBOSE, (long)verbose);
+    curl_easy_setopt(curlhandle, CURLOPT_TIMEOUT, CURLE_TIMEOUT);
+    curl_easy_setopt(curlhandle, CURLOPT_WRITEFUNCTION, write_callback_null);
+    curl_easy_setopt(curlhandle, CURLOPT_ERRORBUFFER, errbuf);
+}
+
+struct ResponseCodes
+curl_copyblock(
+        const struct RequestContext *context,
+        const struct CopySource     *source,
+        char                        *blockid,
+        size_t                       sourceoffset,
+        size_t                       datasize,
+        int                          fresh,
+        int                          verbose)
+{
+    CURL *curlhandle = curl_handle_acquire();
+
+    char errbuf[CURL_ERROR_SIZE];
+    struct RequestHeaders headers;
+    curl_copyblock_setup(curlhandle, context, &headers, source, blockid, sourceoffset, datasize, verbose, errbuf);
+    curl_fresh_connect(curlhandle, fresh);
+
+    long responsecode_http = 200;
+    CURLcode responsecode_curl = curl_perform(curlhandle, &responsecode_http);
+
+    if ( (responsecode_curl != CURLE_OK || responsecode_http >= 300) && verbose > 0) {
+        printf("Warning, curl response=%s, http response code=%ld\n", errbuf, responsecode_http);
+    }
+
+    curl_handle_release(curlhandle);
+
+    struct ResponseCodes responsecodes;
+    responsecodes.http = responsecode_http;
+    responsecodes.curl = (long)responsecode_curl;
+
+    return responsecodes;
+}
+
+struct ResponseCodes
+curl_copyblock_retry(
+        const struct RequestContext *context,
+        const struct CopySource     *source,
+        char                        *blockid,
+        size_t                       sourceoffset,
+        size_t                       datasize,
+        int                          fresh,
+        int                          nretry,
+        int                          verbose)
+{
+    int iretry;
+    struct ResponseCodes responsecodes;
+    for (iretry = 0; iretry < nretry; iretry++) {
+        long generation = token_generation(context->tokenslot);
+        responsecodes = curl_copyblock(context, source, blockid, sourceoffset, datasize, fresh, verbose);
+        if (curl_request_context_reauthorize(context, responsecodes, generation, verbose) == 1) {
+            continue;
+        }
+        if (isrestretrycode(responsecodes) == 0) {
+            break;
+        }
+        if (verbose > 0) {
+            printf("Warning, bad copy, retrying, %d/%d, http_responsecode=%ld, curl_responsecode=%ld.\n", iretry+1, nretry, responsecodes.http, responsecodes.curl);
+        }
+        stats_retry(responsecodes.http, responsecodes.curl);
+        if (exponential_backoff(iretry) != 0) {
+            printf("Warning, unable to sleep in exponential backoff due to failed nanosleep call.\n");
+            break;
+        }
+    }
+    return responsecodes;
+}
+
+/*
+Copy the datasize bytes of the source blob into the nblocks (uncommitted) blocks of blobname, with the block layout of
+curl_writebytes_block_retry_threaded.  The blocks are committed by the caller (Put Block List).  tokenslot may be NULL, in
+which case the requests use token and sourcetoken (which is NULL or empty for a public source), and otherwise the tokens
+of the slot (see curl_token_new).
+*/
+struct ResponseCodes
+curl_copyblocks_threaded(
+        char    *token,
+        struct TokenSlot *tokenslot,
+        char    *storageaccount,
+        char    *containername,
+        char    *blobname,
+        char   **blockids,
+        char    *copysource,
+        char    *sourcetoken,
+        size_t   datasize,
+        int      nthreads,
+        int      nblocks,
+        char    *skip,
+        struct ResponseCodes *blockcodes,
+        int      fresh,
+        int      nretry,
+        int      verbose)
+{
+    struct TokenSlot *slot = tokenslot == NULL ? token_slot_new(token, sourcetoken, 0) : tokenslot;
+    struct RequestContext context;
+    int status = curl_request_context_init(&context, token, slot, storageaccount, containername, blobname);
+    if (tokenslot == NULL && slot != NULL) {
+        context.owntokenslot = 1;
+    }
+    if (status != 0 || slot == NULL) {
+        return curl_request_context_error(&context);
+    }
+    struct CopySource source;
+    if (curl_copysource_init(&source, copysource) != 0) {
+        curl_copysource_free(&source);
+        return curl_request_context_error(&context);
+    }
+
+    size_t block_datasize = datasize/nblocks;
+    size_t block_dataremainder = datasize%nblocks;
+
+    int threadid;
+    long thread_responsecode_http[nthreads];
+    long thread_responsecode_curl[nthreads];
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        thread_responsecode_http[threadid] = 200;
+        thread_responsecode_curl[threadid] = (long)CURLE_OK;
+    }
+
+#pragma omp parallel num_threads(nthreads) default(shared)
+{
+    int threadid = omp_get_thread_num();
+    int iblock;
+#pragma omp for schedule(dynamic,1)
+    for (iblock = 0; iblock < nblocks; iblock++) {
+        struct ResponseCodes responsecodes;
+        if (skip != NULL && skip[iblock] != 0) {
+            responsecodes.http = 200;
+            responsecodes.curl = (long)CURLE_OK;
+        } else {
+            size_t block_firstbyte = iblock*block_datasize + MIN((size_t)iblock, block_dataremainder);
+            size_t _block_datasize = block_datasize + ((size_t)iblock < block_dataremainder ? 1 : 0);
+            responsecodes = curl_copyblock_retry(&context, &source, blockids[iblock], block_firstbyte, _block_datasize, fresh, nretry, verbose);
+        }
+        if (blockcodes != NULL) {
+            blockcodes[iblock] = responsecodes;
+        }
+        thread_responsecode_http[threadid] = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        thread_responsecode_curl[threadid] = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+} /* end pragma omp */
+    curl_copysource_free(&source);
+    curl_request_context_free(&context);
+
+    struct ResponseCodes responsecodes;
+    responsecodes.http = 200;
+    responsecodes.curl = (long)CURLE_OK;
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        responsecodes.http = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        responsecodes.curl = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+    return responsecodes;
+}
+
+/*
+Event driven engine built on curl_multi.  Each driver thread owns one multi handle and a set
+of slots (easy handles) that it keeps busy by pulling work items from a shared counter.  The
+number of requests in flight is therefore set by nrequests rather than by the number of
+threads.  A retryable failure puts its slot into a back-off state rather than sleeping, so
+the other transfers on the thread keep making progress.
+*/
+#define MULTI_SLOT_IDLE 0
+#define MULTI_SLOT_ACTIVE 1
+#define MULTI_SLOT_BACKOFF 2
+#define MULTI_SLOT_FINISHED 3
+#define MULTI_MAXIMUM_POLL 1.0 /* seconds */
+
+struct MultiSlot {
+    CURL                  *curlhandle;
+    struct RequestHeaders  headers;
+    struct DataStruct      datastruct;
+    char                   errbuf[CURL_ERROR_SIZE];
+    size_t                 item;
+    int                    iretry;
+    int                    state;
+    double                 notbefore;
+};
+
+typedef void (*multi_setup_callback)(CURL *curlhandle, struct MultiSlot *slot, void *userdata);
+
+int
+curl_multi_slot_start(
+        CURLM                *multihandle,
+        struct MultiSlot     *slot,
+        multi_setup_callback  setup,
+        void                 *userdata,
+        int                   multiplex)
+{
+    curl_easy_reset(slot->curlhandle);
+    setup(slot->curlhandle, slot, userdata);
+    curl_easy_setopt(slot->curlhandle, CURLOPT_PRIVATE, (void*)slot);
+    if (multiplex > 0) {
+        curl_easy_setopt(slot->curlhandle, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+        curl_easy_setopt(slot->curlhandle, CURLOPT_PIPEWAIT, 1L);
+    }
+    if (curl_multi_add_handle(multihandle, slot->curlhandle) != CURLM_OK) {
+        return -1;
+    }
+    slot->state = MULTI_SLOT_ACTIVE;
+    return 0;
+}
+
+struct ResponseCodes
+curl_multi_driver(
+        size_t                nitems,
+        size_t               *nextitem,
+        int                   nslots,
+        multi_setup_callback  setup,
+        void                 *userdata,
+        int                   multiplex,
+        struct TokenSlot     *tokenslot,
+        int                   nretry,
+        int                   verbose)
+{
+    struct ResponseCodes responsecodes;
+    responsecodes.http = 200;
+    responsecodes.curl = (long)CURLE_OK;
+
+    CURLM *multihandle = curl_multi_init();
+    struct MultiSlot *slots = (struct MultiSlot*)malloc(nslots*sizeof(struct MultiSlot));
+    int islot;
+    int nhandles = 0;
+    if (slots != NULL) {
+        for (nhandles = 0; nhandles < nslots; nhandles++) {
+            slots[nhandles].curlhandle = curl_handle_acquire();
+            if (slots[nhandles].curlhandle == NULL) {
+                break;
+            }
+            slots[nhandles].state = MULTI_SLOT_IDLE;
+        }
+    }
+    if (multihandle == NULL || slots == NULL || nhandles < nslots) {
+        printf("Error, unable to allocate the curl_multi driver.\n");
+        for (islot = 0; islot < nhandles; islot++) {
+            curl_handle_release(slots[islot].curlhandle);
+        }
+        free(slots);
+        if (multihandle != NULL) {
+            curl_multi_cleanup(multihandle);
+        }
+        responsecodes.curl = (long)CURLE_OUT_OF_MEMORY;
+        return responsecodes;
+    }
+    if (multiplex > 0) {
+        curl_multi_setopt(multihandle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    }
+
+    while (1) {
+        double now = walltime();
+        double timeout = MULTI_MAXIMUM_POLL;
+        int nbusy = 0;
+        for (islot = 0; islot < nslots; islot++) {
+            struct MultiSlot *slot = &slots[islot];
+            if (slot->state == MULTI_SLOT_IDLE) {
+                size_t item;
+#pragma omp atomic capture
+                item = (*nextitem)++;
+                if (item >= nitems) {
+                    slot->state = MULTI_SLOT_FINISHED;
+                    continue;
+                }
+                slot->item = item;
+                slot->iretry = 0;
+                slot->notbefore = now;
+                slot->state = MULTI_SLOT_BACKOFF;
+            }
+            if (slot->state == MULTI_SLOT_BACKOFF) {
+                if (now >= slot->notbefore && rate_tryacquire() == 1) {
+                    if (curl_multi_slot_start(multihandle, slot, setup, userdata, multiplex) != 0) {
+                        /* the request is not in flight, so it is retried after a backoff, or counted as failed */
+                        rate_cancel();
+                        if (slot->iretry+1 < nretry) {
+                            slot->notbefore = now + backoff_time(slot->iretry);
+                            slot->iretry++;
+                            timeout = MIN(timeout, slot->notbefore - now);
+                        } else {
+                            printf("Error, unable to start a transfer on the curl_multi handle.\n");
+                            responsecodes.curl = MAX(responsecodes.curl, (long)CURLE_FAILED_INIT);
+                            slot->state = MULTI_SLOT_IDLE;
+                            nbusy++; /* the slot takes the next item on the next pass */
+                        }
+                    }
+                } else {
+                    if (now >= slot->notbefore) {
+                        slot->notbefore = now + rate_delay();
+                    }
+                    timeout = MIN(timeout, slot->notbefore - now);
+                }
+            }
+            if (slot->state == MULTI_SLOT_ACTIVE || slot->state == MULTI_SLOT_BACKOFF) {
+                nbusy++;
+            }
+        }
+        if (nbusy == 0) {
+            break;
+        }
+
+        int nrunning;
+        curl_multi_poll(multihandle, NULL, 0, (int)(timeout*1000.0), NULL);
+        curl_multi_perform(multihandle, &nrunning);
+
+        int nmessages;
+        CURLMsg *message;
+        while ((message = curl_multi_info_read(multihandle, &nmessages)) != NULL) {
+            if (message->msg != CURLMSG_DONE) {
+                continue;
+            }
+            struct MultiSlot *slot;
+            curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char**)&slot);
+
+            struct ResponseCodes _responsecodes;
+            _responsecodes.http = 200;
+            _responsecodes.curl = (long)message->data.result;
+            curl_easy_getinfo(slot->curlhandle, CURLINFO_RESPONSE_CODE, &_responsecodes.http);
+            rate_release(slot->curlhandle, _responsecodes.http);
+            stats_request(slot->curlhandle);
+
+            curl_multi_remove_handle(multihandle, slot->curlhandle);
+
+            /* a request that is rejected with a refreshable token is retried once the backoff (during which the token
+               is refreshed) is over */
+            int reauthorize = tokenslot->refreshable != 0 && isauthcode(_responsecodes) == 1 ? 1 : 0;
+            if (reauthorize == 1) {
+                token_mark_stale(tokenslot);
+            }
+            if ((isrestretrycode(_responsecodes) == 1 || reauthorize == 1) && slot->iretry+1 < nretry) {
+                if (verbose > 0) {
+                    printf("Warning, bad transfer, retrying, %d/%d, http responsecode=%ld, curl responsecode=%ld.\n", slot->iretry+1, nretry, _responsecodes.http, _responsecodes.curl);
+                }
+                double sleeptime = backoff_time(slot->iretry);
+                stats_retry(_responsecodes.http, _responsecodes.curl);
+                stats_add(STATS_BACKOFF, (long)(sleeptime*1000000.0));
+                slot->notbefore = walltime() + sleeptime;
+                slot->iretry++;
+                slot->state = MULTI_SLOT_BACKOFF;
+            } else {
+                if ( (_responsecodes.curl != CURLE_OK || _responsecodes.http >= 300) && verbose > 0) {
+                    printf("Error, bad transfer, http response code=%ld, curl response=%s\n", _responsecodes.http, slot->errbuf);
+                }
+                responsecodes.http = MAX(responsecodes.http, _responsecodes.http);
+                responsecodes.curl = MAX(responsecodes.curl, _responsecodes.curl);
+                slot->state = MULTI_SLOT_IDLE;
+            }
+        }
+    }
+
+    for (islot = 0; islot < nslots; islot++) {
+        curl_handle_release(slots[islot].curlhandle);
+    }
+    free(slots);
+    curl_multi_cleanup(multihandle);
+
+    return responsecodes;
+}
+
+struct ResponseCodes
+curl_multi_threaded(
+        size_t                nitems,
+        multi_setup_callback  setup,
+        void                 *userdata,
+        int                   nthreads,
+        int                   nrequests,
+        int                   multiplex,
+        struct TokenSlot     *tokenslot,
+        int                   nretry,
+        int                   verbose)
+{
+    nthreads = MAX(MIN(nthreads, nrequests), 1);
+    size_t nextitem = 0;
+
+    int threadid;
+    long thread_responsecode_http[nthreads];
+    long thread_responsecode_curl[nthreads];
+
+#pragma omp parallel num_threads(nthreads) default(shared)
+{
+    int threadid = omp_get_thread_num();
+    int nslots = nrequests/nthreads + (threadid < nrequests%nthreads ? 1 : 0);
+    struct ResponseCodes responsecodes = curl_multi_driver(nitems, &nextitem, nslots, setup, userdata, multiplex, tokenslot, nretry, verbose);
+    thread_responsecode_http[threadid] = responsecodes.http;
+    thread_responsecode_curl[threadid] = responsecodes.curl;
+} /* end pragma omp */
+
+    struct ResponseCodes responsecodes;
+    responsecodes.http = 200;
+    responsecodes.curl = (long)CURLE_OK;
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        responsecodes.http = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        responsecodes.curl = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+    return responsecodes;
+}
+
+struct MultiReadContext {
+    struct RequestContext  request;
+    char                  *data;
+    size_t                 dataoffset;
+    size_t                 chunk_datasize;
+    size_t                 chunk_dataremainder;
+    int                    verbose;
+};
+
+void
+curl_readbytes_multi_setup(
+        CURL             *curlhandle,
+        struct MultiSlot *slot,
+        void             *userdata)
+{
+    struct MultiReadContext *context = (struct MultiReadContext*)userdata;
+    size_t ichunk = slot->item;
+    size_t chunk_firstbyte = ichunk*context->chunk_datasize;
+    size_t _chunk_datasize = context->chunk_datasize;
+    if (ichunk < context->chunk_dataremainder) {
+        chunk_firstbyte += ichunk;
+        _chunk_datasize += 1;
+    } else {
+        chunk_firstbyte += context->chunk_dataremainder;
+    }
+
+    slot->datastruct.data = context->data + chunk_firstbyte;
+    slot->datastruct.datasize = _chunk_datasize;
+    slot->datastruct.currentsize = 0;
+
+    curl_readbytes_setup(curlhandle, &context->request, &slot->headers, &slot->datastruct, context->dataoffset+chunk_firstbyte, 0, context->verbose, slot->errbuf);
+}
+
+struct ResponseCodes
+curl_readbytes_multi(
+        char   *token,
+        struct TokenSlot *tokenslot,
+        char   *storageaccount,
+        char   *containername,
+        char   *blobname,
+        char   *data,
+        size_t  dataoffset,
+        size_t  datasize,
+        size_t  chunksize,
+        int     nthreads,
+        int     nrequests,
+        int     multiplex,
+        int     nretry,
+        int     verbose)
+{
+    size_t nchunks = MAX(datasize/MAX(chunksize, 1), 1);
+
+    struct MultiReadContext context;
+    if (curl_request_context_init(&context.request, token, tokenslot, storageaccount, containername, blobname) != 0) {
+        return curl_request_context_error(&context.request);
+    }
+    context.data = data;
+    context.dataoffset = dataoffset;
+    context.chunk_datasize = datasize/nchunks;
+    context.chunk_dataremainder = datasize%nchunks;
+    context.verbose = verbose;
+
+    struct ResponseCodes responsecodes = curl_multi_threaded(nchunks, curl_readbytes_multi_setup, (void*)&context, nthreads, nrequests, multiplex, context.request.tokenslot, nretry, verbose);
+    curl_request_context_free(&context.request);
+    return responsecodes;
+}
+
+struct MultiWriteContext {
+    struct RequestContext   request;
+    char                  **blockids;
+    char                   *data;
+    size_t                  block_datasize;
+    size_t                  block_dataremainder;
+    size_t                 *items;
+    uint64_t               *blockcrcs;
+    int                     verbose;
+};
+
+void
+curl_writebytes_block_multi_setup(
+        CURL             *curlhandle,
+        struct MultiSlot *slot,
+        void             *userdata)
+{
+    struct MultiWriteContext *context = (struct MultiWriteContext*)userdata;
+    size_t iblock = context->items == NULL ? slot->item : context->items[slot->item];
+    size_t block_firstbyte = iblock*context->block_datasize;
+    size_t _block_datasize = context->block_datasize;
+    if (iblock < context->block_dataremainder) {
+        block_firstbyte += iblock;
+        _block_datasize += 1;
+    } else {
+        block_firstbyte += context->block_dataremainder;
+    }
+
+    uint64_t *crc = NULL;
+    if (context->blockcrcs != NULL) {
+        crc = &(context->blockcrcs[iblock]);
+        if (slot->iretry == 0) {
+            *crc = curl_crc64(0, context->data+block_firstbyte, _block_datasize);
+        }
+    }
+
+    curl_writebytes_block_setup(curlhandle, &context->request, &slot->headers, context->blockids[iblock], context->data+block_firstbyte, _block_datasize, crc, context->verbose, slot->errbuf);
+}
+
+struct ResponseCodes
+curl_writebytes_block_multi(
+        char    *token,
+        struct TokenSlot *tokenslot,
+        char    *storageaccount,
+        char    *containername,
+        char    *blobname,
+        char   **blockids,
+        char    *data,
+        size_t   datasize,
+        int      nthreads,
+        int      nblocks,
+        char    *skip,
+        uint64_t *blockcrcs,
+        int      nrequests,
+        int      multiplex,
+        int      nretry,
+        int      verbose)
+{
+    struct MultiWriteContext context;
+    if (curl_request_context_init(&context.request, token, tokenslot, storageaccount, containername, blobname) != 0) {
+        return curl_request_context_error(&context.request);
+    }
+    context.blockids = blockids;
+    context.data = data;
+    context.block_datasize = datasize/nblocks;
+    context.block_dataremainder = datasize%nblocks;
+    context.items = NULL;
+    context.blockcrcs = blockcrcs;
+    context.verbose = verbose;
+
+    /* the blocks that are not skipped are mapped to a contiguous range of work items */
+    size_t nitems = (size_t)nblocks;
+    if (skip != NULL) {
+        size_t iblock;
+        context.items = (size_t*)malloc(nblocks*sizeof(size_t));
+        nitems = 0;
+        for (iblock = 0; iblock < (size_t)nblocks; iblock++) {
+            if (skip[iblock] == 0) {
+                context.items[nitems++] = iblock;
+            } else if (blockcrcs != NULL) {
+                size_t block_firstbyte = iblock*context.block_datasize + MIN(iblock, context.block_dataremainder);
+                size_t _block_datasize = context.block_datasize + (iblock < context.block_dataremainder ? 1 : 0);
+                blockcrcs[iblock] = curl_crc64(0, data+block_firstbyte, _block_datasize);
+            }
+        }
+    }
+
+    struct ResponseCodes responsecodes;
+    responsecodes.http = 200;
+    responsecodes.curl = (long)CURLE_OK;
+    if (nitems > 0) {
+        responsecodes = curl_multi_threaded(nitems, curl_writebytes_block_multi_setup, (void*)&context, nthreads, nrequests, multiplex, context.request.tokenslot, nretry, verbose);
+    }
+    free(context.items);
+    curl_request_context_free(&context.request);
+    return responsecodes;
+}
+
+/*
+Asynchronous transfers.  The transfer is queued to a pool of long-lived driver (p)threads, and runs on one of them,
+using either the OpenMP or the curl_multi engine, and the caller is signaled on completion through the notify callback
+(e.g. uv_async_send with a libuv async handle) so that it does not need to block a thread while waiting.  A driver is
+only started when no driver is idle, and the drivers are never torn down, so that the OpenMP team of a driver (and
+with it the per-thread scratch buffers, pinning and statistics of its threads) is reused by the following transfers.
+The strings (and the codec) are copied so that the caller does not need to keep them alive, but the caller owns the
+other arrays (skip, response codes, CRCs and block offsets), the file descriptor and the token slot, which must outlive
+the transfer.  The synchronous threaded transfers of the Julia layer also run this way, so that Julia can refresh the
+token slot while the transfer runs.
+*/
+#define ASYNC_READ 0
+#define ASYNC_WRITE 1
+#define ASYNC_READ_FD 2
+#define ASYNC_WRITE_FD 3
+#define ASYNC_READ_CODEC 4
+#define ASYNC_COPY 5
+
+typedef int (*notify_callback)(void *notifyarg);
+
+struct AsyncTransfer {
+    struct AsyncTransfer *next;
+    int                   kind;
+    char                 *token;
+    struct TokenSlot     *tokenslot;
+    char                 *storageaccount;
+    char                 *containername;
+    char                 *blobname;
+    char                **blockids;
+    int                   nblocks;
+    char                 *data;
+    size_t                dataoffset;
+    size_t                datasize;
+    size_t                chunksize;
+    int                   fd;
+    size_t                nbytes;
+    size_t               *blockoffsets;
+    char                 *copysource;
+    char                 *sourcetoken;
+    int                   nthreads;
+    int                   nrequests;
+    int                   multiplex;
+    char                 *skip;
+    struct ResponseCodes *codes;
+    uint64_t             *blockcrcs;
+    struct Codec          codec;
+    int                   hascodec;
+    int                   integrity;
+    int                   fresh;
+    int                   nretry;
+    int                   verbose;
+    notify_callback       notify;
+    void                 *notifyarg;
+    int                   done;
+    int                   released;
+    struct ResponseCodes  responsecodes;
+};
+
+/*
+The queue of transfers that wait for a driver.  ASYNC_NIDLE counts the drivers that are not running a transfer
+(including the ones that are starting), and is protected by ASYNC_LOCK, as is the released flag of each transfer.
+*/
+static pthread_mutex_t ASYNC_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ASYNC_QUEUED = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ASYNC_RELEASED = PTHREAD_COND_INITIALIZER;
+static struct AsyncTransfer *ASYNC_HEAD = NULL;
+static struct AsyncTransfer *ASYNC_TAIL = NULL;
+static int ASYNC_NQUEUED = 0;
+static int ASYNC_NIDLE = 0;
+static int ASYNC_NDRIVERS = 0;
+
+void
+curl_async_run(
+        struct AsyncTransfer *transfer)
+{
+    struct ResponseCodes responsecodes;
+
+    if (transfer->kind == ASYNC_READ_FD) {
+        responsecodes = curl_readbytes_fd_threaded(transfer->token, transfer->tokenslot, transfer->storageaccount, transfer->containername, transfer->blobname, transfer->fd, transfer->datasize, transfer->chunksize, transfer->nthreads, transfer->skip, transfer->codes, transfer->fresh, transfer->nretry, transfer->verbose);
+    } else if (transfer->kind == ASYNC_WRITE_FD) {
+        responsecodes = curl_writebytes_block_fd_threaded(transfer->token, transfer->tokenslot, transfer->storageaccount, transfer->containername, transfer->blobname, transfer->blockids, transfer->fd, transfer->datasize, transfer->nthreads, transfer->nblocks, transfer->skip, transfer->codes, transfer->fresh, transfer->nretry, transfer->verbose);
+    } else if (transfer->kind == ASYNC_READ_CODEC) {
+        responsecodes = curl_readbytes_codec_threaded(transfer->token, transfer->tokenslot, transfer->storageaccount, transfer->containername, transfer->blobname, transfer->data, transfer->dataoffset, transfer->datasize, transfer->nbytes, transfer->nblocks, transfer->blockoffsets, &transfer->codec, transfer->nthreads, transfer->integrity, transfer->nretry, transfer->verbose);
+    } else if (transfer->kind == ASYNC_COPY) {
+        responsecodes = curl_copyblocks_threaded(transfer->token, transfer->tokenslot, transfer->storageaccount, transfer->containername, transfer->blobname, transfer->blockids, transfer->copysource, transfer->sourcetoken, transfer->datasize, transfer->nthreads, transfer->nblocks, transfer->skip, transfer->codes, transfer->fresh, transfer->nretry, transfer->verbose);
+    } else if (transfer->kind == ASYNC_READ) {
+        if (transfer->nrequests > 0) {
+            responsecodes = curl_readbytes_multi(transfer->token, transfer->tokenslot, transfer->storageaccount, transfer->containername, transfer->blobname, transfer->data, transfer->dataoffset, transfer->datasize, transfer->chunksize, transfer->nthreads, transfer->nrequests, transfer->multiplex, transfer->nretry, transfer->verbose);
+        } else {
+            responsecodes = curl_readbytes_retry_threaded(transfer->token, transfer->tokenslot, transfer->storageaccount, transfer->containername, transfer->blobname, transfer->data, transfer->dataoffset, transfer->datasize, transfer->chunksize, transfer->nthreads, transfer->codes, transfer->integrity, transfer->nretry, transfer->verbose);
+        }
+    } else {
+        if (transfer->nrequests > 0) {
+            responsecodes = curl_writebytes_block_multi(transfer->token, transfer->tokenslot, transfer->storageaccount, transfer->containername, transfer->blobname, transfer->blockids, transfer->data, transfer->datasize, transfer->nthreads, transfer->nblocks, transfer->skip, transfer->blockcrcs, transfer->nrequests, transfer->multiplex, transfer->nretry, transfer->verbose);
+        } else {
+            responsecodes = curl_writebytes_block_retry_threaded(transfer->token, transfer->tokenslot, transfer->storageaccount, transfer->containername, transfer->blobname, transfer->blockids, transfer->data, transfer->datasize, transfer->nthreads, transfer->nblocks, transfer->skip, transfer->codes, transfer->blockcrcs, transfer->hascodec != 0 ? &transfer->codec : NULL, transfer->fresh, transfer->nretry, transfer->verbose);
+        }
+    }
+
+    transfer->responsecodes = responsecodes;
+    __atomic_store_n(&transfer->done, 1, __ATOMIC_RELEASE);
+    if (transfer->notify != NULL) {
+        transfer->notify(transfer->notifyarg);
+    }
+}
+
+/*
+the transfer is not touched (by its driver) after it is released
+*/
+void
+curl_async_release(
+        struct AsyncTransfer *transfer)
+{
+    pthread_mutex_lock(&ASYNC_LOCK);
+    transfer->released = 1;
+    pthread_cond_broadcast(&ASYNC_RELEASED);
+    pthread_mutex_unlock(&ASYNC_LOCK);
+}
+
+void *
+curl_async_driver(
+        void *unused)
+{
+    affinity_owned();
+    pthread_mutex_lock(&ASYNC_LOCK);
+    for (;;) {
+        while (ASYNC_HEAD == NULL) {
+            pthread_cond_wait(&ASYNC_QUEUED, &ASYNC_LOCK);
+        }
+        struct AsyncTransfer *transfer = ASYNC_HEAD;
+        ASYNC_HEAD = transfer->next;
+        if (ASYNC_HEAD == NULL) {
+            ASYNC_TAIL = NULL;
+        }
+        ASYNC_NQUEUED--;
+        ASYNC_NIDLE--;
+        pthread_mutex_unlock(&ASYNC_LOCK);
+
+        curl_async_run(transfer);
+
+        pthread_mutex_lock(&ASYNC_LOCK);
+        transfer->released = 1;
+        pthread_cond_broadcast(&ASYNC_RELEASED);
+        ASYNC_NIDLE++;
+    }
+    return NULL;
+}
+
+void
+curl_async_free(
+        struct AsyncTransfer *transfer)
+{
+    int iblock;
+    if (transfer->blockids != NULL) {
+        for (iblock = 0; iblock < transfer->nblocks; iblock++) {
+            free(transfer->blockids[iblock]);
+        }
+    }
+    free(transfer->blockids);
+    free(transfer->copysource);
+    free(transfer->sourcetoken);
+    free(transfer->token);
+    free(transfer->storageaccount);
+    free(transfer->containername);
+    free(transfer->blobname);
+    free(transfer);
+}
+
+/*
+copy the block ids into the transfer, or free the transfer (and return -1) if they can not be allocated
+*/
+int
+curl_async_blockids(
+        struct AsyncTransfer *transfer,
+        char                **blockids,
+        int                   nblocks)
+{
+    int iblock;
+    transfer->nblocks = nblocks;
+    transfer->blockids = (char**)calloc(nblocks, sizeof(char*));
+    if (transfer->blockids == NULL) {
+        printf("Error, unable to allocate the block ids of the asynchronous transfer.\n");
+        curl_async_free(transfer);
+        return -1;
+    }
+    for (iblock = 0; iblock < nblocks; iblock++) {
+        transfer->blockids[iblock] = strdup(blockids[iblock]);
+        if (transfer->blockids[iblock] == NULL) {
+            printf("Error, unable to allocate the block ids of the asynchronous transfer.\n");
+            curl_async_free(transfer);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+NULL if the transfer can not be allocated
+*/
+struct AsyncTransfer *
+curl_async_new(
+        int              kind,
+        char            *token,
+        struct TokenSlot *tokenslot,
+        char            *storageaccount,
+        char            *containername,
+        char            *blobname,
+        char            *data,
+        size_t           datasize,
+        int              nthreads,
+        int              nrequests,
+        int              multiplex,
+        int              nretry,
+        int              verbose,
+        notify_callback  notify,
+        void            *notifyarg)
+{
+    struct AsyncTransfer *transfer = (struct AsyncTransfer*)malloc(sizeof(struct AsyncTransfer));
+    if (transfer == NULL) {
+        printf("Error, unable to allocate the asynchronous transfer.\n");
+        return NULL;
+    }
+    transfer->kind = kind;
+    transfer->token = strdup(token);
+    transfer->tokenslot = tokenslot;
+    transfer->storageaccount = strdup(storageaccount);
+    transfer->containername = strdup(containername);
+    transfer->blobname = strdup(blobname);
+    transfer->blockids = NULL;
+    transfer->nblocks = 0;
+    transfer->data = data;
+    transfer->dataoffset = 0;
+    transfer->datasize = datasize;
+    transfer->chunksize = datasize;
+    transfer->fd = -1;
+    transfer->nbytes = datasize;
+    transfer->blockoffsets = NULL;
+    transfer->copysource = NULL;
+    transfer->sourcetoken = NULL;
+    transfer->nthreads = nthreads;
+    transfer->nrequests = nrequests;
+    transfer->multiplex = multiplex;
+    transfer->skip = NULL;
+    transfer->codes = NULL;
+    transfer->blockcrcs = NULL;
+    transfer->hascodec = 0;
+    transfer->integrity = 0;
+    transfer->fresh = 0;
+    transfer->nretry = nretry;
+    transfer->verbose = verbose;
+    transfer->notify = notify;
+    transfer->notifyarg = notifyarg;
+    transfer->done = 0;
+    transfer->released = 0;
+    transfer->next = NULL;
+    if (transfer->token == NULL || transfer->storageaccount == NULL || transfer->containername == NULL || transfer->blobname == NULL) {
+        printf("Error, unable to allocate the asynchronous transfer.\n");
+        curl_async_free(transfer);
+        return NULL;
+    }
+    return transfer;
+}
+
+struct AsyncTransfer *
+curl_async_start(
+        struct AsyncTransfer *transfer)
+{
+    pthread_mutex_lock(&ASYNC_LOCK);
+    if (ASYNC_NQUEUED >= ASYNC_NIDLE) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, curl_async_driver, NULL) == 0) {
+            ASYNC_NDRIVERS++;
+            ASYNC_NIDLE++;
+        } else if (ASYNC_NDRIVERS == 0) {
+            pthread_attr_destroy(&attr);
+            pthread_mutex_unlock(&ASYNC_LOCK);
+            printf("Error, unable to create thread for asynchronous transfer.\n");
+            transfer->responsecodes.http = 200;
+            transfer->responsecodes.curl = (long)CURLE_FAILED_INIT;
+            __atomic_store_n(&transfer->done, 1, __ATOMIC_RELEASE);
+            if (transfer->notify != NULL) {
+                transfer->notify(transfer->notifyarg);
+            }
+            curl_async_release(transfer);
+            return transfer;
+        }
+        /* otherwise, the transfer waits for one of the running drivers */
+        pthread_attr_destroy(&attr);
+    }
+    if (ASYNC_TAIL == NULL) {
+        ASYNC_HEAD = transfer;
+    } else {
+        ASYNC_TAIL->next = transfer;
+    }
+    ASYNC_TAIL = transfer;
+    ASYNC_NQUEUED++;
+    pthread_cond_signal(&ASYNC_QUEUED);
+    pthread_mutex_unlock(&ASYNC_LOCK);
+    return transfer;
+}
+
+/*
+With nrequests > 0 the curl_multi engine is used, and otherwise the OpenMP engine, which also reports the response codes
+of the chunks (if chunkcodes is not NULL) and supports integrity checking.  tokenslot may be NULL.  Returns NULL if the
+transfer can not be allocated.
+*/
+struct AsyncTransfer *
+curl_readbytes_async(
+        char                 *token,
+        struct TokenSlot     *tokenslot,
+        char                 *storageaccount,
+        char                 *containername,
+        char                 *blobname,
+        char                 *data,
+        size_t                dataoffset,
+        size_t                datasize,
+        size_t                chunksize,
+        int                   nthreads,
+        int                   nrequests,
+        int                   multiplex,
+        struct ResponseCodes *chunkcodes,
+        int                   integrity,
+        int                   nretry,
+        int                   verbose,
+        notify_callback       notify,
+        void                 *notifyarg)
+{
+    struct AsyncTransfer *transfer = curl_async_new(ASYNC_READ, token, tokenslot, storageaccount, containername, blobname, data, datasize, nthreads, nrequests, multiplex, nretry, verbose, notify, notifyarg);
+    if (transfer == NULL) {
+        return NULL;
+    }
+    transfer->dataoffset = dataoffset;
+    transfer->chunksize = chunksize;
+    transfer->codes = chunkcodes;
+    transfer->integrity = integrity;
+    return curl_async_start(transfer);
+}
+
+/*
+With nrequests > 0 the curl_multi engine is used, and otherwise the OpenMP engine, which also reports the response codes
+of the blocks (if blockcodes is not NULL), and supports the codec and fresh connections (see
+curl_writebytes_block_retry_threaded).  skip, blockcrcs, codec and tokenslot may be NULL.  Returns NULL if the transfer
+can not be allocated.
+*/
+struct AsyncTransfer *
+curl_writebytes_block_async(
+        char                 *token,
+        struct TokenSlot     *tokenslot,
+        char                 *storageaccount,
+        char                 *containername,
+        char                 *blobname,
+        char                **blockids,
+        char                 *data,
+        size_t                datasize,
+        int                   nthreads,
+        int                   nblocks,
+        char                 *skip,
+        struct ResponseCodes *blockcodes,
+        uint64_t             *blockcrcs,
+        struct Codec         *codec,
+        int                   nrequests,
+        int                   multiplex,
+        int                   fresh,
+        int                   nretry,
+        int                   verbose,
+        notify_callback       notify,
+        void                 *notifyarg)
+{
+    struct AsyncTransfer *transfer = curl_async_new(ASYNC_WRITE, token, tokenslot, storageaccount, containername, blobname, data, datasize, nthreads, nrequests, multiplex, nretry, verbose, notify, notifyarg);
+    if (transfer == NULL) {
+        return NULL;
+    }
+    transfer->skip = skip;
+    transfer->codes = blockcodes;
+    transfer->blockcrcs = blockcrcs;
+    if (codec != NULL) {
+        transfer->codec = *codec;
+        transfer->hascodec = 1;
+    }
+    transfer->fresh = fresh;
+    if (curl_async_blockids(transfer, blockids, nblocks) != 0) {
+        return NULL;
+    }
+    return curl_async_start(transfer);
+}
+
+/*
+The file transfers of curl_writebytes_block_fd_threaded and curl_readbytes_fd_threaded.  The caller owns fd.  tokenslot
+may be NULL.  Returns NULL if the transfer can not be allocated.
+*/
+struct AsyncTransfer *
+curl_writebytes_block_fd_async(
+        char                 *token,
+        struct TokenSlot     *tokenslot,
+        char                 *storageaccount,
+        char                 *containername,
+        char                 *blobname,
+        char                **blockids,
+        int                   fd,
+        size_t                datasize,
+        int                   nthreads,
+        int                   nblocks,
+        char                 *skip,
+        struct ResponseCodes *blockcodes,
+        int                   fresh,
+        int                   nretry,
+        int                   verbose,
+        notify_callback       notify,
+        void                 *notifyarg)
+{
+    struct AsyncTransfer *transfer = curl_async_new(ASYNC_WRITE_FD, token, tokenslot, storageaccount, containername, blobname, NULL, datasize, nthreads, 0, 0, nretry, verbose, notify, notifyarg);
+    if (transfer == NULL) {
+        return NULL;
+    }
+    transfer->fd = fd;
+    transfer->skip = skip;
+    transfer->codes = blockcodes;
+    transfer->fresh = fresh;
+    if (curl_async_blockids(transfer, blockids, nblocks) != 0) {
+        return NULL;
+    }
+    return curl_async_start(transfer);
+}
+
+struct AsyncTransfer *
+curl_readbytes_fd_async(
+        char                 *token,
+        struct TokenSlot     *tokenslot,
+        char                 *storageaccount,
+        char                 *containername,
+        char                 *blobname,
+        int                   fd,
+        size_t                datasize,
+        size_t                chunksize,
+        int                   nthreads,
+        char                 *skip,
+        struct ResponseCodes *chunkcodes,
+        int                   fresh,
+        int                   nretry,
+        int                   verbose,
+        notify_callback       notify,
+        void                 *notifyarg)
+{
+    struct AsyncTransfer *transfer = curl_async_new(ASYNC_READ_FD, token, tokenslot, storageaccount, containername, blobname, NULL, datasize, nthreads, 0, 0, nretry, verbose, notify, notifyarg);
+    if (transfer == NULL) {
+        return NULL;
+    }
+    transfer->fd = fd;
+    transfer->chunksize = chunksize;
+    transfer->skip = skip;
+    transfer->codes = chunkcodes;
+    transfer->fresh = fresh;
+    return curl_async_start(transfer);
+}
+
+/*
+The read of a compressed blob of curl_readbytes_codec_threaded.  The caller owns blockoffsets (nblocks+1 values).
+tokenslot may be NULL.  Returns NULL if the transfer can not be allocated.
+*/
+struct AsyncTransfer *
+curl_readbytes_codec_async(
+        char                 *token,
+        struct TokenSlot     *tokenslot,
+        char                 *storageaccount,
+        char                 *containername,
+        char                 *blobname,
+        char                 *data,
+        size_t                dataoffset,
+        size_t                datasize,
+        size_t                nbytes,
+        int                   nblocks,
+        size_t               *blockoffsets,
+        struct Codec         *codec,
+        int                   nthreads,
+        int                   integrity,
+        int                   nretry,
+        int                   verbose,
+        notify_callback       notify,
+        void                 *notifyarg)
+{
+    struct AsyncTransfer *transfer = curl_async_new(ASYNC_READ_CODEC, token, tokenslot, storageaccount, containername, blobname, data, datasize, nthreads, 0, 0, nretry, verbose, notify, notifyarg);
+    if (transfer == NULL) {
+        return NULL;
+    }
+    transfer->dataoffset = dataoffset;
+    transfer->nbytes = nbytes;
+    transfer->nblocks = nblocks;
+    transfer->blockoffsets = blockoffsets;
+    transfer->codec = *codec;
+    transfer->hascodec = 1;
+    transfer->integrity = integrity;
+    return curl_async_start(transfer);
+}
+
+/*
+The server-side copy of curl_copyblocks_threaded.  tokenslot may be NULL, in which case sourcetoken (which may be NULL)
+authorizes the reads of the copy source.  Returns NULL if the transfer can not be allocated.
+*/
+struct AsyncTransfer *
+curl_copyblocks_async(
+        char                 *token,
+        struct TokenSlot     *tokenslot,
+        char                 *storageaccount,
+        char                 *containername,
+        char                 *blobname,
+        char                **blockids,
+        char                 *copysource,
+        char                 *sourcetoken,
+        size_t                datasize,
+        int                   nthreads,
+        int                   nblocks,
+        char                 *skip,
+        struct ResponseCodes *blockcodes,
+        int                   fresh,
+        int                   nretry,
+        int                   verbose,
+        notify_callback       notify,
+        void                 *notifyarg)
+{
+    struct AsyncTransfer *transfer = curl_async_new(ASYNC_COPY, token, tokenslot, storageaccount, containername, blobname, NULL, datasize, nthreads, 0, 0, nretry, verbose, notify, notifyarg);
+    if (transfer == NULL) {
+        return NULL;
+    }
+    transfer->skip = skip;
+    transfer->codes = blockcodes;
+    transfer->fresh = fresh;
+    transfer->copysource = strdup(copysource);
+    transfer->sourcetoken = sourcetoken == NULL ? NULL : strdup(sourcetoken);
+    if (transfer->copysource == NULL || (sourcetoken != NULL && transfer->sourcetoken == NULL)) {
+        printf("Error, unable to allocate the asynchronous transfer.\n");
+        curl_async_free(transfer);
+        return NULL;
+    }
+    if (curl_async_blockids(transfer, blockids, nblocks) != 0) {
+        return NULL;
+    }
+    return curl_async_start(transfer);
+}
+
+int
+curl_async_done(
+        struct AsyncTransfer *transfer)
+{
+    return __atomic_load_n(&transfer->done, __ATOMIC_ACQUIRE) > 0 ? 1 : 0;
+}
+
+/*
+Wait for the transfer to complete, and free its resources.  The transfer is marked done before its notify callback runs,
+so this also waits for the callback to return, after which the caller may release the notify argument.
+*/
+struct ResponseCodes
+curl_async_wait(
+        struct AsyncTransfer *transfer)
+{
+    pthread_mutex_lock(&ASYNC_LOCK);
+    while (transfer->released == 0) {
+        pthread_cond_wait(&ASYNC_RELEASED, &ASYNC_LOCK);
+    }
+    pthread_mutex_unlock(&ASYNC_LOCK);
+    struct ResponseCodes responsecodes = transfer->responsecodes;
+    curl_async_free(transfer);
+    return responsecodes;
+}
+
+/*
+Vectored reads.  The (offset,size) ranges are sorted, and ranges that are separated by at
+most maxgap bytes are coalesced into a single range GET of at most maxsize bytes.  The body
+of each GET is scattered directly into the destination buffers, dropping the gap bytes.
+*/
+struct ScatterSegment {
+    char   *data;
+    size_t  dataoffset;
+    size_t  datasize;
+};
+
+struct ScatterGroup {
+    size_t dataoffset;
+    size_t datasize;
+    int    firstsegment;
+    int    nsegments;
+};
+
+struct ScatterStruct {
+    struct ScatterSegment *segments;
+    int                    nsegments;
+    int                    isegment;
+    size_t                 dataoffset;
+    size_t                 datasize;
+    size_t                 currentsize;
+};
+
+int
+scatter_segment_compare(
+        const void *a,
+        const void *b)
+{
+    size_t offset_a = ((const struct ScatterSegment*)a)->dataoffset;
+    size_t offset_b = ((const struct ScatterSegment*)b)->dataoffset;
+    return offset_a < offset_b ? -1 : (offset_a > offset_b ? 1 : 0);
+}
+
+size_t
+write_callback_scatter(
+        char   *ptr,
+        size_t  size,
+        size_t  nmemb,
+        void   *scattervoid)
+{
+    struct ScatterStruct *scatter = (struct ScatterStruct*)scattervoid;
+    size_t n = size*nmemb;
+    if (scatter->currentsize + n > scatter->datasize) {
+        printf("error: read too many bytes, %d in %s\n", __LINE__, __FILE__);
+        return 0;
+    }
+    size_t firstbyte = scatter->dataoffset + scatter->currentsize;
+    size_t lastbyte = firstbyte + n; /* exclusive */
+
+    /* segments are sorted by offset, but may overlap */
+    int isegment;
+    for (isegment = scatter->isegment; isegment < scatter->nsegments; isegment++) {
+        struct ScatterSegment *segment = &scatter->segments[isegment];
+        if (segment->dataoffset >= lastbyte) {
+            break;
+        }
+        size_t segment_lastbyte = segment->dataoffset + segment->datasize;
+        size_t _firstbyte = MAX(firstbyte, segment->dataoffset);
+        size_t _lastbyte = MIN(lastbyte, segment_lastbyte);
+        if (_lastbyte > _firstbyte) {
+            memcpy(segment->data + (_firstbyte - segment->dataoffset), ptr + (_firstbyte - firstbyte), _lastbyte - _firstbyte);
+        }
+        if (isegment == scatter->isegment && segment_lastbyte <= lastbyte) {
+            scatter->isegment++;
+        }
+    }
+    scatter->currentsize += n;
+    return n;
+}
+
+struct ResponseCodes
+curl_readbytes_scatter(
+        const struct RequestContext *context,
+        struct ScatterSegment       *segments,
+        struct ScatterGroup         *group,
+        int                          verbose)
+{
+    struct ScatterStruct scatter;
+    scatter.segments = segments + group->firstsegment;
+    scatter.nsegments = group->nsegments;
+    scatter.isegment = 0;
+    scatter.dataoffset = group->dataoffset;
+    scatter.datasize = group->datasize;
+    scatter.currentsize = 0;
+
+    CURL *curlhandle = curl_handle_acquire();
+
+    char errbuf[CURL_ERROR_SIZE];
+    struct RequestHeaders headers;
+    curl_readrange_setup(curlhandle, context, &headers, group->dataoffset, group->datasize, 0, write_callback_scatter, (void*)&scatter, verbose, errbuf);
+
+    long responsecode_http = 200;
+    CURLcode responsecode_curl = curl_perform(curlhandle, &responsecode_http);
+
+    if ( (responsecode_curl != CURLE_OK || responsecode_http >= 300) && verbose > 0) {
+        printf("Error, bad read, http response code=%ld, curl response=%s\n", responsecode_http, errbuf);
+    }
+
+    curl_handle_release(curlhandle);
+
+    struct ResponseCodes responsecodes;
+    responsecodes.http = responsecode_http;
+    responsecodes.curl = (long)responsecode_curl;
+
+    return responsecodes;
+}
+
+struct ResponseCodes
+curl_readbytes_scatter_retry(
+        const struct RequestContext *context,
+        struct ScatterSegment       *segments,
+        struct ScatterGroup         *group,
+        int                          nretry,
+        int                          verbose)
+{
+    struct ResponseCodes responsecodes;
+    int iretry;
+    for (iretry = 0; iretry < nretry; iretry++) {
+        responsecodes = curl_readbytes_scatter(context, segments, group, verbose);
+        if (isrestretrycode(responsecodes) == 0) {
+            break;
+        }
+        if (verbose > 0) {
+            printf("Warning, bad read, retrying, %d/%d, http responsecode=%ld, curl responsecode=%ld.\n", iretry+1, nretry, responsecodes.http, responsecodes.curl);
+        }
+        stats_retry(responsecodes.http, responsecodes.curl);
+        if (exponential_backoff(iretry) != 0) {
+            printf("Warning, exponential backoff failed\n");
+            break;
+        }
+    }
+    return responsecodes;
+}
+
+struct ResponseCodes
+curl_readbytes_vectored_retry_threaded(
+        char    *token,
+        char    *storageaccount,
+        char    *containername,
+        char    *blobname,
+        char   **datas,
+        size_t  *dataoffsets,
+        size_t  *datasizes,
+        int      nranges,
+        size_t   maxgap,
+        size_t   maxsize,
+        int      nthreads,
+        int      nretry,
+        int      verbose)
+{
+    struct ResponseCodes responsecodes;
+    responsecodes.http = 200;
+    responsecodes.curl = (long)CURLE_OK;
+
+    struct ScatterSegment *segments = (struct ScatterSegment*)malloc(nranges*sizeof(struct ScatterSegment));
+    struct ScatterGroup *groups = (struct ScatterGroup*)malloc(nranges*sizeof(struct ScatterGroup));
+    if (segments == NULL || groups == NULL) {
+        free(segments);
+        free(groups);
+        responsecodes.curl = (long)CURLE_OUT_OF_MEMORY;
+        return responsecodes;
+    }
+
+    int nsegments = 0;
+    int irange;
+    for (irange = 0; irange < nranges; irange++) {
+        if (datasizes[irange] == 0) {
+            continue;
+        }
+        segments[nsegments].data = datas[irange];
+        segments[nsegments].dataoffset = dataoffsets[irange];
+        segments[nsegments].datasize = datasizes[irange];
+        nsegments++;
+    }
+    qsort(segments, nsegments, sizeof(struct ScatterSegment), scatter_segment_compare);
+
+    int ngroups = 0;
+    int isegment;
+    for (isegment = 0; isegment < nsegments; isegment++) {
+        size_t segment_lastbyte = segments[isegment].dataoffset + segments[isegment].datasize;
+        if (ngroups > 0) {
+            struct ScatterGroup *group = &groups[ngroups-1];
+            size_t group_lastbyte = group->dataoffset + group->datasize;
+            size_t _group_lastbyte = MAX(group_lastbyte, segment_lastbyte);
+            if (segments[isegment].dataoffset <= group_lastbyte + maxgap && _group_lastbyte - group->dataoffset <= maxsize) {
+                group->datasize = _group_lastbyte - group->dataoffset;
+                group->nsegments++;
+                continue;
+            }
+        }
+        groups[ngroups].dataoffset = segments[isegment].dataoffset;
+        groups[ngroups].datasize = segments[isegment].datasize;
+        groups[ngroups].firstsegment = isegment;
+        groups[ngroups].nsegments = 1;
+        ngroups++;
+    }
 
-struct DataStruct {
-    char *data;
-    size_t datasize;
-    size_t currentsize;
-};
+    struct RequestContext context;
+    if (curl_request_context_init(&context, token, NULL, storageaccount, containername, blobname) != 0) {
+        free(segments);
+        free(groups);
+        return curl_request_context_error(&context);
+    }
 
-size_t
-write_callback_readdata(
-        char   *ptr,
-        size_t  size,
-        size_t  nmemb,
-        void   *datavoid)
+    nthreads = MAX(MIN(nthreads, ngroups), 1);
+    int threadid;
+    long thread_responsecode_http[nthreads];
+    long thread_responsecode_curl[nthreads];
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        thread_responsecode_http[threadid] = 200;
+        thread_responsecode_curl[threadid] = (long)CURLE_OK;
+    }
+
+#pragma omp parallel num_threads(nthreads) default(shared)
 {
-    struct DataStruct *datastruct = (struct DataStruct*)datavoid;
-    size_t n = size*nmemb;
-    size_t newsize = datastruct->currentsize + n;
-    if (newsize > datastruct->datasize) {
-        printf("error: read too many bytes, %d in %s\n", __LINE__, __FILE__);
-        return 0;
+    int threadid = omp_get_thread_num();
+    int igroup;
+#pragma omp for schedule(dynamic,1)
+    for (igroup = 0; igroup < ngroups; igroup++) {
+        struct ResponseCodes _responsecodes = curl_readbytes_scatter_retry(&context, segments, &groups[igroup], nretry, verbose);
+        thread_responsecode_http[threadid] = MAX(_responsecodes.http, thread_responsecode_http[threadid]);
+        thread_responsecode_curl[threadid] = MAX(_responsecodes.curl, thread_responsecode_curl[threadid]);
     }
-    memcpy(datastruct->data+datastruct->currentsize, ptr, n);
-    datastruct->currentsize = newsize;
-    return n;
+} /* end pragma omp */
+
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        responsecodes.http = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        responsecodes.curl = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+
+    curl_request_context_free(&context);
+    free(segments);
+    free(groups);
+
+    return responsecodes;
 }
 
+/*
+Put Blob (single-shot upload) and batched transfers of many (small) blobs.  The blobs are
+spread over the OpenMP threads with a dynamic schedule so that at most nthreads requests
+are in flight.
+*/
 struct ResponseCodes
-curl_writebytes_block(
-        char   *token,
-        char   *storageaccount,
-        char   *containername,
-        char   *blobname,
-        char   *blockid,
-        char   *data,
-        size_t  datasize,
-        int     verbose)
+curl_writebytes_blob(
+        const struct RequestContext *context,
+        char                        *contenttype,
+        char                        *data,
+        size_t                       datasize,
+        int                          integrity,
+        int                          verbose)
 {
-    char authorization[BUFFER_SIZE];
-    curl_authorization(token, authorization);
-    char contentlength[BUFFER_SIZE];
-    curl_contentlength(datasize, contentlength);
-
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, API_HEADER);
-    headers = curl_slist_append(headers, "Content-Type: application/octet-stream");
-    headers = curl_slist_append(headers, contentlength);
-    headers = curl_slist_append(headers, authorization);
+    char _contenttype[strlen(contenttype) + 16];
+    snprintf(_contenttype, sizeof(_contenttype), "Content-Type: %s", contenttype);
 
-    CURL *curlhandle = curl_easy_init();
+    struct RequestHeaders headers;
+    headers.n = 0;
+    request_header(&headers, _contenttype);
+    curl_contentlength(&headers, datasize);
+    request_header(&headers, "x-ms-blob-type: BlockBlob");
+    if (integrity != 0) {
+        /* the service checks the CRC64 of the body, and the CRC64 is also stored (for crc64 in the Julia layer) */
+        char *crcheader = request_header(&headers, NULL);
+        crc64_header(crcheader, curl_crc64(0, data, datasize));
+        snprintf(request_header(&headers, NULL), REQUEST_HEADER_SIZE, "x-ms-meta-crc64: %s", crcheader + strlen("x-ms-content-crc64: "));
+    }
 
-    char url[BUFFER_SIZE];
-    snprintf(
-        url,
-        BUFFER_SIZE,
-        "https://%s.blob.core.windows.net/%s/%s?comp=block&blockid=%s",
-        storageaccount,
-        containername,
-        blobname,
-        blockid);
+    CURL *curlhandle = curl_handle_acquire();
 
-    curl_easy_setopt(curlhandle, CURLOPT_URL, url);
-    curl_easy_setopt(curlhandle, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curlhandle, CURLOPT_URL, context->url);
+    curl_easy_setopt(curlhandle, CURLOPT_HTTPHEADER, request_headers_link(&headers, context));
     curl_easy_setopt(curlhandle, CURLOPT_CUSTOMREQUEST, "PUT");
-    curl_easy_setopt(curlhandle, CURLOPT_POSTFIELDSIZE, datasize);
-    curl_easy_setopt(curlhandle, CURLOPT_POSTFIELDS, data);
-    curl_easy_setopt(curlhandle, CURLOPT_SSL_VERIFYPEER, 0); /* TODO */
-    curl_easy_setopt(curlhandle, CURLOPT_VERBOSE, verbose);
+    curl_easy_setopt(curlhandle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)datasize);
+    curl_easy_setopt(curlhandle, CURLOPT_POSTFIELDS, datasize > 0 ? data : "");
+    curl_easy_setopt(curlhandle, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(curlhandle, CURLOPT_VERBOSE, (long)verbose);
     curl_easy_setopt(curlhandle, CURLOPT_TIMEOUT, CURLE_TIMEOUT);
     curl_easy_setopt(curlhandle, CURLOPT_WRITEFUNCTION, write_callback_null);
 
@@ -193,15 +4219,13 @@ curl_writebytes_block(
     curl_easy_setopt(curlhandle, CURLOPT_ERRORBUFFER, errbuf);
 
     long responsecode_http = 200;
-    CURLcode responsecode_curl = curl_easy_perform(curlhandle);
-    curl_easy_getinfo(curlhandle, CURLINFO_RESPONSE_CODE, &responsecode_http);
+    CURLcode responsecode_curl = curl_perform(curlhandle, &responsecode_http);
 
     if ( (responsecode_curl != CURLE_OK || responsecode_http >= 300) && verbose > 0) {
         printf("Warning, curl response=%s, http response code=%ld\n", errbuf, responsecode_http);
     }
 
-    curl_easy_cleanup(curlhandle);
-    curl_slist_free_all(headers);
+    curl_handle_release(curlhandle);
 
     struct ResponseCodes responsecodes;
     responsecodes.http = responsecode_http;
@@ -211,27 +4235,26 @@ curl_writebytes_block(
 }
 
 struct ResponseCodes
-curl_writebytes_block_retry(
-        char   *token,
-        char   *storageaccount,
-        char   *containername,
-        char   *blobname,
-        char   *blockid,
-        char   *data,
-        size_t  datasize,
-        int     nretry,
-        int     verbose)
+curl_writebytes_blob_retry(
+        const struct RequestContext *context,
+        char                        *contenttype,
+        char                        *data,
+        size_t                       datasize,
+        int                          integrity,
+        int                          nretry,
+        int                          verbose)
 {
     int iretry;
     struct ResponseCodes responsecodes;
     for (iretry = 0; iretry < nretry; iretry++) {
-        responsecodes = curl_writebytes_block(token, storageaccount, containername, blobname, blockid, data, datasize, verbose);
+        responsecodes = curl_writebytes_blob(context, contenttype, data, datasize, integrity, verbose);
         if (isrestretrycode(responsecodes) == 0) {
             break;
         }
         if (verbose > 0) {
             printf("Warning, bad write, retrying, %d/%d, http_responsecode=%ld, curl_responsecode=%ld.\n", iretry+1, nretry, responsecodes.http, responsecodes.curl);
         }
+        stats_retry(responsecodes.http, responsecodes.curl);
         if (exponential_backoff(iretry) != 0) {
             printf("Warning, unable to sleep in exponential backoff due to failed nanosleep call.\n");
             break;
@@ -241,22 +4264,21 @@ curl_writebytes_block_retry(
 }
 
 struct ResponseCodes
-curl_writebytes_block_retry_threaded(
+curl_writebytes_blob_batch_retry_threaded(
         char    *token,
         char    *storageaccount,
         char    *containername,
-        char    *blobname,
-        char   **blockids,
-        char    *data,
-        size_t  datasize,
-        int     nthreads,
-        int     nblocks,
-        int     nretry,
-        int     verbose)
+        char   **blobnames,
+        char    *contenttype,
+        char   **datas,
+        size_t  *datasizes,
+        int      nblobs,
+        int      nthreads,
+        int      integrity,
+        int      nretry,
+        int      verbose)
 {
-    size_t block_datasize = datasize/nblocks;
-    size_t block_dataremainder = datasize%nblocks;
-
+    nthreads = MAX(MIN(nthreads, nblobs), 1);
     int threadid;
     long thread_responsecode_http[nthreads];
     long thread_responsecode_curl[nthreads];
@@ -268,26 +4290,24 @@ curl_writebytes_block_retry_threaded(
 #pragma omp parallel num_threads(nthreads) default(shared)
 {
     int threadid = omp_get_thread_num();
-    int iblock;
-#pragma omp for
-    for (iblock = 0; iblock < nblocks; iblock++) {
-        size_t block_firstbyte = iblock*block_datasize;
-        size_t _block_datasize = block_datasize;
-        if (iblock < block_dataremainder) {
-            block_firstbyte += iblock;
-            _block_datasize += 1;
+    int iblob;
+#pragma omp for schedule(dynamic,1)
+    for (iblob = 0; iblob < nblobs; iblob++) {
+        struct RequestContext context;
+        struct ResponseCodes responsecodes;
+        if (curl_request_context_init(&context, token, NULL, storageaccount, containername, blobnames[iblob]) != 0) {
+            responsecodes = curl_request_context_error(&context);
         } else {
-            block_firstbyte += block_dataremainder;
+            responsecodes = curl_writebytes_blob_retry(&context, contenttype, datas[iblob], datasizes[iblob], integrity, nretry, verbose);
+            curl_request_context_free(&context);
         }
-
-        struct ResponseCodes responsecodes = curl_writebytes_block_retry(token, storageaccount, containername, blobname, blockids[iblock], data+block_firstbyte, _block_datasize, nretry, verbose);
         thread_responsecode_http[threadid] = MAX(responsecodes.http, thread_responsecode_http[threadid]);
         thread_responsecode_curl[threadid] = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
     }
-} // end #pragma omp
+} /* end pragma omp */
 
     struct ResponseCodes responsecodes;
-    responsecodes.http = (long)200;
+    responsecodes.http = 200;
     responsecodes.curl = (long)CURLE_OK;
     for (threadid = 0; threadid < nthreads; threadid++) {
         responsecodes.http = MAX(responsecodes.http, thread_responsecode_http[threadid]);
@@ -297,147 +4317,386 @@ curl_writebytes_block_retry_threaded(
 }
 
 struct ResponseCodes
-curl_readbytes(
-        char   *token,
-        char   *storageaccount,
-        char   *containername,
-        char   *blobname,
-        char   *data,
-        size_t  dataoffset,
-        size_t  datasize,
-        int     verbose)
+curl_readbytes_batch_retry_threaded(
+        char    *token,
+        char    *storageaccount,
+        char    *containername,
+        char   **blobnames,
+        char   **datas,
+        size_t  *dataoffsets,
+        size_t  *datasizes,
+        int      nblobs,
+        int      nthreads,
+        int      integrity,
+        int      fresh,
+        int      nretry,
+        int      verbose)
 {
-    char authorization[BUFFER_SIZE];
-    curl_authorization(token, authorization);
+    nthreads = MAX(MIN(nthreads, nblobs), 1);
+    int threadid;
+    long thread_responsecode_http[nthreads];
+    long thread_responsecode_curl[nthreads];
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        thread_responsecode_http[threadid] = 200;
+        thread_responsecode_curl[threadid] = (long)CURLE_OK;
+    }
+
+#pragma omp parallel num_threads(nthreads) default(shared)
+{
+    int threadid = omp_get_thread_num();
+    int iblob;
+#pragma omp for schedule(dynamic,1)
+    for (iblob = 0; iblob < nblobs; iblob++) {
+        if (datasizes[iblob] == 0) {
+            continue;
+        }
+        struct RequestContext context;
+        struct ResponseCodes responsecodes;
+        if (curl_request_context_init(&context, token, NULL, storageaccount, containername, blobnames[iblob]) != 0) {
+            responsecodes = curl_request_context_error(&context);
+        } else {
+            responsecodes = curl_readbytes_retry(&context, datas[iblob], dataoffsets[iblob], datasizes[iblob], integrity, fresh, nretry, verbose);
+            curl_request_context_free(&context);
+        }
+        thread_responsecode_http[threadid] = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        thread_responsecode_curl[threadid] = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+} /* end pragma omp */
 
-    char byterange[BUFFER_SIZE];
-    curl_byterange(byterange, dataoffset, datasize);
+    struct ResponseCodes responsecodes;
+    responsecodes.http = 200;
+    responsecodes.curl = (long)CURLE_OK;
+    for (threadid = 0; threadid < nthreads; threadid++) {
+        responsecodes.http = MAX(responsecodes.http, thread_responsecode_http[threadid]);
+        responsecodes.curl = MAX(responsecodes.curl, thread_responsecode_curl[threadid]);
+    }
+    return responsecodes;
+}
 
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, authorization);
-    headers = curl_slist_append(headers, API_HEADER);
-    headers = curl_slist_append(headers, byterange);
+/*
+Block pipeline.  A bounded queue of filled blocks that is consumed by a fixed set of upload
+(p)threads, so that the producer (e.g. an encoder on the Julia side) keeps filling blocks while
+the earlier blocks are uploaded.  The producer owns `nslots` buffers.  A filled slot is pushed with
+its block-id, and, once its upload completes, the slot is marked as done and the notify callback is
+called.  A slot is pushed at most once before it is reaped, so the queue (of length `nslots`) can
+not overflow, and the push never blocks.  A pipeline that is abandoned (e.g. by a writer that is
+garbage collected without being closed) is cancelled before it is finished, so that only the blocks
+that are already being uploaded are waited for.
+*/
+#define PIPELINE_SLOT_FREE 0
+#define PIPELINE_SLOT_BUSY 1
+#define PIPELINE_SLOT_DONE 2
 
-    struct DataStruct datastruct;
-    datastruct.data = data;
-    datastruct.datasize = datasize;
-    datastruct.currentsize = 0;
+struct PipelineBlock {
+    char   *token;
+    char   *blockid;
+    char   *data;
+    size_t  datasize;
+    size_t  index;
+    int     slot;
+};
 
-    CURL *curlhandle = curl_easy_init();
+struct BlockPipeline {
+    char                 *storageaccount;
+    char                 *containername;
+    char                 *blobname;
+    int                   nretry;
+    int                   verbose;
+    int                   integrity;
+    uint64_t             *crcs;
+    size_t               *datasizes;
+    size_t                nblocks;
+    size_t                capacity;
+    int                   nslots;
+    struct PipelineBlock *queue;
+    int                   head;
+    int                   count;
+    int                  *slotstate;
+    int                   closed;
+    pthread_mutex_t       lock;
+    pthread_cond_t        notempty;
+    int                   nworkers;
+    pthread_t            *workers;
+    notify_callback       notify;
+    void                 *notifyarg;
+    struct ResponseCodes  responsecodes;
+};
 
-    char url[BUFFER_SIZE];
-    snprintf(
-        url,
-        BUFFER_SIZE,
-        "https://%s.blob.core.windows.net/%s/%s",
-        storageaccount,
-        containername,
-        blobname);
+void *
+curl_pipeline_main(
+        void *pipelinevoid)
+{
+    struct BlockPipeline *pipeline = (struct BlockPipeline*)pipelinevoid;
+    struct PipelineBlock block;
+    struct ResponseCodes responsecodes;
+    affinity_owned();
 
-    curl_easy_setopt(curlhandle, CURLOPT_URL, url);
-    curl_easy_setopt(curlhandle, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curlhandle, CURLOPT_SSL_VERIFYPEER, 0); /* TODO */
-    curl_easy_setopt(curlhandle, CURLOPT_TIMEOUT, CURLE_TIMEOUT);
-    curl_easy_setopt(curlhandle, CURLOPT_VERBOSE, verbose);
-    curl_easy_setopt(curlhandle, CURLOPT_WRITEFUNCTION, write_callback_readdata);
-    curl_easy_setopt(curlhandle, CURLOPT_WRITEDATA, (void*)&datastruct);
+    while (1) {
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->count == 0 && pipeline->closed == 0) {
+            pthread_cond_wait(&pipeline->notempty, &pipeline->lock);
+        }
+        if (pipeline->count == 0) {
+            pthread_mutex_unlock(&pipeline->lock);
+            break;
+        }
+        block = pipeline->queue[pipeline->head];
+        pipeline->head = (pipeline->head + 1) % pipeline->nslots;
+        pipeline->count--;
+        pthread_mutex_unlock(&pipeline->lock);
 
-    char errbuf[CURL_ERROR_SIZE];
-    curl_easy_setopt(curlhandle, CURLOPT_ERRORBUFFER, errbuf);
+        /* the token is pushed with each block (it may be refreshed during a long write) */
+        uint64_t crc = 0;
+        struct RequestContext context;
+        if (curl_request_context_init(&context, block.token, NULL, pipeline->storageaccount, pipeline->containername, pipeline->blobname) != 0) {
+            responsecodes = curl_request_context_error(&context);
+        } else {
+            responsecodes = curl_writebytes_block_retry(&context, block.blockid, block.data, block.datasize, pipeline->integrity != 0 ? &crc : NULL, 0, pipeline->nretry, pipeline->verbose);
+            curl_request_context_free(&context);
+        }
+        free(block.token);
+        free(block.blockid);
 
-    long responsecode_http = 200;
-    CURLcode responsecode_curl = curl_easy_perform(curlhandle);
-    curl_easy_getinfo(curlhandle, CURLINFO_RESPONSE_CODE, &responsecode_http);
+        pthread_mutex_lock(&pipeline->lock);
+        if (pipeline->integrity != 0) {
+            pipeline->crcs[block.index] = crc;
+            pipeline->datasizes[block.index] = block.datasize;
+        }
+        pipeline->responsecodes.http = MAX(pipeline->responsecodes.http, responsecodes.http);
+        pipeline->responsecodes.curl = MAX(pipeline->responsecodes.curl, responsecodes.curl);
+        pipeline->slotstate[block.slot] = PIPELINE_SLOT_DONE;
+        pthread_mutex_unlock(&pipeline->lock);
 
-    if ( (responsecode_curl != CURLE_OK || responsecode_http >= 300) && verbose > 0) {
-        printf("Error, bad read, http response code=%ld, curl response=%s\n", responsecode_http, errbuf);
+        if (pipeline->notify != NULL) {
+            pipeline->notify(pipeline->notifyarg);
+        }
     }
+    return NULL;
+}
 
-    curl_easy_cleanup(curlhandle);
-    curl_slist_free_all(headers);
-
-    struct ResponseCodes responsecodes;
-    responsecodes.http = responsecode_http;
-    responsecodes.curl = (long)responsecode_curl;
+struct BlockPipeline *
+curl_pipeline_new(
+        char            *storageaccount,
+        char            *containername,
+        char            *blobname,
+        int              nworkers,
+        int              nslots,
+        int              integrity,
+        int              nretry,
+        int              verbose,
+        notify_callback  notify,
+        void            *notifyarg)
+{
+    int islot, iworker;
+    struct BlockPipeline *pipeline = (struct BlockPipeline*)malloc(sizeof(struct BlockPipeline));
+    if (pipeline == NULL) {
+        printf("Error, unable to allocate the block pipeline.\n");
+        return NULL;
+    }
+    pipeline->storageaccount = strdup(storageaccount);
+    pipeline->containername = strdup(containername);
+    pipeline->blobname = strdup(blobname);
+    pipeline->nretry = nretry;
+    pipeline->verbose = verbose;
+    pipeline->integrity = integrity;
+    pipeline->crcs = NULL;
+    pipeline->datasizes = NULL;
+    pipeline->nblocks = 0;
+    pipeline->capacity = 0;
+    pipeline->nslots = nslots;
+    pipeline->queue = (struct PipelineBlock*)malloc(nslots*sizeof(struct PipelineBlock));
+    pipeline->head = 0;
+    pipeline->count = 0;
+    pipeline->slotstate = (int*)malloc(nslots*sizeof(int));
+    pipeline->workers = (pthread_t*)malloc(nworkers*sizeof(pthread_t));
+    if (pipeline->storageaccount == NULL || pipeline->containername == NULL || pipeline->blobname == NULL || pipeline->queue == NULL || pipeline->slotstate == NULL || pipeline->workers == NULL) {
+        printf("Error, unable to allocate the block pipeline.\n");
+        free(pipeline->workers);
+        free(pipeline->queue);
+        free(pipeline->slotstate);
+        free(pipeline->storageaccount);
+        free(pipeline->containername);
+        free(pipeline->blobname);
+        free(pipeline);
+        return NULL;
+    }
+    for (islot = 0; islot < nslots; islot++) {
+        pipeline->slotstate[islot] = PIPELINE_SLOT_FREE;
+    }
+    pipeline->closed = 0;
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->notempty, NULL);
+    pipeline->notify = notify;
+    pipeline->notifyarg = notifyarg;
+    pipeline->responsecodes.http = 200;
+    pipeline->responsecodes.curl = 0;
 
-    return responsecodes;
+    pipeline->nworkers = 0;
+    for (iworker = 0; iworker < nworkers; iworker++) {
+        if (pthread_create(&pipeline->workers[iworker], NULL, curl_pipeline_main, (void*)pipeline) != 0) {
+            printf("Warning, unable to create upload thread %d/%d for block pipeline.\n", iworker+1, nworkers);
+            break;
+        }
+        pipeline->nworkers++;
+    }
+    if (pipeline->nworkers == 0) {
+        printf("Error, unable to create any upload threads for block pipeline.\n");
+        pipeline->responsecodes.curl = (long)CURLE_FAILED_INIT;
+    }
+    return pipeline;
 }
 
-struct ResponseCodes
-curl_readbytes_retry(
-        char   *token,
-        char   *storageaccount,
-        char   *containername,
-        char   *blobname,
-        char   *data,
-        size_t  dataoffset,
-        size_t  datasize,
-        int     nretry,
-        int     verbose)
+/*
+Push the filled slot `slot` for upload.  Returns 0 on success, and -1 if the slot is busy or
+if the pipeline has no upload threads.
+*/
+int
+curl_pipeline_push(
+        struct BlockPipeline *pipeline,
+        char                 *token,
+        char                 *blockid,
+        char                 *data,
+        size_t                datasize,
+        int                   slot)
 {
-    struct ResponseCodes responsecodes;
-    int iretry;
-    for (iretry = 0; iretry < nretry; iretry++) {
-        responsecodes = curl_readbytes(token, storageaccount, containername, blobname, data, dataoffset, datasize, verbose);
-        if (isrestretrycode(responsecodes) == 0) {
-            break;
+    pthread_mutex_lock(&pipeline->lock);
+    if (pipeline->nworkers == 0 || pipeline->slotstate[slot] != PIPELINE_SLOT_FREE) {
+        pthread_mutex_unlock(&pipeline->lock);
+        return -1;
+    }
+    /* the CRCs are stored by block index, so that they can be combined in order once the uploads are done */
+    if (pipeline->integrity != 0 && pipeline->nblocks == pipeline->capacity) {
+        int capacity = MAX(2*pipeline->capacity, 64);
+        uint64_t *crcs = (uint64_t*)realloc(pipeline->crcs, capacity*sizeof(uint64_t));
+        if (crcs != NULL) {
+            pipeline->crcs = crcs;
         }
-        if (verbose > 0) {
-            printf("Warning, bad read, retrying, %d/%d, http responsecode=%ld, curl responsecode=%ld.\n", iretry+1, nretry, responsecodes.http, responsecodes.curl);
+        size_t *datasizes = (size_t*)realloc(pipeline->datasizes, capacity*sizeof(size_t));
+        if (datasizes != NULL) {
+            pipeline->datasizes = datasizes;
         }
-        if (exponential_backoff(iretry) != 0) {
-            printf("Warning, exponential backoff failed\n");
+        if (crcs == NULL || datasizes == NULL) {
+            printf("Error, unable to allocate the CRCs of the pipeline.\n");
+            pthread_mutex_unlock(&pipeline->lock);
+            return -1;
+        }
+        pipeline->capacity = capacity;
+    }
+    struct PipelineBlock *block = &(pipeline->queue[(pipeline->head + pipeline->count) % pipeline->nslots]);
+    block->token = strdup(token);
+    block->blockid = strdup(blockid);
+    if (block->token == NULL || block->blockid == NULL) {
+        printf("Error, unable to allocate the block of the pipeline.\n");
+        free(block->token);
+        free(block->blockid);
+        pthread_mutex_unlock(&pipeline->lock);
+        return -1;
+    }
+    block->data = data;
+    block->datasize = datasize;
+    block->index = pipeline->nblocks++;
+    block->slot = slot;
+    pipeline->count++;
+    pipeline->slotstate[slot] = PIPELINE_SLOT_BUSY;
+    pthread_cond_signal(&pipeline->notempty);
+    pthread_mutex_unlock(&pipeline->lock);
+    return 0;
+}
+
+/*
+Returns a slot whose upload has completed (marking it as free), or -1 if there is no such slot.
+*/
+int
+curl_pipeline_reap(
+        struct BlockPipeline *pipeline)
+{
+    int islot, slot = -1;
+    pthread_mutex_lock(&pipeline->lock);
+    for (islot = 0; islot < pipeline->nslots; islot++) {
+        if (pipeline->slotstate[islot] == PIPELINE_SLOT_DONE) {
+            pipeline->slotstate[islot] = PIPELINE_SLOT_FREE;
+            slot = islot;
             break;
         }
     }
-    return responsecodes;
+    pthread_mutex_unlock(&pipeline->lock);
+    return slot;
 }
 
+/*
+The maximum response codes of the uploads that have completed so far.
+*/
 struct ResponseCodes
-curl_readbytes_retry_threaded(
-        char   *token,
-        char   *storageaccount,
-        char   *containername,
-        char   *blobname,
-        char   *data,
-        size_t  dataoffset,
-        size_t  datasize,
-        int     nthreads,
-        int     nretry,
-        int     verbose)
+curl_pipeline_status(
+        struct BlockPipeline *pipeline)
 {
-    size_t thread_datasize = datasize/nthreads;
-    size_t thread_dataremainder = datasize%nthreads;
+    pthread_mutex_lock(&pipeline->lock);
+    struct ResponseCodes responsecodes = pipeline->responsecodes;
+    pthread_mutex_unlock(&pipeline->lock);
+    return responsecodes;
+}
 
-    long thread_responsecode_http[nthreads];
-    long thread_responsecode_curl[nthreads];
+/*
+Drop the queued blocks whose uploads have not started (their slots are marked as free), such that a following
+curl_pipeline_finish only waits for the uploads that are in flight.  The pipeline is marked as failed, so that its
+blocks are not committed.
+*/
+void
+curl_pipeline_cancel(
+        struct BlockPipeline *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->count > 0) {
+        struct PipelineBlock *block = &(pipeline->queue[pipeline->head]);
+        free(block->token);
+        free(block->blockid);
+        pipeline->slotstate[block->slot] = PIPELINE_SLOT_FREE;
+        pipeline->head = (pipeline->head + 1) % pipeline->nslots;
+        pipeline->count--;
+    }
+    pipeline->responsecodes.curl = MAX(pipeline->responsecodes.curl, (long)CURLE_ABORTED_BY_CALLBACK);
+    pthread_mutex_unlock(&pipeline->lock);
+}
 
-#pragma omp parallel num_threads(nthreads)
+/*
+Wait for the queued blocks to be uploaded, stop the upload threads, and free the pipeline.  With integrity
+checking, and if crc is not NULL, then the CRC64 of the concatenated blocks is returned in crc.
+*/
+struct ResponseCodes
+curl_pipeline_finish(
+        struct BlockPipeline *pipeline,
+        uint64_t             *crc)
 {
-    int threadid = omp_get_thread_num();
-    size_t thread_firstbyte = threadid*thread_datasize;
-    size_t _thread_datasize = thread_datasize;
-    if (threadid < thread_dataremainder) {
-        thread_firstbyte += threadid;
-        _thread_datasize += 1;
-    } else {
-        thread_firstbyte += thread_dataremainder;
+    int iworker;
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->closed = 1;
+    pthread_cond_broadcast(&pipeline->notempty);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    for (iworker = 0; iworker < pipeline->nworkers; iworker++) {
+        pthread_join(pipeline->workers[iworker], NULL);
     }
+    struct ResponseCodes responsecodes = pipeline->responsecodes;
 
-    struct ResponseCodes responsecodes = curl_readbytes_retry(token, storageaccount, containername, blobname, data+thread_firstbyte, dataoffset+thread_firstbyte, _thread_datasize, nretry, verbose);
-    thread_responsecode_http[threadid] = responsecodes.http;
-    thread_responsecode_curl[threadid] = responsecodes.curl;
-} /* end pragma omp */
-    long responsecode_http = 200;
-    long responsecode_curl = (long)CURLE_OK;
-    int threadid;
-    for (threadid = 0; threadid < nthreads; threadid++) {
-        responsecode_http = MAX(responsecode_http, thread_responsecode_http[threadid]);
-        responsecode_curl = MAX(responsecode_curl, thread_responsecode_curl[threadid]);
+    if (pipeline->integrity != 0 && crc != NULL) {
+        size_t iblock;
+        *crc = 0;
+        for (iblock = 0; iblock < pipeline->nblocks; iblock++) {
+            *crc = iblock == 0 ? pipeline->crcs[0] : curl_crc64_combine(*crc, pipeline->crcs[iblock], pipeline->datasizes[iblock]);
+        }
     }
-    struct ResponseCodes responsecodes;
-    responsecodes.http = responsecode_http;
-    responsecodes.curl = responsecode_curl;
+
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->notempty);
+    free(pipeline->workers);
+    free(pipeline->queue);
+    free(pipeline->slotstate);
+    free(pipeline->crcs);
+    free(pipeline->datasizes);
+    free(pipeline->storageaccount);
+    free(pipeline->containername);
+    free(pipeline->blobname);
+    free(pipeline);
 
     return responsecodes;
 }
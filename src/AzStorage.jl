@@ -1,9 +1,10 @@
 module AzStorage
 
-using AbstractStorage, AzSessions, AzStorage_jll, Base64, DelimitedFiles, HTTP, LightXML, Serialization, Sockets
+using AbstractStorage, AzSessions, AzStorage_jll, Base64, DelimitedFiles, HTTP, Libdl, LightXML, Mmap, Serialization, Sockets, Zstd_jll
 
 # https://docs.microsoft.com/en-us/rest/api/storageservices/common-rest-api-error-codes
 const RETRYABLE_HTTP_ERRORS = [
+    429, # Too many requests
     500, # Internal server error
     503] # Service unavailable
 
@@ -15,11 +16,58 @@ const RETRYABLE_CURL_ERRORS = [
     56] # Failure with received network data.
 
 # https://docs.microsoft.com/en-us/rest/api/storageservices/versioning-for-the-azure-storage-services
-const API_VERSION = "2020-04-08"
+const API_VERSION = "2020-10-02"
 
 function __init__()
-    ccall((:curl_init, libAzStorage), Cvoid, (Cint, Cint, Ptr{Clong}, Ptr{Clong}, Cstring),
-        length(RETRYABLE_HTTP_ERRORS), length(RETRYABLE_CURL_ERRORS), RETRYABLE_HTTP_ERRORS, RETRYABLE_CURL_ERRORS, API_VERSION)
+    ccall((:curl_init, libAzStorage), Cvoid, (Cint, Cint, Ptr{Clong}, Ptr{Clong}, Cstring, Cint),
+        length(RETRYABLE_HTTP_ERRORS), length(RETRYABLE_CURL_ERRORS), RETRYABLE_HTTP_ERRORS, RETRYABLE_CURL_ERRORS, API_VERSION, Sys.CPU_THREADS)
+    atexit(() -> ccall((:curl_cleanup, libAzStorage), Cvoid, ()))
+    haskey(ENV, "AZSTORAGE_ENDPOINT") && set_endpoint!(ENV["AZSTORAGE_ENDPOINT"])
+    if haskey(ENV, "AZSTORAGE_AFFINITY")
+        node = tryparse(Int, ENV["AZSTORAGE_AFFINITY"])
+        set_affinity!(node === nothing ? ENV["AZSTORAGE_AFFINITY"] : node)
+    end
+end
+
+const _ENDPOINT = Ref("https://%s.blob.core.windows.net")
+
+endpoint(storageaccount) = replace(_ENDPOINT[], "%s" => storageaccount)
+
+"""
+    AzStorage.set_endpoint!(endpoint)
+
+Set the blob service endpoint, where `"%s"` is replaced by the storage account name.  The default is
+`"https://%s.blob.core.windows.net"`.  A local endpoint (e.g. Azurite, or the mock server in `benchmark/`)
+is, for example, `"http://127.0.0.1:10000/%s"`.  The endpoint can also be set with the `AZSTORAGE_ENDPOINT`
+environment variable.
+"""
+function set_endpoint!(format::AbstractString)
+    ccall((:curl_endpoint, libAzStorage), Cint, (Cstring,), format) == 0 || throw(ArgumentError("AzStorage: endpoint must contain exactly one \"%s\""))
+    _ENDPOINT[] = format
+    nothing
+end
+
+"""
+    AzStorage.set_affinity!(node)
+    AzStorage.set_affinity!(nic)
+
+Pin the threads of the C layer that make requests (the OpenMP threads, the drivers of the threaded and asynchronous
+transfers, and the workers of the streaming writer) to the cpus of the NUMA node `node::Integer`, or of the node of the network interface
+`nic::AbstractString` (e.g. `"eth0"`), so that on multi-socket hosts the threads stay near the NIC.  The pinned threads
+also keep their (codec) scratch buffers across transfers, allocated on their node.  A Julia thread that runs a transfer itself (e.g.
+`readv!`, or the batched `read!` and `write`) is not pinned.  `AzStorage.set_affinity!(-1)` unpins the threads.  This is only
+available on Linux, and the affinity can also be set with the `AZSTORAGE_AFFINITY` environment variable (a node or a
+NIC).  See `AzStorage.thread_stats` for the per-thread throughput.
+"""
+function set_affinity!(node::Integer)
+    ccall((:curl_affinity, libAzStorage), Cint, (Cint,), node) == 0 || throw(ArgumentError("AzStorage: unable to set the affinity to NUMA node $node"))
+    nothing
+end
+
+function set_affinity!(nic::AbstractString)
+    node = ccall((:curl_nic_node, libAzStorage), Cint, (Cstring,), nic)
+    node < 0 && throw(ArgumentError("AzStorage: the NUMA node of the network interface $nic is not known"))
+    set_affinity!(node)
 end
 
 mutable struct AzContainer{A<:AzSessionAbstract} <: Container
@@ -28,8 +76,17 @@ mutable struct AzContainer{A<:AzSessionAbstract} <: Container
     prefix::String
     session::A
     nthreads::Int
+    nrequests::Int
+    http2::Bool
     nretry::Int
     verbose::Int
+    cachettl::Float64
+    autotune::Bool
+    integrity::Bool
+    compression::String
+    compressionlevel::Int
+    cachedir::String
+    cachesize::Int
 end
 
 function Base.copy(container::AzContainer)
@@ -39,8 +96,17 @@ function Base.copy(container::AzContainer)
         container.prefix,
         copy(container.session),
         container.nthreads,
+        container.nrequests,
+        container.http2,
         container.nretry,
-        container.verbose)
+        container.verbose,
+        container.cachettl,
+        container.autotune,
+        container.integrity,
+        container.compression,
+        container.compressionlevel,
+        container.cachedir,
+        container.cachesize)
 end
 
 struct AzObject
@@ -49,7 +115,7 @@ struct AzObject
 end
 
 """
-    open(container, blobname) -> AzObject
+    open(container, blobname[; read=false, write=false]) -> AzObject
 
 Create a handle to an Azure blob with the name `blobname::String` in the
 Azure storage container: `container::AzContainer`.
@@ -59,10 +125,54 @@ Azure storage container: `container::AzContainer`.
 io = open(AzContainer("mycontainer"; storageaccount="myaccount"), "foo.bin")
 write(io, rand(10))
 ```
+
+If `write=true`, then an `IO` is returned that streams data to the blob.  The data is
+buffered into blocks of `blocksize` bytes, and each full block is uploaded in the background
+while at most `ninflight` blocks are in flight.  The block list is committed when the `IO` is
+closed.  Hence, memory use is bounded by `ninflight*blocksize`, regardless of the blob size.
+
+# Example:
+```julia
+open(AzContainer("mycontainer"; storageaccount="myaccount"), "foo.bin"; write=true) do io
+    for i = 1:1000
+        write(io, rand(1_000_000))
+    end
+end
+```
+
+# Additional keyword arguments (when `write=true`)
+* `blocksize=32_000_000` number of bytes per block (the learned block size if `container.autotune=true`)
+* `ninflight=container.nthreads` maximum number of blocks that are uploaded concurrently (the learned value if `container.autotune=true`)
+* `contenttype="application/octet-stream"` content type of the blob
+
+If `read=true`, then a seekable `IO` is returned that streams data from the blob.  The blob
+is fetched in blocks of `blocksize` bytes, and up to `nprefetch` blocks ahead of the current
+position are fetched in the background.  Hence, a sequential scan of the blob uses constant
+memory, and the network latency is overlapped with the consumer.
+
+# Example:
+```julia
+open(AzContainer("mycontainer"; storageaccount="myaccount"), "foo.bin"; read=true) do io
+    while !eof(io)
+        x = read!(io, Vector{Float64}(undef, 1_000_000))
+    end
+end
+```
+
+# Additional keyword arguments (when `read=true`)
+* `blocksize=32_000_000` number of bytes per block
+* `nprefetch=4` number of blocks to fetch ahead of the current position
 """
-function Base.open(container::AzContainer, name)
+function Base.open(container::AzContainer, name; read=false, write=false, blocksize=nothing, ninflight=writeninflight(container), nprefetch=4, contenttype="application/octet-stream")
+    (read && write) && throw(ArgumentError("AzStorage: `open` does not support simultaneous read and write"))
     mkpath(container)
-    AzObject(container, string(name))
+    o = AzObject(container, string(name))
+    if write
+        return AzObjectWriter(o; blocksize=blocksize === nothing ? writeblocksize(container) : blocksize, ninflight=ninflight, contenttype=contenttype)
+    elseif read
+        return AzObjectReader(o; blocksize=blocksize === nothing ? _MINBYTES_PER_BLOCK : blocksize, nprefetch=nprefetch)
+    end
+    o
 end
 
 """
@@ -92,30 +202,99 @@ The storage account must already exist.
 # Additional keyword arguments
 * `session=AzSession(;lazy=true,scope=$__OAUTH_SCOPE)` user credentials (see AzSessions.jl package).
 * `nthreads=Sys.CPU_THREADS` number of system threads that OpenMP will use to thread I/O.
+* `nrequests=0` if positive, use the event driven (curl_multi) engine with this many requests in flight, driven by up to `nthreads` threads.
+* `http2=false` when using the event driven engine, negotiate HTTP/2 and multiplex the requests of each driver thread over its connections.
 * `nretry=10` number of retries to the Azure service (when Azure throws a retryable error) before throwing an error.
 * `verbose=0` verbosity flag passed to libcurl.
+* `cachettl=0` if positive, cache container existence and blob properties (size, ETag, content-type) for `cachettl` seconds.
+* `autotune=false` if true, learn the block size and number of blocks in flight for writes from the measured throughput (see `AzStorage.calibrate!`).
+* `integrity=false` if true, check the integrity of transfers with CRC64 checksums (see below).
+* `compression=""` if `"zstd"`, compress the blocks of writes, and decompress the reads of compressed blobs (see below).
+* `compressionlevel=3` the compression level that is passed to the codec.
+* `cachedir=""` if not empty, cache the blocks of reads in this local directory (see below).
+* `cachesize=10_000_000_000` the maximum number of bytes in the local block cache.
+
+# Notes on autotuning
+With `autotune=true`, each multi-block write is timed, and the block size and the number of blocks in flight
+are adjusted, one at a time, towards higher throughput.  The learned values are kept per storage account, and are
+persisted to the file `ENV["AZSTORAGE_TUNING_FILE"]` (default `~/.azstorage/tuning`) so that later sessions start
+from them.
+
+# Notes on integrity checking
+With `integrity=true`, the CRC64 of each block (or single-shot blob) is computed by the thread that uploads it and sent
+with it, so that the service rejects a block that is corrupted in transit.  The block CRCs are combined into the CRC64 of
+the blob, which is stored in the `crc64` metadata of the blob (see `AzStorage.crc64`).  Reads ask the service for the
+CRC64 of each range, and verify it in the thread that reads the range.  Since the service computes the CRC64 for ranges
+of at most 4 MiB, reads are split into ranges of at most 4 MiB.  A range that fails verification is retried, and, after
+`nretry` retries, reported as curl error 61.  Integrity checking applies to `write` (including batched writes),
+`read!`, `read`, `read_async!`, `write_async`, `serialize`, `writedlm`, the `open(...; write=true)` writer, and batched
+reads.  `readv!`, `deserialize` and the `open(...; read=true)` reader do not check integrity.  Reads use the threaded
+engine (ignoring `nrequests`) when integrity checking is enabled.
+
+# Notes on compression
+With `compression="zstd"`, the data of a `write` is cut into blocks that are compressed independently, each by the thread
+that uploads it.  For arrays with elements of more than one byte, the bytes of each block are shuffled (byte `k` of
+every element is stored contiguously) before compression, which often improves the compression of numerical data.
+The codec and the size of the uncompressed data are stored in the metadata of the blob, and the block list of the blob
+serves as the index of the compressed blocks.  Hence, `read!` with an `offset` only fetches and decompresses the blocks
+that overlap the requested range.  Compressed blobs are read (by `read!`, `read`, `read_async!`, `download`, `filesize`,
+`deserialize` and `open(...; read=true)`) as such only through a container with `compression` set, where `readv!` throws
+for a compressed blob, and, through other containers, all methods see the compressed bytes.
+Batched writes of small blobs and the streaming writer (`open(...; write=true)`, `serialize` and `writedlm`) do not
+compress.  Compressed writes do not resume (`resume=true`), are not autotuned, and, with `integrity=true`, the CRC64 of each
+(compressed) block is checked by the service, but the CRC64 of the blob is not stored.
+
+# Notes on token refresh
+A transfer of a large blob can outlive its OAuth2 token.  So, the threaded (multi-block) transfers of `write`, `read!`
+(including compressed blobs), `read_async!`, `write_async`, `upload`, `download` and `cp` run on a C thread, and take
+their token from a slot that is refreshed (from `token(session)`) every second while the transfer runs.  For `cp`
+between storage accounts, the slot also holds the token of the source container.  A request that is rejected (http 401
+or 403) asks for the token to be refreshed, and is retried once it is, so that only the blocks that were in flight when
+the token expired are sent again.  Other transfers fetch their token once per call.
+
+# Notes on caching
+The cache is invalidated by writes and deletes made through this package, but not by changes that are made
+by other clients.  So, `cachettl` should be chosen with the expected modification pattern of the container in mind.
+
+With `cachedir` set, reads (`read!` and `read`) go through a local (e.g. NVMe) cache of aligned 8 MiB blocks that are
+stored as files in `cachedir`, and served from memory maps of those files.  The blocks are keyed by the storage account,
+container, blob, and the ETag of the blob, so that a changed blob does not read stale blocks.  This costs one request per
+read for the ETag (none with `cachettl`, in which case the usual caveat applies).  The least recently used blocks are
+evicted once the cache holds more than `cachesize` bytes.  Concurrent reads of the same block, by the tasks of one
+process, fill the block once.  The cache directory can be shared by processes, but its size is only tracked within a
+process.  Compressed blobs are not cached.
 
 # Notes
 The container name can container "/"'s.  If this is the case, then the string preceding the first "/" will
 be the container name, and the string that remains will be pre-pended to the blob names.  This allows Azure
 to present blobs in a pseudo-directory structure.
 """
-function AzContainer(containername::AbstractString; storageaccount, session=AzSession(;lazy=true, scope=__OAUTH_SCOPE), nthreads=Sys.CPU_THREADS, nretry=10, verbose=0, prefix="")
+function AzContainer(containername::AbstractString; storageaccount, session=AzSession(;lazy=true, scope=__OAUTH_SCOPE), nthreads=Sys.CPU_THREADS, nrequests=0, http2=false, nretry=10, verbose=0, cachettl=0, autotune=false, integrity=false, compression="", compressionlevel=3, cachedir="", cachesize=10_000_000_000, prefix="")
+    compression ∈ _COMPRESSIONS || throw(ArgumentError("AzStorage: unsupported compression \"$compression\", must be one of $_COMPRESSIONS"))
     name = split(containername, '/')
     _containername = name[1]
     prefix *= lstrip('/'*join(name[2:end], '/'), '/')
-    AzContainer(String(storageaccount), String(_containername), String(prefix), session, nthreads, nretry, verbose)
+    AzContainer(String(storageaccount), String(_containername), String(prefix), session, nthreads, nrequests, http2, nretry, verbose, cachettl, autotune, integrity, String(compression), compressionlevel, String(cachedir), cachesize)
 end
 
-function AbstractStorage.Container(::Type{<:AzContainer}, d::Dict, session=AzSession(;lazy=true, scope=__OAUTH_SCOPE); nthreads = Sys.CPU_THREADS, nretry=10, verbose=0)
+function AbstractStorage.Container(::Type{<:AzContainer}, d::Dict, session=AzSession(;lazy=true, scope=__OAUTH_SCOPE); nthreads = Sys.CPU_THREADS, nrequests=0, http2=false, nretry=10, verbose=0, cachettl=0, autotune=false, integrity=false, compression="", compressionlevel=3, cachedir="", cachesize=10_000_000_000)
     AzContainer(
         d["storageaccount"],
         d["containername"],
         d["prefix"],
         session,
         get(d, "nthreads", nthreads),
+        get(d, "nrequests", nrequests),
+        get(d, "http2", http2),
         get(d, "nretry", nretry),
-        get(d, "verbose", verbose))
+        get(d, "verbose", verbose),
+        get(d, "cachettl", cachettl),
+        get(d, "autotune", autotune),
+        get(d, "integrity", integrity),
+        get(d, "compression", compression),
+        get(d, "compressionlevel", compressionlevel),
+        get(d, "cachedir", cachedir),
+        get(d, "cachesize", cachesize))
 end
 
 struct ResponseCodes
@@ -123,6 +302,8 @@ struct ResponseCodes
     curl::Int64
 end
 
+isfailure(r::ResponseCodes) = r.http >= 300 || r.curl > 0
+
 function isretryable(e::HTTP.StatusError)
     e.status ∈ RETRYABLE_HTTP_ERRORS && (return true)
     false
@@ -137,6 +318,13 @@ function retrywarn(i, s, e)
     @debug "retry $i, sleeping for $s seconds, e=$e"
 end
 
+# seconds from the Retry-After header of a throttling response (0 if there is none)
+function retryafter(e::HTTP.StatusError)
+    s = tryparse(Float64, HTTP.header(e.response, "Retry-After"))
+    s === nothing ? 0.0 : s
+end
+retryafter(e) = 0.0
+
 macro retry(retries, ex::Expr)
     quote
         local r
@@ -147,7 +335,7 @@ macro retry(retries, ex::Expr)
             catch e
                 (i <= $(esc(retries)) && isretryable(e)) || rethrow(e)
                 maximum_backoff = 256
-                s = min(2.0^(i-1), maximum_backoff) + rand()
+                s = max(min(2.0^(i-1), maximum_backoff) + rand(), min(retryafter(e), maximum_backoff))
                 retrywarn(i, s, e)
                 sleep(s)
             end
@@ -166,11 +354,12 @@ function Base.mkpath(c::AzContainer)
     if !iscontainer(c)
         @retry c.nretry HTTP.request(
             "PUT",
-            "https://$(c.storageaccount).blob.core.windows.net/$(c.containername)?restype=container",
+            "$(endpoint(c.storageaccount))/$(c.containername)?restype=container",
             Dict(
                 "Authorization" => "Bearer $(token(c.session))",
                 "x-ms-version" => API_VERSION),
             retry = false)
+        c.cachettl > 0 && lock(() -> _CONTAINER_CACHE[cachekey(c)] = time(), _CACHE_LOCK)
     end
     nothing
 end
@@ -179,6 +368,9 @@ const _MINBYTES_PER_BLOCK = 32_000_000
 const _MAXBYTES_PER_BLOCK = 400_000_000
 const _MAXBLOCKS_PER_BLOB = 500_000
 
+# number of concurrent requests, either OpenMP threads or (curl_multi) requests in flight
+nconcurrent(c::AzContainer) = c.nrequests > 0 ? c.nrequests : c.nthreads
+
 nblocks_error() = error("data is too large for a block-blob")
 function nblocks(nthreads::Integer, nbytes::Integer)
     nblocks = ceil(Int, nbytes/_MAXBYTES_PER_BLOCK + eps(Float64))
@@ -189,65 +381,512 @@ function nblocks(nthreads::Integer, nbytes::Integer)
     nblocks
 end
 
+#
+# Autotuning of writes.  For each storage account we keep the best (block size, blocks in flight)
+# found so far, and a trial setting that differs from the best in one of the two parameters.  Each
+# timed write is done with the trial setting.  If it beats the best throughput, then it becomes the
+# best and the search continues in the same direction, otherwise the direction is reversed, and,
+# after both directions fail, the search moves to the other parameter.  Since the throughput is
+# the bandwidth-delay product divided by the latency, this settles on the smallest in-flight volume
+# that saturates the link.  The throughput of a write is counted per wave of blocks in flight, so
+# that writes of different sizes compare, and the best throughput decays with each failed trial
+# (and is averaged when the best setting is timed again), so that an outlier does not freeze the
+# search.  The tuners are saved at most every `_TUNER_SAVE_INTERVAL` seconds.
+#
+mutable struct Tuner
+    blocksize::Int
+    nconcurrent::Int
+    throughput::Float64
+    trialblocksize::Int
+    trialnconcurrent::Int
+    parameter::Int
+    direction::Int
+    nfail::Int
+end
+
+Tuner(blocksize, nconcurrent, throughput=0.0) = Tuner(blocksize, nconcurrent, throughput, blocksize, nconcurrent, 1, 1, 0)
+
+const _MINBYTES_PER_TUNEDBLOCK = 4_000_000
+const _TUNER_LOCK = ReentrantLock()
+const _TUNERS = Dict{String,Tuner}()
+const _TUNER_DECAY = 0.9
+const _TUNER_SAVE_INTERVAL = 60.0
+const _TUNER_SAVED = Ref(0.0)
+const _TUNER_FILE_LOCK = ReentrantLock()
+
+tuningfile() = get(ENV, "AZSTORAGE_TUNING_FILE", joinpath(homedir(), ".azstorage", "tuning"))
+
+function loadtuners!()
+    isempty(_TUNERS) || return
+    try
+        isfile(tuningfile()) || return
+        x = readdlm(tuningfile(), ' ', String)
+        for i = 1:size(x,1)
+            _TUNERS[x[i,1]] = Tuner(parse(Int, x[i,2]), parse(Int, x[i,3]), parse(Float64, x[i,4]))
+        end
+    catch e
+        @debug "unable to load tuning file $(tuningfile()), e=$e"
+    end
+end
+
+# rows of the tuning file, the caller holds _TUNER_LOCK
+tunerrows() = [[account, tuner.blocksize, tuner.nconcurrent, tuner.throughput] for (account,tuner) in _TUNERS]
+
+# the caller does not hold _TUNER_LOCK; the file is replaced in one step, so a reader never sees a partial file
+function savetuners(rows)
+    lock(_TUNER_FILE_LOCK) do
+        try
+            mkpath(dirname(tuningfile()))
+            tmp = "$(tuningfile()).$(getpid())"
+            writedlm(tmp, rows, ' ')
+            mv(tmp, tuningfile(); force=true)
+        catch e
+            @debug "unable to save tuning file $(tuningfile()), e=$e"
+        end
+    end
+end
+
+function tuner(c::AzContainer)
+    lock(_TUNER_LOCK) do
+        loadtuners!()
+        get!(() -> Tuner(_MINBYTES_PER_BLOCK, nconcurrent(c)), _TUNERS, c.storageaccount)
+    end
+end
+
+# (block size, blocks in flight) to use for the next write, and a copy of `c` with that concurrency
+function tuned(c::AzContainer)
+    t = tuner(c)
+    blocksize,n = lock(() -> (t.trialblocksize, t.trialnconcurrent), _TUNER_LOCK)
+    _c = copy(c)
+    c.nrequests > 0 ? (_c.nrequests = n) : (_c.nthreads = n)
+    blocksize, _c
+end
+
+function measure!(c::AzContainer, blocksize, n, nblocks, elapsed)
+    t = tuner(c)
+    rows = lock(_TUNER_LOCK) do
+        (blocksize == t.trialblocksize && n == t.trialnconcurrent) || return nothing
+        # a partial last wave takes about as long as a full one
+        throughput = cld(nblocks, n) * n * blocksize / elapsed
+        if blocksize == t.blocksize && n == t.nconcurrent
+            t.throughput = t.throughput > 0 ? (t.throughput + throughput) / 2 : throughput
+            t.nfail = 0
+        elseif throughput > t.throughput
+            t.blocksize,t.nconcurrent,t.throughput = blocksize,n,throughput
+            t.nfail = 0
+        else
+            t.throughput *= _TUNER_DECAY
+            t.direction = -t.direction
+            t.nfail += 1
+            if t.nfail == 2
+                t.parameter = 3 - t.parameter
+                t.nfail = 0
+            end
+        end
+        if t.parameter == 1
+            t.trialblocksize = clamp(t.direction > 0 ? 2*t.blocksize : div(t.blocksize, 2), _MINBYTES_PER_TUNEDBLOCK, _MAXBYTES_PER_BLOCK)
+            t.trialnconcurrent = t.nconcurrent
+        else
+            t.trialblocksize = t.blocksize
+            t.trialnconcurrent = max(1, t.direction > 0 ? ceil(Int, 1.5*t.nconcurrent) : div(2*t.nconcurrent, 3))
+        end
+        time() - _TUNER_SAVED[] < _TUNER_SAVE_INTERVAL && return nothing
+        _TUNER_SAVED[] = time()
+        tunerrows()
+    end
+    rows === nothing || savetuners(rows)
+    nothing
+end
+
+writeblocksize(c::AzContainer) = c.autotune ? tuner(c).blocksize : _MINBYTES_PER_BLOCK
+writeninflight(c::AzContainer) = c.autotune ? tuner(c).nconcurrent : nconcurrent(c)
+
+"""
+    AzStorage.calibrate!(container[; nbytes=1_000_000_000, ntrials=8])
+
+Seed the autotuner for the storage account of `container::AzContainer` by timing `ntrials` writes of
+`nbytes` bytes to a scratch blob in `container`.  The scratch blob is removed afterwards.  The learned
+settings are used by containers that are constructed with `autotune=true`.
+"""
+function calibrate!(c::AzContainer; nbytes=1_000_000_000, ntrials=8)
+    _c = copy(c)
+    _c.autotune = true
+    data = rand(UInt8, nbytes)
+    o = "azstorage-calibrate-$(string(rand(UInt64); base=16))"
+    try
+        for i = 1:ntrials
+            writebytes(_c, o, data)
+        end
+    finally
+        rm(c, o)
+    end
+    t = tuner(c)
+    blocksize,n,throughput,rows = lock(() -> (t.blocksize, t.nconcurrent, t.throughput, tunerrows()), _TUNER_LOCK)
+    savetuners(rows)
+    blocksize,n,throughput
+end
+
 _normpath(s) = Sys.iswindows() ? replace(normpath(s), "\\"=>"/") : normpath(s)
 
 addprefix(c::AzContainer, o) = c.prefix == "" ? o : _normpath("$(c.prefix)/$o")
 
-function writebytes(c::AzContainer, o::AbstractString, data::DenseArray{UInt8}; contenttype="application/octet-stream")
-    function writebytes_blob(c, o, data, contenttype)
-        @retry c.nretry HTTP.request(
-            "PUT",
-            "https://$(c.storageaccount).blob.core.windows.net/$(c.containername)/$(addprefix(c,o))",
-            Dict(
-                "Authorization" => "Bearer $(token(c.session))",
-                "x-ms-version" => API_VERSION,
-                "Content-Length" => "$(length(data))",
-                "Content-Type" => contenttype,
-                "x-ms-blob-type" => "BlockBlob"),
-            data,
-            retry = false,
-            verbose = c.verbose)
-        nothing
+#
+# Metadata cache.  The cache is shared by all container handles, and an entry is used only
+# if it is younger than the `cachettl` of the handle that asks for it.  Invalidation happens
+# irrespective of `cachettl` so that a handle with caching disabled can still write.
+#
+struct BlobProperties
+    size::Int
+    etag::String
+    contenttype::String
+end
+
+const _CACHE_LOCK = ReentrantLock()
+const _CONTAINER_CACHE = Dict{Tuple{String,String},Float64}()
+const _PROPERTIES_CACHE = Dict{Tuple{String,String,String},Tuple{Float64,BlobProperties}}()
+const _CODEC_CACHE = Dict{Tuple{String,String,String},Tuple{Float64,Any}}()
+
+cachekey(c::AzContainer) = (c.storageaccount, c.containername)
+cachekey(c::AzContainer, o) = (c.storageaccount, c.containername, addprefix(c,o))
+
+function cacheproperties!(c::AzContainer, o, properties::BlobProperties)
+    c.cachettl > 0 && lock(() -> _PROPERTIES_CACHE[cachekey(c,o)] = (time(), properties), _CACHE_LOCK)
+    properties
+end
+
+function cachedproperties(c::AzContainer, o)
+    c.cachettl > 0 || return nothing
+    t,properties = lock(() -> get(_PROPERTIES_CACHE, cachekey(c,o), (0.0, nothing)), _CACHE_LOCK)
+    time() - t < c.cachettl ? properties : nothing
+end
+
+function invalidate!(c::AzContainer, o)
+    lock(_CACHE_LOCK) do
+        delete!(_PROPERTIES_CACHE, cachekey(c,o))
+        delete!(_CODEC_CACHE, cachekey(c,o))
+    end
+end
+
+function invalidate!(c::AzContainer)
+    key = cachekey(c)
+    lock(_CACHE_LOCK) do
+        delete!(_CONTAINER_CACHE, key)
+        filter!(entry -> (entry.first[1],entry.first[2]) != key, _PROPERTIES_CACHE)
+        filter!(entry -> (entry.first[1],entry.first[2]) != key, _CODEC_CACHE)
+    end
+    nothing
+end
+
+function BlobProperties(r::HTTP.Response, size)
+    BlobProperties(size, HTTP.header(r, "ETag"), HTTP.header(r, "Content-Type"))
+end
+
+#
+# CRC64 (computed in the C layer) for integrity checking, see the `integrity` keyword argument of `AzContainer`
+#
+const _CRC64_MAXIMUM_RANGE = 4_194_304
+
+"""
+    AzStorage.crc64(data[, crc=0]) -> UInt64
+
+Returns the CRC64 (as used by the storage service) of the bytes in `data::DenseArray{UInt8}`.  If `crc`
+is given, then it is the CRC64 of the bytes that precede `data`.
+"""
+crc64(data::DenseArray{UInt8}, crc=UInt64(0)) =
+    ccall((:curl_crc64, libAzStorage), UInt64, (UInt64, Ptr{UInt8}, Csize_t), crc, data, length(data))
+
+"""
+    AzStorage.crc64(container, "blobname") -> Union{UInt64,Nothing}
+
+Returns the CRC64 of the blob "blobname" in `container::AzContainer` that is stored in its metadata by a write with
+integrity checking (`AzContainer(...; integrity=true)`), or `nothing` if the blob has no such metadata.
+"""
+function crc64(c::AzContainer, o::AbstractString)
+    r = @retry c.nretry HTTP.request(
+        "HEAD",
+        "$(endpoint(c.storageaccount))/$(c.containername)/$(addprefix(c,o))",
+        Dict(
+            "Authorization" => "Bearer $(token(c.session))",
+            "x-ms-version" => API_VERSION),
+        retry = false)
+    s = HTTP.header(r, "x-ms-meta-crc64")
+    s == "" ? nothing : crc64parse(s)
+end
+
+# the service expects the base64 encoding of the little-endian bytes
+crc64string(crc) = base64encode(reinterpret(UInt8, [htol(UInt64(crc))]))
+crc64parse(s) = ltoh(reinterpret(UInt64, base64decode(s))[1])
+crc64headers(crc) = ("x-ms-content-crc64" => crc64string(crc), "x-ms-meta-crc64" => crc64string(crc))
+
+# CRC64 of a blob from the CRC64s of its blocks (with the block layout of `writebytes_block`)
+function crc64combine(blockcrcs, nbytes)
+    _nblocks = length(blockcrcs)
+    crc = blockcrcs[1]
+    for i = 2:_nblocks
+        crc = ccall((:curl_crc64_combine, libAzStorage), UInt64, (UInt64, UInt64, Csize_t),
+            crc, blockcrcs[i], div(nbytes, _nblocks) + (i <= rem(nbytes, _nblocks) ? 1 : 0))
+    end
+    crc
+end
+
+struct CRC64Error <: Exception
+    msg::String
+end
+
+isretryable(e::CRC64Error) = true
+
+function checkcrc64(r::HTTP.Response, verify)
+    verify || return r
+    s = HTTP.header(r, "x-ms-content-crc64")
+    s == "" && throw(CRC64Error("AzStorage: the response is missing its CRC64"))
+    crc64parse(s) == crc64(r.body) || throw(CRC64Error("AzStorage: the CRC64 of the response does not match its data"))
+    r
+end
+
+function writebytes_blob(c, o, data, contenttype)
+    invalidate!(c, o)
+    crcheaders = c.integrity ? crc64headers(crc64(data)) : ()
+    @retry c.nretry HTTP.request(
+        "PUT",
+        "$(endpoint(c.storageaccount))/$(c.containername)/$(addprefix(c,o))",
+        Dict(
+            "Authorization" => "Bearer $(token(c.session))",
+            "x-ms-version" => API_VERSION,
+            "Content-Length" => "$(length(data))",
+            "Content-Type" => contenttype,
+            "x-ms-blob-type" => "BlockBlob",
+            crcheaders...),
+        data,
+        retry = false,
+        verbose = c.verbose)
+    nothing
+end
+
+function putblocklist(c, o, blockids; contenttype="", crc=nothing, metadata=())
+    xdoc = XMLDocument()
+    xroot = create_root(xdoc, "BlockList")
+    for blockid in blockids
+        add_text(new_child(xroot, "Uncommitted"), blockid)
+    end
+    blocklist = string(xdoc)
+
+    invalidate!(c, o)
+    @retry c.nretry HTTP.request(
+        "PUT",
+        "$(endpoint(c.storageaccount))/$(c.containername)/$(addprefix(c,o))?comp=blocklist",
+        Dict(
+            "x-ms-version" => API_VERSION,
+            "Authorization" => "Bearer $(token(c.session))",
+            "Content-Type" => "application/octet-stream",
+            "Content-Length" => "$(length(blocklist))",
+            (contenttype == "" ? () : ("x-ms-blob-content-type" => contenttype,))...,
+            (crc === nothing ? () : ("x-ms-meta-crc64" => crc64string(crc),))...,
+            metadata...),
+        blocklist,
+        retry = false)
+    nothing
+end
+
+function blockids(_nblocks)
+    l = ceil(Int, log10(_nblocks))
+    [base64encode(lpad(blockid-1, l, '0')) for blockid in 1:_nblocks]
+end
+
+function writebytes_block(c, o, data, _nblocks; resume=false)
+    _blockids = blockids(_nblocks)
+    __blockids = [HTTP.escapeuri(blockid) for blockid in _blockids]
+    blockcrcs = c.integrity ? Vector{UInt64}(undef, _nblocks) : nothing
+    if resume
+        # the block-ids and block sizes are a function of the block index, so that a block that is already
+        # uncommitted on the service (from an earlier, failed, attempt) does not need to be uploaded again.
+        for iresume = 1:_NRESUME
+            skip = uploadedblocks(c, o, _blockids, length(data))
+            # with integrity checking, the C layer still computes the CRCs of the skipped blocks
+            (all(skip) && !c.integrity) && break
+            r,failed = putblocks(c, o, data, _nblocks, __blockids, skip, blockcrcs)
+            isfailure(r) || break
+            iresume == _NRESUME && writebytes_block_error(r, failed)
+            @debug "writebytes_block: resuming $(count(!, skip)) blocks after error, http=$(r.http), curl=$(r.curl)"
+        end
+    else
+        writebytes_block_error(putblocks(c, o, data, _nblocks, __blockids, falses(_nblocks), blockcrcs)...)
     end
 
-    function putblocklist(c, o, blockids)
-        xdoc = XMLDocument()
-        xroot = create_root(xdoc, "BlockList")
-        for blockid in blockids
-            add_text(new_child(xroot, "Uncommitted"), blockid)
+    putblocklist(c, o, _blockids; crc=blockcrcs === nothing ? nothing : crc64combine(blockcrcs, length(data)))
+end
+
+#
+# Upload the blocks that are not skipped.  With the threaded engine, the C layer reports the status of each
+# block, and the blocks that failed (after `nretry` retries) get a second chance, on fresh connections, once
+# the other blocks are done.  Returns the response codes and the indices of the blocks that still failed.
+#
+function putblocks(c, o, data, _nblocks, __blockids, skip, blockcrcs=nothing, codec=nothing)
+    _blockcrcs = blockcrcs === nothing ? Ptr{UInt64}(C_NULL) : pointer(blockcrcs)
+    _codec = codec === nothing ? Ptr{Codec}(C_NULL) : Ref(codec)
+    # the codec is only available in the threaded engine
+    nrequests = codec === nothing ? c.nrequests : 0
+    blockcodes = Vector{ResponseCodes}(undef, _nblocks)
+    local r
+    for fresh in (0, 1)
+        _skip = UInt8.(skip)
+        r = GC.@preserve data blockcrcs blockcodes _skip transfer_refreshed(c) do slot, cond
+            ccall((:curl_writebytes_block_async, libAzStorage), Ptr{Cvoid},
+                (Cstring,    Ptr{Cvoid}, Cstring,          Cstring,         Cstring,        Ptr{Cstring}, Ptr{UInt8}, Csize_t,      Cint,       Cint,     Ptr{UInt8}, Ptr{ResponseCodes}, Ptr{UInt64}, Ptr{Codec}, Cint,      Cint,    Cint,  Cint,     Cint,      Ptr{Cvoid},             Ptr{Cvoid}),
+                 slot.token, slot.ptr,   c.storageaccount, c.containername, addprefix(c,o), __blockids,   data,       length(data), c.nthreads, _nblocks, _skip,      blockcodes,         _blockcrcs,  _codec,     nrequests, c.http2, fresh, c.nretry, c.verbose, cglobal(:uv_async_send), cond.handle)
         end
-        blocklist = string(xdoc)
+        # the curl_multi engine does not report the status of each block
+        nrequests > 0 && return r, isfailure(r) ? findall(!, skip) : Int[]
+        isfailure(r) || break
+        skip = [!isfailure(blockcode) for blockcode in blockcodes]
+        @debug "putblocks: second chance for blocks $(findall(!, skip)), http=$(r.http), curl=$(r.curl)"
+    end
+    r, findall(!, skip)
+end
+
+function writebytes_block_error(r::ResponseCodes, failed)
+    r.http >= 300 && error("writebytes_block: error code $(r.http), failed blocks: $failed")
+    r.curl > 0 && error("curl error, code=$(r.curl), failed blocks: $failed")
+    nothing
+end
+
+const _NRESUME = 3
+
+# blocks of the planned block list that are already uncommitted on the service with the expected size
+function uploadedblocks(c, o, _blockids, nbytes)
+    _nblocks = length(_blockids)
+    blocks = Dict(_blockids[i] => (i, div(nbytes, _nblocks) + (i <= rem(nbytes, _nblocks) ? 1 : 0)) for i = 1:_nblocks)
+    uploaded = falses(_nblocks)
+    for (blockid,size) in uncommittedblocks(c, o)
+        i,_size = get(blocks, blockid, (0,-1))
+        _size == size && (uploaded[i] = true)
+    end
+    uploaded
+end
 
+uncommittedblocks(c, o) = blocklist(c, o, "uncommitted")
+
+# (block-id, size) of the blocks of the blob, where `blocklisttype` is "committed" or "uncommitted"
+function blocklist(c, o, blocklisttype)
+    r = try
         @retry c.nretry HTTP.request(
-            "PUT",
-            "https://$(c.storageaccount).blob.core.windows.net/$(c.containername)/$(addprefix(c,o))?comp=blocklist",
+            "GET",
+            "$(endpoint(c.storageaccount))/$(c.containername)/$(addprefix(c,o))?comp=blocklist&blocklisttype=$blocklisttype",
             Dict(
-                "x-ms-version" => API_VERSION,
                 "Authorization" => "Bearer $(token(c.session))",
-                "Content-Type" => "application/octet-stream",
-                "Content-Length" => "$(length(blocklist))"),
-            blocklist,
+                "x-ms-version" => API_VERSION),
             retry = false)
-        nothing
+    catch e
+        (isa(e, HTTP.StatusError) && e.status == 404) && return Tuple{String,Int}[]
+        rethrow(e)
+    end
+    body = String(r.body)
+    blocks = Tuple{String,Int}[]
+    i = 1
+    while true
+        name,i = xmlelement(body, "Name", i)
+        name === nothing && break
+        size,i = xmlelement(body, "Size", i)
+        push!(blocks, (name, parse(Int, size)))
     end
+    blocks
+end
 
-    function writebytes_block(c, o, data, _nblocks)
-        t = token(c.session)
-        l = ceil(Int, log10(_nblocks))
-        blockids = [base64encode(lpad(blockid-1, l, '0')) for blockid in 1:_nblocks]
-        _blockids = [HTTP.escapeuri(blockid) for blockid in blockids]
-        r = ccall((:curl_writebytes_block_retry_threaded, libAzStorage), ResponseCodes,
-            (Cstring, Cstring,          Cstring,         Cstring,        Ptr{Cstring}, Ptr{UInt8}, Csize_t,      Cint,       Cint,     Cint,     Cint),
-             t,       c.storageaccount, c.containername, addprefix(c,o), _blockids,    data,       length(data), c.nthreads, _nblocks, c.nretry, c.verbose)
-        r.http >= 300 && error("writebytes_block: error code $(r.http)")
-        r.curl > 0 && error("curl error, code=$(r.curl)")
+#
+# Compression.  The codec functions (with the signatures of the zstd simple API) are passed to the C layer, where the blocks
+# are compressed and decompressed by the transfer threads.  The blocks have the layout of `writebytes_block`, and the
+# committed block list of the blob gives the compressed size of each block.
+#
+const _COMPRESSIONS = ("", "zstd")
+
+struct Codec
+    compress::Ptr{Cvoid}
+    decompress::Ptr{Cvoid}
+    bound::Ptr{Cvoid}
+    iserror::Ptr{Cvoid}
+    level::Cint
+    elsize::Cint
+end
+
+function Codec(c::AzContainer, elsize)
+    lib = Libdl.dlopen(libzstd)
+    Codec(Libdl.dlsym(lib, :ZSTD_compress), Libdl.dlsym(lib, :ZSTD_decompress), Libdl.dlsym(lib, :ZSTD_compressBound),
+        Libdl.dlsym(lib, :ZSTD_isError), c.compressionlevel, elsize)
+end
+
+struct CodecIndex
+    codec::String
+    elsize::Int
+    nbytes::Int
+    blockoffsets::Vector{Csize_t}
+end
+
+function writebytes_compressed(c, o, data, elsize, contenttype)
+    _nblocks = nblocks(nconcurrent(c), length(data))
+    _blockids = blockids(_nblocks)
+    __blockids = [HTTP.escapeuri(blockid) for blockid in _blockids]
+    blockcrcs = c.integrity ? Vector{UInt64}(undef, _nblocks) : nothing
+    invalidate!(c, o)
+    writebytes_block_error(putblocks(c, o, data, _nblocks, __blockids, falses(_nblocks), blockcrcs, Codec(c, elsize))...)
+    metadata = ("x-ms-meta-codec" => c.compression, "x-ms-meta-codecelsize" => "$elsize", "x-ms-meta-codecnbytes" => "$(length(data))")
+    putblocklist(c, o, _blockids; contenttype=contenttype, metadata=metadata)
+    nothing
+end
+
+# the codec index of a compressed blob, or `nothing` if the blob is not compressed
+function codecindex(c::AzContainer, o::AbstractString)
+    if c.cachettl > 0
+        t,index = lock(() -> get(_CODEC_CACHE, cachekey(c,o), (0.0, nothing)), _CACHE_LOCK)
+        time() - t < c.cachettl && return index
+    end
+
+    r = @retry c.nretry HTTP.request(
+        "HEAD",
+        "$(endpoint(c.storageaccount))/$(c.containername)/$(addprefix(c,o))",
+        Dict(
+            "Authorization" => "Bearer $(token(c.session))",
+            "x-ms-version" => API_VERSION),
+        retry = false)
+    codec = HTTP.header(r, "x-ms-meta-codec")
+    index = if codec == ""
+        nothing
+    else
+        codec ∈ _COMPRESSIONS || error("AzStorage: blob $o is compressed with the unsupported codec \"$codec\"")
+        blockoffsets = cumsum([0; [size for (blockid,size) in blocklist(c, o, "committed")]])
+        CodecIndex(codec, parse(Int, HTTP.header(r, "x-ms-meta-codecelsize")), parse(Int, HTTP.header(r, "x-ms-meta-codecnbytes")), blockoffsets)
+    end
+    c.cachettl > 0 && lock(() -> _CODEC_CACHE[cachekey(c,o)] = (time(), index), _CACHE_LOCK)
+    index
+end
 
-        putblocklist(c, o, blockids)
+function readbytes_compressed!(c::AzContainer, o::AbstractString, data::DenseArray{UInt8}, offset, index::CodecIndex)
+    offset + length(data) <= index.nbytes || throw(EOFError())
+    codec = Codec(c, index.elsize)
+    r = GC.@preserve data index transfer_refreshed(c) do slot, cond
+        ccall((:curl_readbytes_codec_async, libAzStorage), Ptr{Cvoid},
+            (Cstring,    Ptr{Cvoid}, Cstring,          Cstring,         Cstring,        Ptr{UInt8}, Csize_t, Csize_t,      Csize_t,      Cint,                         Ptr{Csize_t},       Ref{Codec}, Cint,       Cint,        Cint,     Cint,      Ptr{Cvoid},             Ptr{Cvoid}),
+             slot.token, slot.ptr,   c.storageaccount, c.containername, addprefix(c,o), data,       offset,  length(data), index.nbytes, length(index.blockoffsets)-1, index.blockoffsets, codec,      c.nthreads, c.integrity, c.nretry, c.verbose, cglobal(:uv_async_send), cond.handle)
     end
+    r.http >= 300 && error("readbytes_compressed!: error code $(r.http)")
+    r.curl > 0 && error("curl error, code=$(r.curl)")
+    data
+end
 
-    _nblocks = nblocks(c.nthreads, length(data))
+function writebytes(c::AzContainer, o::AbstractString, data::DenseArray{UInt8}; contenttype="application/octet-stream", resume=false, elsize=1)
+    c.compression == "" || return writebytes_compressed(c, o, data, elsize, contenttype)
+    if c.autotune && !resume
+        blocksize,_c = tuned(c)
+        _nblocks = ceil(Int, length(data)/blocksize)
+        _nblocks > _MAXBLOCKS_PER_BLOB && nblocks_error()
+        if _nblocks > 1
+            elapsed = @elapsed writebytes_block(_c, o, data, _nblocks)
+            # only writes that keep every slot busy measure the setting
+            _nblocks >= nconcurrent(_c) && measure!(c, blocksize, nconcurrent(_c), _nblocks, elapsed)
+            return nothing
+        end
+    end
+    _nblocks = nblocks(nconcurrent(c), length(data))
     if _nblocks > 1
-        writebytes_block(c, o, data, _nblocks)
+        writebytes_block(c, o, data, _nblocks; resume=resume)
     else
         writebytes_blob(c, o, data, contenttype)
     end
@@ -269,13 +908,29 @@ _iscontiguous(data::SubArray) = isbitstype(eltype(data)) && Base.iscontiguous(da
 _iscontiguous(data::AbstractArray) = false
 
 """
-    write(container, "blobname", data::StridedArray)
+    write(container, "blobname", data::StridedArray[; resume=false])
 
 Write the array `data` to a blob with the name `blobname` in `container::AzContainer`.
+
+If `resume=true`, then the blocks of a multi-block write that are already uploaded (but not yet committed)
+are not uploaded again.  This includes blocks from an earlier call that failed part-way.  A block is
+considered to be uploaded if the service has an uncommitted block with the expected block-id and size.
+Hence, the resumed write must use the same `data` and the same container settings (`nthreads` and
+`nrequests`, which determine the block layout) as the failed write.  With `resume=true`, the missing
+blocks are also retried (up to 3 rounds) before an error is thrown.
+
+# Example
+```
+try
+    write(container, "foo.bin", x; resume=true)
+catch
+    write(container, "foo.bin", x; resume=true) # only uploads the blocks that are missing
+end
+```
 """
-function Base.write(c::AzContainer, o::AbstractString, data::AbstractArray{T}) where {T}
+function Base.write(c::AzContainer, o::AbstractString, data::AbstractArray{T}; resume=false) where {T}
     if _iscontiguous(data)
-        writebytes(c, o, unsafe_wrap(Vector{UInt8}, convert(Ptr{UInt8}, pointer(data)), length(data)*sizeof(T), own=false); contenttype="application/octet-stream")
+        writebytes(c, o, unsafe_wrap(Vector{UInt8}, convert(Ptr{UInt8}, pointer(data)), length(data)*sizeof(T), own=false); contenttype="application/octet-stream", resume=resume, elsize=sizeof(T))
     else
         error("AzStorage: `write` is not supported on non-isbits arrays and/or non-contiguous arrays")
     end
@@ -283,67 +938,381 @@ end
 
 Base.write(c::AzContainer, o::AbstractString, data) = error("AzStorage: `write` is only suppoted for DenseArray.")
 
-"""
-    write(io::AzObject, data)
-
-write data to `io::AzObject`.
+_bytes(data::AbstractString) = transcode(UInt8, String(data))
+function _bytes(data::AbstractArray{T}) where {T}
+    _iscontiguous(data) || error("AzStorage: `write` is not supported on non-isbits arrays and/or non-contiguous arrays")
+    unsafe_wrap(Vector{UInt8}, convert(Ptr{UInt8}, pointer(data)), length(data)*sizeof(T), own=false)
+end
 
-# Example
-```
-io = open(AzContainer("mycontainer";storageaccount="mystorageaccount"), "foo.bin")
-write(io, rand(10))
-x = read!(io, zeros(10))
-```
 """
-Base.write(o::AzObject, data) = write(o.container, o.name, data)
+    write(container, ["blobname1", "blobname2", ...], [data1, data2, ...]; contenttype="application/octet-stream")
 
+Write `datas[i]` to a blob with the name `blobnames[i]` in `container::AzContainer` for all `i`.  The
+blobs that fit in a single block are written in one threaded call with at most `container.nthreads`
+requests in flight, which amortizes the per-request latency when writing many small blobs.  Larger
+blobs are written one at a time, each using the threaded block writer.
 """
-    serialize(container, "blobname", data)
+function Base.write(c::AzContainer, os::AbstractVector{<:AbstractString}, datas::AbstractVector; contenttype="application/octet-stream")
+    length(os) == length(datas) || throw(DimensionMismatch("AzStorage: `write` requires one blob name per data item"))
+    GC.@preserve datas begin
+        _datas = [_bytes(data) for data in datas]
+        issmall = [nblocks(nconcurrent(c), length(data)) == 1 for data in _datas]
+        foreach(o->invalidate!(c, o), os)
+        _os = [addprefix(c,o) for o in os[issmall]]
+        _ptrs = Ptr{UInt8}[pointer(data) for data in _datas[issmall]]
+        _sizes = Csize_t[length(data) for data in _datas[issmall]]
 
-Serialize and write `data` to a blob with the name `blobname` in `container::AzContainer`.
+        t = token(c.session)
+        r = ccall((:curl_writebytes_blob_batch_retry_threaded, libAzStorage), ResponseCodes,
+            (Cstring, Cstring,          Cstring,         Ptr{Cstring}, Cstring,     Ptr{Ptr{UInt8}}, Ptr{Csize_t}, Cint,        Cint,       Cint,        Cint,     Cint),
+             t,       c.storageaccount, c.containername, _os,          contenttype, _ptrs,           _sizes,       length(_os), c.nthreads, c.integrity, c.nretry, c.verbose)
+        r.http >= 300 && error("write: error code $(r.http)")
+        r.curl > 0 && error("curl error, code=$(r.curl)")
+
+        for i in findall(!, issmall)
+            writebytes(c, os[i], _datas[i]; contenttype=contenttype)
+        end
+    end
+    nothing
+end
+
+"""
+    upload(container, "blobname", "localpath"; contenttype="application/octet-stream")
 
+Upload the local file `localpath` to a blob with the name `blobname` in `container::AzContainer`.  The
+file is not read into memory.  Instead, its descriptor is handed to the C layer, and each of the
+`container.nthreads` threads reads its blocks straight from the file (`pread`) as curl sends them.
+The block layout is that of `write`, and the blocks that fail (after `container.nretry` retries) get
+a second chance on fresh connections.  Note that the threaded engine is always used (`nrequests` is
+ignored), that the `compression` setting of the container is not applied, and that the `integrity`
+setting is only applied to a file that fits in a single block (which is uploaded from memory).
 
 # Example
 ```
-container = AzContainer("mycontainer";storageaccount="mystorageaccount")
-serialize(container, "foo.bin", (rand(10),rand(20)))
-a,b = deserialize(io)
+upload(container, "foo.bin", "/scratch/foo.bin")
 ```
 """
-function Serialization.serialize(c::AzContainer, o::AbstractString, data)
-    io = IOBuffer(;write=true)
-    serialize(io, data)
-    writebytes(c, o, take!(io); contenttype="application/octet-stream")
+function upload(c::AzContainer, o::AbstractString, localpath::AbstractString; contenttype="application/octet-stream")
+    nbytes = filesize(localpath)
+    _nblocks = nbytes > 0 ? nblocks(nconcurrent(c), nbytes) : 1
+    _nblocks > 1 || return writebytes_blob(c, o, read(localpath), contenttype)
+
+    _blockids = blockids(_nblocks)
+    __blockids = [HTTP.escapeuri(blockid) for blockid in _blockids]
+    invalidate!(c, o)
+    blockcodes = Vector{ResponseCodes}(undef, _nblocks)
+    skip = falses(_nblocks)
+    open(localpath, "r") do io
+        for fresh in (0, 1)
+            _skip = UInt8.(skip)
+            r = GC.@preserve _skip blockcodes transfer_refreshed(c) do slot, cond
+                ccall((:curl_writebytes_block_fd_async, libAzStorage), Ptr{Cvoid},
+                    (Cstring,    Ptr{Cvoid}, Cstring,          Cstring,         Cstring,        Ptr{Cstring}, Cint,        Csize_t, Cint,       Cint,     Ptr{UInt8}, Ptr{ResponseCodes}, Cint,  Cint,     Cint,      Ptr{Cvoid},             Ptr{Cvoid}),
+                     slot.token, slot.ptr,   c.storageaccount, c.containername, addprefix(c,o), __blockids,   Base.fd(io), nbytes,  c.nthreads, _nblocks, _skip,      blockcodes,         fresh, c.nretry, c.verbose, cglobal(:uv_async_send), cond.handle)
+            end
+            isfailure(r) || break
+            skip = [!isfailure(blockcode) for blockcode in blockcodes]
+            fresh == 1 && writebytes_block_error(r, findall(!, skip))
+            @debug "upload: second chance for blocks $(findall(!, skip)), http=$(r.http), curl=$(r.curl)"
+        end
+    end
+    putblocklist(c, o, _blockids; contenttype=contenttype)
+    nothing
 end
 
 """
-    serialize(io::AzObject, data)
+    download(container, "blobname", "localpath"; chunksize=$_MINBYTES_PER_BLOCK)
 
-Serialize and write data to `io::AzObject`.  See serialize(conainer, blobname, data).
-"""
-Serialization.serialize(o::AzObject, data) = serialize(o.container, o.name, data)
+Download the blob `blobname` in `container::AzContainer` to the local file `localpath`, replacing
+the file if it exists.  The blob is not read into memory.  Instead, the descriptor of the file is
+handed to the C layer, and the threads write each chunk (of about `chunksize` bytes) straight to
+its offset in the file (`pwrite`) as it arrives.  The chunks that fail (after `container.nretry`
+retries) get a second chance on fresh connections.  Note that the `integrity` and `cachedir`
+settings of the container are not applied, and that, through a container with `compression` set, a
+compressed blob is decompressed in memory (`container.nthreads` chunks at a time) before it is
+written to the file.
 
+# Example
+```
+download(container, "foo.bin", "/scratch/foo.bin")
+```
 """
-    writedlm(container, "blobname", data, args...; options...)
+function Base.download(c::AzContainer, o::AbstractString, localpath::AbstractString; chunksize=_MINBYTES_PER_BLOCK)
+    if c.compression != ""
+        index = codecindex(c, o)
+        index === nothing || return download_compressed(c, o, localpath, index, chunksize)
+    end
+    nbytes = properties(c, o).size
+    _nthreads = nthreads_effective(nconcurrent(c), nbytes)
+    nchunks = max(div(nbytes, max(chunksize, 1)), _nthreads)
+    chunkcodes = Vector{ResponseCodes}(undef, nchunks)
+    skip = falses(nchunks)
+    open(localpath, "w") do io
+        nbytes > 0 || return
+        for fresh in (0, 1)
+            _skip = UInt8.(skip)
+            r = GC.@preserve _skip chunkcodes transfer_refreshed(c) do slot, cond
+                ccall((:curl_readbytes_fd_async, libAzStorage), Ptr{Cvoid},
+                    (Cstring,    Ptr{Cvoid}, Cstring,          Cstring,         Cstring,        Cint,        Csize_t, Csize_t,   Cint,      Ptr{UInt8}, Ptr{ResponseCodes}, Cint,  Cint,     Cint,      Ptr{Cvoid},             Ptr{Cvoid}),
+                     slot.token, slot.ptr,   c.storageaccount, c.containername, addprefix(c,o), Base.fd(io), nbytes,  chunksize, _nthreads, _skip,      chunkcodes,         fresh, c.nretry, c.verbose, cglobal(:uv_async_send), cond.handle)
+            end
+            isfailure(r) || break
+            skip = [!isfailure(chunkcode) for chunkcode in chunkcodes]
+            if fresh == 1
+                r.http >= 300 && error("download: error code $(r.http), failed chunks: $(findall(!, skip))")
+                r.curl > 0 && error("curl error, code=$(r.curl), failed chunks: $(findall(!, skip))")
+            end
+            @debug "download: second chance for chunks $(findall(!, skip)), http=$(r.http), curl=$(r.curl)"
+        end
+    end
+    localpath
+end
 
-Write the array `data` to a delimited blob with the name `blobname` in container `container::AzContainer`
-"""
-function DelimitedFiles.writedlm(c::AzContainer, o::AbstractString, data::AbstractArray, args...; opts...)
-    io = IOBuffer(;write=true)
-    writedlm(io, data, args...; opts...)
-    write(c, o, String(take!(io)))
+# decompress through memory, `nconcurrent(c)` chunks at a time
+function download_compressed(c::AzContainer, o::AbstractString, localpath::AbstractString, index::CodecIndex, chunksize)
+    n = max(chunksize, 1)*nconcurrent(c)
+    buffer = Vector{UInt8}(undef, min(n, index.nbytes))
+    open(localpath, "w") do io
+        for offset in 0:n:index.nbytes-1
+            length(buffer) == min(n, index.nbytes - offset) || resize!(buffer, index.nbytes - offset)
+            write(io, readbytes_compressed!(c, o, buffer, offset, index))
+        end
+    end
+    localpath
 end
 
 """
-    writedlm(io:AzObject, data, args...; options...)
+    write(io::AzObject, data)
 
-write the array `data` to `io::AzObject`
+write data to `io::AzObject`.
 
 # Example
 ```
-io = open(AzContainer("mycontainer";storageaccount="mystorageaccount"), "foo.txt")
-writedlm(io, rand(10,10))
-x = readdlm(io)
+io = open(AzContainer("mycontainer";storageaccount="mystorageaccount"), "foo.bin")
+write(io, rand(10))
+x = read!(io, zeros(10))
+```
+"""
+Base.write(o::AzObject, data) = write(o.container, o.name, data)
+
+mutable struct AzObjectWriter <: IO
+    object::AzObject
+    contenttype::String
+    buffer::Vector{UInt8}
+    nbuffer::Int
+    blockids::Vector{String}
+    buffers::Vector{Vector{UInt8}}
+    islot::Int
+    ninflight::Int
+    pipeline::Ptr{Cvoid}
+    cond::Union{Base.AsyncCondition,Nothing}
+    crc::UInt64
+    isopen::Bool
+end
+
+function AzObjectWriter(object::AzObject; blocksize=writeblocksize(object.container), ninflight=writeninflight(object.container), contenttype="application/octet-stream")
+    buffer = Vector{UInt8}(undef, blocksize)
+    io = AzObjectWriter(object, contenttype, buffer, 0, String[], [buffer], 0, max(ninflight, 1), C_NULL, nothing, UInt64(0), true)
+    # the upload threads must not outlive the buffers if the writer is dropped without being closed
+    finalizer(pipeline_finalize, io)
+end
+
+# The condition that the upload threads signal must stay open until the pipeline is finished, but finalizers run in no
+# particular order, so the condition of a pipeline is kept (reachable, and so not finalized) in a global set until then.
+const _PIPELINE_CONDITIONS = IdDict{Base.AsyncCondition,Nothing}()
+const _PIPELINE_CONDITIONS_LOCK = Threads.SpinLock()
+
+function pipeline_retain(cond)
+    lock(_PIPELINE_CONDITIONS_LOCK)
+    _PIPELINE_CONDITIONS[cond] = nothing
+    unlock(_PIPELINE_CONDITIONS_LOCK)
+    cond
+end
+
+function pipeline_release(cond)
+    lock(_PIPELINE_CONDITIONS_LOCK)
+    delete!(_PIPELINE_CONDITIONS, cond)
+    unlock(_PIPELINE_CONDITIONS_LOCK)
+    close(cond)
+end
+
+function pipeline_finalize(io::AzObjectWriter)
+    if io.pipeline != C_NULL
+        # the blob of an abandoned writer is not committed, so only the uploads in flight are waited for
+        ccall((:curl_pipeline_cancel, libAzStorage), Cvoid, (Ptr{Cvoid},), io.pipeline)
+        ccall((:curl_pipeline_finish, libAzStorage), ResponseCodes, (Ptr{Cvoid}, Ptr{UInt64}), io.pipeline, C_NULL)
+        io.pipeline = C_NULL
+    end
+    io.cond === nothing && return
+    # a finalizer must not wait for the lock, so, if it is taken, the condition is released by a later finalizer
+    if trylock(_PIPELINE_CONDITIONS_LOCK)
+        delete!(_PIPELINE_CONDITIONS, io.cond)
+        unlock(_PIPELINE_CONDITIONS_LOCK)
+        close(io.cond)
+        io.cond = nothing
+    else
+        finalizer(pipeline_finalize, io)
+    end
+    nothing
+end
+
+# block-ids must have the same length for all blocks in a blob, and the number of blocks is not known up-front.
+streamblockid(iblock) = base64encode(lpad(iblock-1, ndigits(_MAXBLOCKS_PER_BLOB), '0'))
+
+#
+# The filled blocks are handed to a pipeline in the C layer (a bounded queue that is drained by
+# `ninflight` upload threads).  The writer owns `ninflight+1` buffers (slots), so that one buffer is
+# filled while the others are uploaded, and a filled slot is recycled once the C layer reports its
+# upload as done (signaled through `cond`).  The pipeline is created on the first full block, so that
+# small blobs are written with a single Put Blob and without starting any threads.
+#
+function pipeline_check(io::AzObjectWriter)
+    r = ccall((:curl_pipeline_status, libAzStorage), ResponseCodes, (Ptr{Cvoid},), io.pipeline)
+    (r.http >= 300 || r.curl > 0) && pipeline_finish(io)
+    nothing
+end
+
+function pipeline_finish(io::AzObjectWriter)
+    io.pipeline == C_NULL && return nothing
+    crc = Ref{UInt64}(0)
+    r = GC.@preserve io ccall((:curl_pipeline_finish, libAzStorage), ResponseCodes, (Ptr{Cvoid}, Ptr{UInt64}), io.pipeline, crc)
+    io.pipeline = C_NULL
+    io.crc = crc[]
+    pipeline_release(io.cond)
+    io.cond = nothing
+    r.http >= 300 && error("putblock: error code $(r.http)")
+    r.curl > 0 && error("curl error, code=$(r.curl)")
+    nothing
+end
+
+function putblock!(io::AzObjectWriter; refill=true)
+    c,o = io.object.container,io.object.name
+    length(io.blockids) == _MAXBLOCKS_PER_BLOB && nblocks_error()
+    push!(io.blockids, streamblockid(length(io.blockids)+1))
+    if io.pipeline == C_NULL
+        io.cond = pipeline_retain(Base.AsyncCondition())
+        io.pipeline = ccall((:curl_pipeline_new, libAzStorage), Ptr{Cvoid},
+            (Cstring,          Cstring,         Cstring,        Cint,         Cint,           Cint,        Cint,     Cint,      Ptr{Cvoid},             Ptr{Cvoid}),
+             c.storageaccount, c.containername, addprefix(c,o), io.ninflight, io.ninflight+1, c.integrity, c.nretry, c.verbose, cglobal(:uv_async_send), io.cond.handle)
+        if io.pipeline == C_NULL
+            pipeline_release(io.cond)
+            io.cond = nothing
+            error("AzStorage: unable to start the block pipeline")
+        end
+    end
+    status = ccall((:curl_pipeline_push, libAzStorage), Cint,
+        (Ptr{Cvoid},  Cstring,          Cstring,                        Ptr{UInt8}, Csize_t,    Cint),
+         io.pipeline, token(c.session), HTTP.escapeuri(io.blockids[end]), io.buffer, io.nbuffer, io.islot)
+    status == 0 || (pipeline_finish(io); error("AzStorage: unable to queue block for upload"))
+    refill || return nothing
+
+    if length(io.buffers) <= io.ninflight
+        push!(io.buffers, Vector{UInt8}(undef, length(io.buffer)))
+        io.islot = length(io.buffers) - 1
+    else
+        while (io.islot = ccall((:curl_pipeline_reap, libAzStorage), Cint, (Ptr{Cvoid},), io.pipeline)) < 0
+            wait(io.cond)
+        end
+        pipeline_check(io)
+    end
+    io.buffer = io.buffers[io.islot+1]
+    io.nbuffer = 0
+    nothing
+end
+
+function Base.unsafe_write(io::AzObjectWriter, p::Ptr{UInt8}, n::UInt)
+    io.isopen || throw(ArgumentError("write failed, AzObjectWriter is not open"))
+    m = 0
+    while m < n
+        _m = min(n - m, length(io.buffer) - io.nbuffer)
+        unsafe_copyto!(pointer(io.buffer, io.nbuffer+1), p + m, _m)
+        io.nbuffer += _m
+        m += _m
+        io.nbuffer == length(io.buffer) && putblock!(io)
+    end
+    Int(n)
+end
+
+function Base.write(io::AzObjectWriter, x::UInt8)
+    io.isopen || throw(ArgumentError("write failed, AzObjectWriter is not open"))
+    io.buffer[io.nbuffer+=1] = x
+    io.nbuffer == length(io.buffer) && putblock!(io)
+    1
+end
+
+Base.isopen(io::AzObjectWriter) = io.isopen
+Base.iswritable(io::AzObjectWriter) = io.isopen
+Base.isreadable(io::AzObjectWriter) = false
+Base.flush(io::AzObjectWriter) = nothing
+
+"""
+    close(io::AzObjectWriter)
+
+Upload any remaining buffered data, wait for the in-flight blocks, and commit the block list.
+"""
+function Base.close(io::AzObjectWriter)
+    io.isopen || return nothing
+    io.isopen = false
+    c,o = io.object.container,io.object.name
+    if isempty(io.blockids)
+        writebytes_blob(c, o, resize!(io.buffer, io.nbuffer), io.contenttype)
+    else
+        io.nbuffer > 0 && putblock!(io; refill=false)
+        pipeline_finish(io)
+        putblocklist(c, o, io.blockids; crc=c.integrity ? io.crc : nothing)
+    end
+    io.buffer = UInt8[]
+    io.buffers = Vector{UInt8}[]
+    nothing
+end
+
+"""
+    serialize(container, "blobname", data)
+
+Serialize and write `data` to a blob with the name `blobname` in `container::AzContainer`.
+
+
+# Example
+```
+container = AzContainer("mycontainer";storageaccount="mystorageaccount")
+serialize(container, "foo.bin", (rand(10),rand(20)))
+a,b = deserialize(io)
+```
+"""
+function Serialization.serialize(c::AzContainer, o::AbstractString, data)
+    io = AzObjectWriter(AzObject(c, o))
+    serialize(io, data)
+    close(io)
+end
+
+"""
+    serialize(io::AzObject, data)
+
+Serialize and write data to `io::AzObject`.  See serialize(conainer, blobname, data).
+"""
+Serialization.serialize(o::AzObject, data) = serialize(o.container, o.name, data)
+
+"""
+    writedlm(container, "blobname", data, args...; options...)
+
+Write the array `data` to a delimited blob with the name `blobname` in container `container::AzContainer`
+"""
+function DelimitedFiles.writedlm(c::AzContainer, o::AbstractString, data::AbstractArray, args...; opts...)
+    io = AzObjectWriter(AzObject(c, o); contenttype="text/plain")
+    writedlm(io, data, args...; opts...)
+    close(io)
+end
+
+"""
+    writedlm(io:AzObject, data, args...; options...)
+
+write the array `data` to `io::AzObject`
+
+# Example
+```
+io = open(AzContainer("mycontainer";storageaccount="mystorageaccount"), "foo.txt")
+writedlm(io, rand(10,10))
+x = readdlm(io)
 ```
 """
 function DelimitedFiles.writedlm(o::AzObject, data::AbstractArray, args...; opts...)
@@ -384,11 +1353,182 @@ end
 
 nthreads_effective(nthreads::Integer, nbytes::Integer) = clamp(div(nbytes, _MINBYTES_PER_BLOCK), 1, nthreads)
 
-function readbytes!(c::AzContainer, o::AbstractString, data::DenseArray{UInt8}; offset=0)
+#
+# Local disk cache of blob blocks, see the `cachedir` keyword argument of `AzContainer`.  Each aligned block of
+# `_DISKCACHE_BLOCKSIZE` bytes is a file in a directory per (storage account, container, blob, ETag).  The in-memory
+# index (per cache directory) holds the size and last access time of each block for the LRU eviction (blocks from
+# earlier sessions are ordered by their modification time), and the blocks that are being filled, so that another task
+# that needs such a block waits for it rather than fetching it again.
+#
+const _DISKCACHE_BLOCKSIZE = 8_388_608
+
+mutable struct DiskCache
+    lock::ReentrantLock
+    blocks::Dict{String,Tuple{Int,Float64}}
+    nbytes::Int
+    filling::Dict{String,Channel{Any}}
+end
+
+const _DISKCACHES_LOCK = ReentrantLock()
+const _DISKCACHES = Dict{String,DiskCache}()
+
+function diskcache(c::AzContainer)
+    lock(_DISKCACHES_LOCK) do
+        get!(_DISKCACHES, c.cachedir) do
+            cache = DiskCache(ReentrantLock(), Dict{String,Tuple{Int,Float64}}(), 0, Dict{String,Channel{Any}}())
+            if isdir(c.cachedir)
+                for (root,dirs,files) in walkdir(c.cachedir), file in files
+                    endswith(file, ".tmp") && continue
+                    path = joinpath(root, file)
+                    n = filesize(path)
+                    cache.blocks[path] = (n, mtime(path))
+                    cache.nbytes += n
+                end
+            end
+            cache
+        end
+    end
+end
+
+diskcachedir(c::AzContainer, o, etag) =
+    joinpath(c.cachedir, string(hash((c.storageaccount, c.containername, addprefix(c,o), etag, _DISKCACHE_BLOCKSIZE)); base=16))
+
+function diskcache_insert!(cache::DiskCache, path, n, cachesize)
+    lock(cache.lock) do
+        cache.nbytes += n - get(cache.blocks, path, (0, 0.0))[1]
+        cache.blocks[path] = (n, time())
+        cache.nbytes <= cachesize && return
+        for (_path,(_n,t)) in sort(collect(cache.blocks); by=entry->entry.second[2])
+            cache.nbytes <= cachesize && break
+            _path == path && continue
+            rm(_path; force=true)
+            delete!(cache.blocks, _path)
+            cache.nbytes -= _n
+        end
+    end
+    nothing
+end
+
+function diskcache_release!(cache::DiskCache, paths)
+    lock(cache.lock) do
+        for path in paths
+            channel = pop!(cache.filling, path, nothing)
+            channel === nothing || put!(channel, nothing)
+        end
+    end
+    nothing
+end
+
+# contiguous runs of the (sorted) block indices
+function blockruns(iblocks)
+    runs = UnitRange{Int}[]
+    for iblock in iblocks
+        if isempty(runs) || last(runs[end]) + 1 != iblock
+            push!(runs, iblock:iblock)
+        else
+            runs[end] = first(runs[end]):iblock
+        end
+    end
+    runs
+end
+
+# a copy of the container without the local cache and without compression (for the reads that fill the cache)
+function uncached(c::AzContainer)
+    _c = copy(c)
+    _c.cachedir = ""
+    _c.compression = ""
+    _c
+end
+
+function diskcache_fill!(c::AzContainer, o, cache::DiskCache, dir, iblocks, nbytes, chunksize)
+    claimed = Int[]
+    waiting = Channel{Any}[]
+    lock(cache.lock) do
+        for iblock in iblocks
+            path = joinpath(dir, "$iblock")
+            isfile(path) && continue
+            if haskey(cache.filling, path)
+                push!(waiting, cache.filling[path])
+            else
+                cache.filling[path] = Channel{Any}(1)
+                push!(claimed, iblock)
+            end
+        end
+    end
+
+    # each contiguous run of claimed blocks is fetched with one (threaded) read
+    try
+        for run in blockruns(claimed)
+            firstbyte = first(run)*_DISKCACHE_BLOCKSIZE
+            buffer = readbytes!(uncached(c), o, Vector{UInt8}(undef, min((last(run)+1)*_DISKCACHE_BLOCKSIZE, nbytes) - firstbyte); offset=firstbyte, chunksize=chunksize)
+            mkpath(dir)
+            paths = [joinpath(dir, "$iblock") for iblock in run]
+            for (i,path) in enumerate(paths)
+                block = view(buffer, (i-1)*_DISKCACHE_BLOCKSIZE+1:min(i*_DISKCACHE_BLOCKSIZE, length(buffer)))
+                # the block is renamed into place so that a concurrent reader never maps a partial block
+                tmp = "$path.$(getpid()).tmp"
+                write(tmp, block)
+                mv(tmp, path; force=true)
+                diskcache_insert!(cache, path, length(block), c.cachesize)
+            end
+            diskcache_release!(cache, paths)
+        end
+    finally
+        diskcache_release!(cache, [joinpath(dir, "$iblock") for iblock in claimed])
+    end
+    foreach(fetch, waiting)
+    nothing
+end
+
+# copy `n` bytes, from `blockoffset` in the cached block, to `dataoffset` in `data`, returning false on a miss
+function diskcache_copy!(c::AzContainer, cache::DiskCache, path, blocksize, data, dataoffset, blockoffset, n)
+    block = try
+        open(io -> Mmap.mmap(io, Vector{UInt8}, filesize(io)), path)
+    catch
+        UInt8[]
+    end
+    if length(block) != blocksize
+        lock(() -> haskey(cache.blocks, path) && (cache.nbytes -= pop!(cache.blocks, path)[1]), cache.lock)
+        return false
+    end
+    copyto!(data, dataoffset+1, block, blockoffset+1, n)
+    diskcache_insert!(cache, path, blocksize, c.cachesize)
+    true
+end
+
+function readbytes_cached!(c::AzContainer, o::AbstractString, data::DenseArray{UInt8}, offset, chunksize)
+    length(data) == 0 && return data
+    p = properties(c, o)
+    offset + length(data) <= p.size || throw(EOFError())
+    cache = diskcache(c)
+    dir = diskcachedir(c, o, p.etag)
+    iblocks = div(offset, _DISKCACHE_BLOCKSIZE):div(offset+length(data)-1, _DISKCACHE_BLOCKSIZE)
+    diskcache_fill!(c, o, cache, dir, iblocks, p.size, chunksize)
+
+    for iblock in iblocks
+        blockfirstbyte = iblock*_DISKCACHE_BLOCKSIZE
+        blocksize = min(_DISKCACHE_BLOCKSIZE, p.size - blockfirstbyte)
+        firstbyte = max(blockfirstbyte, offset)
+        lastbyte = min(blockfirstbyte + blocksize, offset + length(data))
+        if !diskcache_copy!(c, cache, joinpath(dir, "$iblock"), blocksize, data, firstbyte-offset, firstbyte-blockfirstbyte, lastbyte-firstbyte)
+            # the block was evicted (or its fill failed), so read the range directly
+            GC.@preserve data readbytes!(uncached(c), o, unsafe_wrap(Array, pointer(data, firstbyte-offset+1), lastbyte-firstbyte; own=false); offset=firstbyte, chunksize=chunksize)
+        end
+    end
+    data
+end
+
+function readbytes!(c::AzContainer, o::AbstractString, data::DenseArray{UInt8}; offset=0, chunksize=_MINBYTES_PER_BLOCK)
+    if c.compression != ""
+        index = codecindex(c, o)
+        index === nothing || return readbytes_compressed!(c, o, data, offset, index)
+    end
+    c.cachedir == "" || return readbytes_cached!(c, o, data, offset, chunksize)
+
     function readbytes_serial!(c, o, data, offset)
         @retry c.nretry HTTP.open(
                 "GET",
-                "https://$(c.storageaccount).blob.core.windows.net/$(c.containername)/$(addprefix(c,o))",
+                "$(endpoint(c.storageaccount))/$(c.containername)/$(addprefix(c,o))",
                 Dict(
                     "Authorization" => "Bearer $(token(c.session))",
                     "x-ms-version" => API_VERSION,
@@ -400,34 +1540,101 @@ function readbytes!(c::AzContainer, o::AbstractString, data::DenseArray{UInt8};
         nothing
     end
 
-    function readbytes_threaded!(c, o, data, offset, _nthreads)
-        t = token(c.session)
-        r = ccall((:curl_readbytes_retry_threaded, libAzStorage), ResponseCodes,
-            (Cstring, Cstring,          Cstring,         Cstring,        Ptr{UInt8}, Csize_t, Csize_t,      Cint,      Cint,     Cint),
-             t,       c.storageaccount, c.containername, addprefix(c,o), data,       offset,  length(data), _nthreads, c.nretry, c.verbose)
+    function readbytes_threaded!(c, o, data, offset, chunksize, _nthreads)
+        # the curl_multi engine neither checks integrity nor reports the status of each chunk
+        nrequests,nthreads = c.nrequests > 0 && !c.integrity ? (min(c.nrequests, cld(length(data), max(chunksize, 1))),c.nthreads) : (0,_nthreads)
+        chunkcodes = Vector{ResponseCodes}(undef, nrequests > 0 ? 0 : max(div(length(data), max(chunksize, 1)), _nthreads))
+        _chunkcodes = nrequests > 0 ? Ptr{ResponseCodes}(C_NULL) : pointer(chunkcodes)
+        r = GC.@preserve data chunkcodes transfer_refreshed(c) do slot, cond
+            ccall((:curl_readbytes_async, libAzStorage), Ptr{Cvoid},
+                (Cstring,    Ptr{Cvoid}, Cstring,          Cstring,         Cstring,        Ptr{UInt8}, Csize_t, Csize_t,      Csize_t,   Cint,     Cint,      Cint,    Ptr{ResponseCodes}, Cint,        Cint,     Cint,      Ptr{Cvoid},             Ptr{Cvoid}),
+                 slot.token, slot.ptr,   c.storageaccount, c.containername, addprefix(c,o), data,       offset,  length(data), chunksize, nthreads, nrequests, c.http2, _chunkcodes,        c.integrity, c.nretry, c.verbose, cglobal(:uv_async_send), cond.handle)
+        end
+        if nrequests == 0 && isfailure(r)
+            r = rereadchunks!(c, o, data, offset, chunkcodes)
+        end
         r.http >= 300 && error("readbytes_threaded!: error code $(r.http)")
         r.curl > 0 && error("curl error, code=$(r.curl))")
         nothing
     end
 
-    _nthreads = nthreads_effective(c.nthreads, length(data))
-    if _nthreads > 1
-        readbytes_threaded!(c, o, data, offset, _nthreads)
+    _nthreads = nthreads_effective(nconcurrent(c), length(data))
+    # the serial (HTTP.jl) path does not verify the CRC64 of the range
+    if _nthreads > 1 || (c.integrity && length(data) > 0)
+        GC.@preserve data readbytes_threaded!(c, o, data, offset, chunksize, _nthreads)
     else
         readbytes_serial!(c, o, data, offset)
     end
     data
 end
 
+# second-chance pass, on fresh connections, over the chunks of a threaded read that failed (after `nretry` retries)
+function rereadchunks!(c::AzContainer, o::AbstractString, data, offset, chunkcodes)
+    nchunks = length(chunkcodes)
+    firstbytes = [(i-1)*div(length(data), nchunks) + min(i-1, rem(length(data), nchunks)) for i = 1:nchunks+1]
+    failed = findall(isfailure, chunkcodes)
+    @debug "readbytes!: second chance for chunks $failed"
+    _os = [addprefix(c,o) for i in failed]
+    _ptrs = Ptr{UInt8}[pointer(data, firstbytes[i]+1) for i in failed]
+    _offsets = Csize_t[offset+firstbytes[i] for i in failed]
+    _sizes = Csize_t[firstbytes[i+1]-firstbytes[i] for i in failed]
+    r = ccall((:curl_readbytes_batch_retry_threaded, libAzStorage), ResponseCodes,
+        (Cstring,          Cstring,          Cstring,         Ptr{Cstring}, Ptr{Ptr{UInt8}}, Ptr{Csize_t}, Ptr{Csize_t}, Cint,           Cint,       Cint,        Cint, Cint,     Cint),
+         token(c.session), c.storageaccount, c.containername, _os,          _ptrs,           _offsets,     _sizes,       length(failed), c.nthreads, c.integrity, 1,    c.nretry, c.verbose)
+    isfailure(r) && @debug "readbytes!: chunks $failed failed after second chance"
+    r
+end
+
 """
     read(container, "blobname", String)
 
 returns the contents of the blob "blobname" in `container::AzContainer` as a string.
 """
-Base.read(c::AzContainer, o::AbstractString, T::Type{String}) = String(readbytes!(c, o, Vector{UInt8}(undef, filesize(c,o))))
+function Base.read(c::AzContainer, o::AbstractString, T::Type{String})
+    if c.compression != ""
+        index = codecindex(c, o)
+        index === nothing || return String(readbytes_compressed!(c, o, Vector{UInt8}(undef, index.nbytes), 0, index))
+    end
+    c.cachedir == "" || return String(readbytes!(c, o, Vector{UInt8}(undef, filesize(c, o))))
+    properties = cachedproperties(c, o)
+    properties === nothing || return String(readbytes!(c, o, Vector{UInt8}(undef, properties.size)))
+
+    data,nbytes = readfirst(c, o, c.integrity ? _CRC64_MAXIMUM_RANGE : _MINBYTES_PER_BLOCK)
+    n = length(data)
+    if nbytes > n
+        resize!(data, nbytes)
+        GC.@preserve data readbytes!(c, o, unsafe_wrap(Array, pointer(data, n+1), nbytes-n; own=false); offset=n)
+    end
+    String(data)
+end
+
+# read the first `n` bytes of a blob, taking the size of the blob from the Content-Range of the response
+function readfirst(c::AzContainer, o::AbstractString, n)
+    verify = c.integrity && n <= _CRC64_MAXIMUM_RANGE
+    r = try
+        @retry c.nretry checkcrc64(HTTP.request(
+            "GET",
+            "$(endpoint(c.storageaccount))/$(c.containername)/$(addprefix(c,o))",
+            Dict(
+                "Authorization" => "Bearer $(token(c.session))",
+                "x-ms-version" => API_VERSION,
+                "Range" => "bytes=0-$(n-1)",
+                (verify ? ("x-ms-range-get-content-crc64" => "true",) : ())...),
+            retry = false,
+            verbose = c.verbose), verify)
+    catch e
+        # the service responds with "invalid range" for a zero-length blob
+        (isa(e, HTTP.StatusError) && e.status == 416) && return UInt8[],0
+        rethrow(e)
+    end
+    contentrange = HTTP.header(r, "Content-Range")
+    nbytes = contentrange == "" ? length(r.body) : parse(Int, split(contentrange, '/')[end])
+    cacheproperties!(c, o, BlobProperties(r, nbytes))
+    r.body, nbytes
+end
 
 """
-    read!(container, "blobname", data; offset=0)
+    read!(container, "blobname", data; offset=0, chunksize=32_000_000)
 
 read from the blob "blobname" in `container::AzContainer` into `data::DenseArray`, and
 where `offset` specifies a number of bytes in the blob to skip before reading.  This
@@ -435,17 +1642,47 @@ method returns `data`.  For example,
 ```
 data = read!(AzContainer("foo";storageaccount="bar"), "baz.bin", Vector{Float32}(undef,10))
 ```
+For threaded reads, the range is split into chunks of about `chunksize` bytes that the
+threads pull from a shared queue, such that a slow chunk does not stall the other threads.
 """
-function Base.read!(c::AzContainer, o::AbstractString, data::AbstractArray{T}; offset=0) where {T}
+function Base.read!(c::AzContainer, o::AbstractString, data::AbstractArray{T}; offset=0, chunksize=_MINBYTES_PER_BLOCK) where {T}
     if _iscontiguous(data)
         _data = unsafe_wrap(Array, convert(Ptr{UInt8}, pointer(data)), length(data)*sizeof(T), own=false)
-        readbytes!(c, o, _data; offset=offset*sizeof(T))
+        readbytes!(c, o, _data; offset=offset*sizeof(T), chunksize=chunksize)
     else
         error("AzStorage does not support reading objects of type $T and/or into a non-contiguous array.")
     end
     data
 end
 
+"""
+    read!(container, ["blobname1", "blobname2", ...], [data1, data2, ...]) -> datas
+
+read from the blobs `blobnames[i]` in `container::AzContainer` into `datas[i]::DenseArray` for all `i`,
+in one threaded call with at most `container.nthreads` requests in flight.  This amortizes the
+per-request latency when reading many small blobs.  This method returns `datas`.
+"""
+function Base.read!(c::AzContainer, os::AbstractVector{<:AbstractString}, datas::AbstractVector)
+    length(os) == length(datas) || throw(DimensionMismatch("AzStorage: `read!` requires one blob name per data item"))
+    for data in datas
+        _iscontiguous(data) || error("AzStorage does not support reading objects of type $(eltype(data)) and/or into a non-contiguous array.")
+    end
+    _os = [addprefix(c,o) for o in os]
+    _offsets = zeros(Csize_t, length(os))
+    _sizes = Csize_t[length(data)*sizeof(eltype(data)) for data in datas]
+
+    t = token(c.session)
+    r = GC.@preserve datas begin
+        _ptrs = Ptr{UInt8}[convert(Ptr{UInt8}, pointer(data)) for data in datas]
+        ccall((:curl_readbytes_batch_retry_threaded, libAzStorage), ResponseCodes,
+            (Cstring, Cstring,          Cstring,         Ptr{Cstring}, Ptr{Ptr{UInt8}}, Ptr{Csize_t}, Ptr{Csize_t}, Cint,       Cint,       Cint,        Cint, Cint,     Cint),
+             t,       c.storageaccount, c.containername, _os,          _ptrs,           _offsets,     _sizes,       length(os), c.nthreads, c.integrity, 0,    c.nretry, c.verbose)
+    end
+    r.http >= 300 && error("read!: error code $(r.http)")
+    r.curl > 0 && error("curl error, code=$(r.curl)")
+    datas
+end
+
 """
     read(object, String)
 
@@ -472,7 +1709,375 @@ io = open(AzContainer("mycontainer";storageaccount="mystorageaccount"), "foo.txt
 read!(io, Vector{Float64}(undef, 10))
 ```
 """
-Base.read!(o::AzObject, data; offset=0) = read!(o.container, o.name, data; offset=offset)
+Base.read!(o::AzObject, data; offset=0, chunksize=_MINBYTES_PER_BLOCK) = read!(o.container, o.name, data; offset=offset, chunksize=chunksize)
+
+const _MAXGAP_BYTES = 256_000
+
+"""
+    readv!(container, "blobname", offsets, buffers; maxgap=256_000, maxsize=32_000_000) -> buffers
+
+Read many ranges from the blob "blobname" in `container::AzContainer` in a single threaded call,
+where `buffers[i]` is filled starting at `offsets[i]`.  Similar to `read!`, `offsets[i]` is
+in units of `eltype(buffers[i])`.  Ranges that are separated by at most `maxgap` bytes are
+coalesced into a single request (of at most `maxsize` bytes), and the response is scattered
+directly into the buffers.  This method returns `buffers`.  For example,
+```
+traces = [Vector{Float32}(undef, 1000) for i = 1:10_000]
+readv!(container, "shots.bin", [rand(0:1_000_000)*1000 for i=1:10_000], traces)
+```
+"""
+function readv!(c::AzContainer, o::AbstractString, offsets::AbstractVector{<:Integer}, buffers::AbstractVector; maxgap=_MAXGAP_BYTES, maxsize=_MINBYTES_PER_BLOCK)
+    length(offsets) == length(buffers) || throw(DimensionMismatch("AzStorage: `readv!` requires one offset per buffer"))
+    for buffer in buffers
+        _iscontiguous(buffer) || error("AzStorage does not support reading objects of type $(eltype(buffer)) and/or into a non-contiguous array.")
+    end
+    # the ranges would be scattered from the compressed bytes
+    c.compression != "" && codecindex(c, o) !== nothing && error("AzStorage: `readv!` does not support compressed blobs, use `read!` instead.")
+    _offsets = Csize_t[offsets[i]*sizeof(eltype(buffers[i])) for i in eachindex(offsets, buffers)]
+    _sizes = Csize_t[length(buffer)*sizeof(eltype(buffer)) for buffer in buffers]
+
+    t = token(c.session)
+    r = GC.@preserve buffers begin
+        _buffers = Ptr{UInt8}[convert(Ptr{UInt8}, pointer(buffer)) for buffer in buffers]
+        ccall((:curl_readbytes_vectored_retry_threaded, libAzStorage), ResponseCodes,
+            (Cstring, Cstring,          Cstring,         Cstring,        Ptr{Ptr{UInt8}}, Ptr{Csize_t}, Ptr{Csize_t}, Cint,             Csize_t, Csize_t, Cint,       Cint,     Cint),
+             t,       c.storageaccount, c.containername, addprefix(c,o), _buffers,        _offsets,     _sizes,       length(buffers), maxgap,  maxsize, c.nthreads, c.nretry, c.verbose)
+    end
+    r.http >= 300 && error("readv!: error code $(r.http)")
+    r.curl > 0 && error("curl error, code=$(r.curl)")
+    buffers
+end
+
+"""
+    readv!(object, offsets, buffers; maxgap=256_000, maxsize=32_000_000) -> buffers
+
+Read many ranges from `object::AzObject`.  See `readv!(container, "blobname", offsets, buffers)`.
+"""
+readv!(o::AzObject, offsets, buffers; kwargs...) = readv!(o.container, o.name, offsets, buffers; kwargs...)
+
+"""
+    read_async!(container, "blobname", data; offset=0, chunksize=32_000_000) -> Task
+
+Start reading from the blob "blobname" in `container::AzContainer` into `data::DenseArray`, and
+return immediately.  The returned task completes (returning `data`) once the read is done, and
+can be waited on without occupying a thread, which allows for overlapping I/O with compute.
+For example,
+```
+t = read_async!(container, "chunk2.bin", y)
+process(x)
+wait(t)
+```
+`data` must not be modified until the read is done.
+"""
+function read_async!(c::AzContainer, o::AbstractString, data::AbstractArray{T}; offset=0, chunksize=_MINBYTES_PER_BLOCK) where {T}
+    _iscontiguous(data) || error("AzStorage does not support reading objects of type $T and/or into a non-contiguous array.")
+    _data = unsafe_wrap(Array, convert(Ptr{UInt8}, pointer(data)), length(data)*sizeof(T), own=false)
+    _offset = offset*sizeof(T)
+
+    if c.compression != ""
+        index = codecindex(c, o)
+        if index !== nothing
+            return @async begin
+                readbytes_compressed!(c, o, _data, _offset, index)
+                data
+            end
+        end
+    end
+
+    _nthreads = nthreads_effective(nconcurrent(c), length(_data))
+    if _nthreads == 1
+        return @async begin
+            readbytes!(c, o, _data; offset=_offset, chunksize=chunksize)
+            data
+        end
+    end
+
+    # the curl_multi engine does not check integrity
+    nrequests,nthreads = c.nrequests > 0 && !c.integrity ? (min(c.nrequests, cld(length(_data), max(chunksize, 1))),c.nthreads) : (0,_nthreads)
+    slot = TokenSlot(c.session)
+    cond = Base.AsyncCondition()
+    transfer = ccall((:curl_readbytes_async, libAzStorage), Ptr{Cvoid},
+        (Cstring,    Ptr{Cvoid}, Cstring,          Cstring,         Cstring,        Ptr{UInt8}, Csize_t, Csize_t,       Csize_t,   Cint,     Cint,      Cint,    Ptr{ResponseCodes}, Cint,        Cint,     Cint,      Ptr{Cvoid},             Ptr{Cvoid}),
+         slot.token, slot.ptr,   c.storageaccount, c.containername, addprefix(c,o), _data,      _offset, length(_data), chunksize, nthreads, nrequests, c.http2, C_NULL,             c.integrity, c.nretry, c.verbose, cglobal(:uv_async_send), cond.handle)
+    async_started(transfer, slot, cond)
+    @async begin
+        r = wait_transfer(transfer, cond)
+        close(slot)
+        r.http >= 300 && error("read_async!: error code $(r.http)")
+        r.curl > 0 && error("curl error, code=$(r.curl)")
+        data
+    end
+end
+
+"""
+    read_async!(object, data; offset=0) -> Task
+
+Start reading from `object::AzObject` into `data`.  See `read_async!(container, "blobname", data)`.
+"""
+read_async!(o::AzObject, data; offset=0, chunksize=_MINBYTES_PER_BLOCK) = read_async!(o.container, o.name, data; offset=offset, chunksize=chunksize)
+
+"""
+    write_async(container, "blobname", data::StridedArray) -> Task
+
+Start writing the array `data` to a blob with the name `blobname` in `container::AzContainer`, and
+return immediately.  The returned task completes once the blob is committed.  `data` must not be
+modified until the write is done.
+"""
+function write_async(c::AzContainer, o::AbstractString, data::AbstractArray{T}) where {T}
+    _iscontiguous(data) || error("AzStorage: `write` is not supported on non-isbits arrays and/or non-contiguous arrays")
+    _data = unsafe_wrap(Vector{UInt8}, convert(Ptr{UInt8}, pointer(data)), length(data)*sizeof(T), own=false)
+
+    _nblocks = nblocks(nconcurrent(c), length(_data))
+    if _nblocks == 1
+        return @async begin
+            writebytes_blob(c, o, _data, "application/octet-stream")
+            data
+        end
+    end
+
+    _blockids = blockids(_nblocks)
+    __blockids = [HTTP.escapeuri(blockid) for blockid in _blockids]
+    blockcrcs = c.integrity ? Vector{UInt64}(undef, _nblocks) : nothing
+    _blockcrcs = blockcrcs === nothing ? Ptr{UInt64}(C_NULL) : pointer(blockcrcs)
+    slot = TokenSlot(c.session)
+    cond = Base.AsyncCondition()
+    transfer = ccall((:curl_writebytes_block_async, libAzStorage), Ptr{Cvoid},
+        (Cstring,    Ptr{Cvoid}, Cstring,          Cstring,         Cstring,        Ptr{Cstring}, Ptr{UInt8}, Csize_t,       Cint,       Cint,     Ptr{UInt8}, Ptr{ResponseCodes}, Ptr{UInt64}, Ptr{Codec}, Cint,        Cint,    Cint, Cint,     Cint,      Ptr{Cvoid},             Ptr{Cvoid}),
+         slot.token, slot.ptr,   c.storageaccount, c.containername, addprefix(c,o), __blockids,   _data,      length(_data), c.nthreads, _nblocks, C_NULL,     C_NULL,             _blockcrcs,  C_NULL,     c.nrequests, c.http2, 0,    c.nretry, c.verbose, cglobal(:uv_async_send), cond.handle)
+    async_started(transfer, slot, cond)
+    @async begin
+        r = GC.@preserve blockcrcs wait_transfer(transfer, cond)
+        close(slot)
+        r.http >= 300 && error("write_async: error code $(r.http)")
+        r.curl > 0 && error("curl error, code=$(r.curl)")
+        putblocklist(c, o, _blockids; crc=blockcrcs === nothing ? nothing : crc64combine(blockcrcs, length(_data)))
+        data
+    end
+end
+
+"""
+    write_async(object, data) -> Task
+
+Start writing `data` to `object::AzObject`.  See `write_async(container, "blobname", data)`.
+"""
+write_async(o::AzObject, data) = write_async(o.container, o.name, data)
+
+# the transfer is C_NULL when the C layer can not allocate it
+function async_started(transfer, slot, cond)
+    if transfer == C_NULL
+        close(cond)
+        slot === nothing || close(slot)
+        error("AzStorage: unable to start the transfer")
+    end
+    transfer
+end
+
+# The C driver marks the transfer done before it signals `cond`, so the transfer is released (by curl_async_wait) before
+# `cond` is closed.
+function wait_transfer(transfer, cond)
+    while ccall((:curl_async_done, libAzStorage), Cint, (Ptr{Cvoid},), transfer) == 0
+        wait(cond)
+    end
+    r = ccall((:curl_async_wait, libAzStorage), ResponseCodes, (Ptr{Cvoid},), transfer)
+    close(cond)
+    r
+end
+
+#
+# Token refresh (see the notes of `AzContainer`).  The token slot lives in the C layer, and a timer sets it from
+# `token(session)` when the token changes, or when a request asks for a refresh (after a 401 or 403).  The slot must
+# outlive the transfers that use it.
+#
+const _TOKEN_REFRESH_INTERVAL = 1.0
+
+mutable struct TokenSlot
+    ptr::Ptr{Cvoid}
+    token::String
+    sourcetoken::String
+    lock::ReentrantLock
+    timer::Union{Timer,Nothing}
+end
+
+# `sourcesession`, if not `nothing`, authorizes the reads of the source of a server-side copy
+sourcetoken(sourcesession) = sourcesession === nothing ? "" : token(sourcesession)
+
+function TokenSlot(session, sourcesession=nothing)
+    t,s = token(session),sourcetoken(sourcesession)
+    ptr = ccall((:curl_token_new, libAzStorage), Ptr{Cvoid}, (Cstring, Cstring), t, s)
+    ptr == C_NULL && error("AzStorage: unable to allocate the token slot")
+    slot = TokenSlot(ptr, t, s, ReentrantLock(), nothing)
+    slot.timer = Timer(timer->refresh!(slot, session, sourcesession), _TOKEN_REFRESH_INTERVAL; interval=_TOKEN_REFRESH_INTERVAL)
+    slot
+end
+
+function refresh!(slot::TokenSlot, session, sourcesession=nothing)
+    lock(slot.lock) do
+        slot.ptr == C_NULL && return
+        try
+            t,s = token(session),sourcetoken(sourcesession)
+            if t != slot.token || s != slot.sourcetoken || ccall((:curl_token_stale, libAzStorage), Cint, (Ptr{Cvoid},), slot.ptr) != 0
+                ccall((:curl_token_set, libAzStorage), Cint, (Ptr{Cvoid}, Cstring, Cstring), slot.ptr, t, s) == 0 || error("unable to set the token")
+                slot.token,slot.sourcetoken = t,s
+            end
+        catch e
+            @debug "AzStorage: token refresh failed" exception=e
+        end
+    end
+    nothing
+end
+
+function Base.close(slot::TokenSlot)
+    close(slot.timer)
+    lock(slot.lock) do
+        ccall((:curl_token_free, libAzStorage), Cvoid, (Ptr{Cvoid},), slot.ptr)
+        slot.ptr = C_NULL
+    end
+    nothing
+end
+
+# run the threaded transfer that is started by `start(slot, cond)` on a C thread, with its token (and the token of the
+# copy source `src`, if any) refreshed while it runs.  The slot is only freed once the transfer is done.
+function transfer_refreshed(start, c::AzContainer, src=nothing)
+    slot = TokenSlot(c.session, src === nothing ? nothing : src.session)
+    cond = Base.AsyncCondition()
+    r = wait_transfer(async_started(start(slot, cond), slot, cond), cond)
+    close(slot)
+    r
+end
+
+mutable struct AzObjectReader <: IO
+    object::AzObject
+    nbytes::Int
+    blocksize::Int
+    nprefetch::Int
+    position::Int
+    blocks::Dict{Int,Tuple{Task,Vector{UInt8}}}
+    iblock::Int
+    block::Vector{UInt8}
+    isopen::Bool
+    index::Union{CodecIndex,Nothing}
+end
+
+function AzObjectReader(object::AzObject; blocksize=_MINBYTES_PER_BLOCK, nprefetch=4, nbytes=nothing)
+    c = object.container
+    # the blocks of a compressed blob are decompressed as they are read
+    index = c.compression == "" ? nothing : codecindex(c, object.name)
+    io = AzObjectReader(object, 0, blocksize, max(nprefetch, 0), 0, Dict{Int,Tuple{Task,Vector{UInt8}}}(), -1, UInt8[], true, index)
+    properties = cachedproperties(object.container, object.name)
+    if nbytes !== nothing
+        io.nbytes = nbytes
+    elseif index !== nothing
+        io.nbytes = index.nbytes
+    elseif properties !== nothing
+        io.nbytes = properties.size
+    else
+        # the first block is fetched synchronously, and gives the size of the blob
+        data,io.nbytes = readfirst(object.container, object.name, blocksize)
+        io.blocks[0] = (@async(nothing), data)
+    end
+    io
+end
+
+function getblock_async(c::AzContainer, o::AbstractString, data::Vector{UInt8}, offset, index=nothing)
+    if index !== nothing
+        return @async begin
+            readbytes_compressed!(c, o, data, offset, index)
+            nothing
+        end
+    end
+    t = token(c.session)
+    cond = Base.AsyncCondition()
+    transfer = ccall((:curl_readbytes_async, libAzStorage), Ptr{Cvoid},
+        (Cstring, Ptr{Cvoid}, Cstring,          Cstring,         Cstring,        Ptr{UInt8}, Csize_t, Csize_t,      Csize_t,      Cint, Cint, Cint,    Ptr{ResponseCodes}, Cint, Cint,     Cint,      Ptr{Cvoid},             Ptr{Cvoid}),
+         t,       C_NULL,     c.storageaccount, c.containername, addprefix(c,o), data,       offset,  length(data), length(data), 1,    0,    c.http2, C_NULL,             0,    c.nretry, c.verbose, cglobal(:uv_async_send), cond.handle)
+    async_started(transfer, nothing, cond)
+    @async begin
+        r = GC.@preserve data wait_transfer(transfer, cond)
+        r.http >= 300 && error("getblock: error code $(r.http)")
+        r.curl > 0 && error("curl error, code=$(r.curl)")
+        nothing
+    end
+end
+
+nblocks(io::AzObjectReader) = cld(io.nbytes, io.blocksize)
+
+function prefetch!(io::AzObjectReader, iblock)
+    if !haskey(io.blocks, iblock) && 0 <= iblock < nblocks(io)
+        offset = iblock*io.blocksize
+        data = Vector{UInt8}(undef, min(io.blocksize, io.nbytes - offset))
+        io.blocks[iblock] = (getblock_async(io.object.container, io.object.name, data, offset, io.index), data)
+    end
+    nothing
+end
+
+# returns the block containing the current position, and maintains the read-ahead window
+function currentblock(io::AzObjectReader)
+    iblock = div(io.position, io.blocksize)
+    iblock == io.iblock && return io.block, io.position - iblock*io.blocksize
+    for _iblock in collect(keys(io.blocks))
+        (iblock <= _iblock <= iblock+io.nprefetch) || delete!(io.blocks, _iblock)
+    end
+    for _iblock = iblock:iblock+io.nprefetch
+        prefetch!(io, _iblock)
+    end
+    task,data = io.blocks[iblock]
+    wait(task)
+    io.iblock,io.block = iblock,data
+    data, io.position - iblock*io.blocksize
+end
+
+function Base.unsafe_read(io::AzObjectReader, p::Ptr{UInt8}, n::UInt)
+    io.isopen || throw(ArgumentError("read failed, AzObjectReader is not open"))
+    m = 0
+    while m < n
+        eof(io) && throw(EOFError())
+        data,i = currentblock(io)
+        _m = min(n - m, length(data) - i)
+        GC.@preserve data unsafe_copyto!(p + m, pointer(data, i+1), _m)
+        io.position += _m
+        m += _m
+    end
+    nothing
+end
+
+function Base.read(io::AzObjectReader, ::Type{UInt8})
+    io.isopen || throw(ArgumentError("read failed, AzObjectReader is not open"))
+    eof(io) && throw(EOFError())
+    data,i = currentblock(io)
+    io.position += 1
+    data[i+1]
+end
+
+function Base.readbytes!(io::AzObjectReader, b::AbstractVector{UInt8}, nb=length(b))
+    n = min(nb, bytesavailable(io))
+    n > length(b) && resize!(b, n)
+    GC.@preserve b unsafe_read(io, pointer(b), n)
+    n
+end
+
+Base.bytesavailable(io::AzObjectReader) = io.nbytes - io.position
+Base.eof(io::AzObjectReader) = io.position >= io.nbytes
+Base.position(io::AzObjectReader) = io.position
+Base.filesize(io::AzObjectReader) = io.nbytes
+
+function Base.seek(io::AzObjectReader, n::Integer)
+    io.position = clamp(n, 0, io.nbytes)
+    io
+end
+Base.seekstart(io::AzObjectReader) = seek(io, 0)
+Base.seekend(io::AzObjectReader) = seek(io, io.nbytes)
+Base.skip(io::AzObjectReader, n::Integer) = seek(io, io.position + n)
+
+Base.isopen(io::AzObjectReader) = io.isopen
+Base.isreadable(io::AzObjectReader) = io.isopen
+Base.iswritable(io::AzObjectReader) = false
+
+function Base.close(io::AzObjectReader)
+    io.isopen = false
+    empty!(io.blocks)
+    io.iblock,io.block = -1,UInt8[]
+    nothing
+end
 
 """
     deserialize(container, "blobname")
@@ -487,8 +2092,10 @@ a,b = deserialize(io)
 ```
 """
 function Serialization.deserialize(c::AzContainer, o::AbstractString)
-    io = IOBuffer(readbytes!(c, o, Vector{UInt8}(undef,filesize(c, o))); read=true)
-    deserialize(io)
+    io = AzObjectReader(AzObject(c, o); nprefetch=nconcurrent(c))
+    x = deserialize(io)
+    close(io)
+    x
 end
 
 """
@@ -498,35 +2105,126 @@ read and deserialize a blob `object::AzObject`.  See `deserialize(container, "bl
 """
 Serialization.deserialize(o::AzObject) = deserialize(o.container, o.name)
 
-"""
-    readdir(container)
+#
+# Listing.  The List Blobs/List Containers responses are scanned for the <Name> and <NextMarker>
+# elements without building a DOM, and the next page is fetched in the background while the
+# caller consumes the current page.
+#
+const _XML_ENTITIES = Dict("amp"=>"&", "lt"=>"<", "gt"=>">", "quot"=>"\"", "apos"=>"'")
+
+function xmlunescape(s::AbstractString)
+    occursin('&', s) || return String(s)
+    replace(s, r"&(#x[0-9a-fA-F]+|#[0-9]+|[a-z]+);" => function(entity)
+        name = entity[2:end-1]
+        if startswith(name, "#x")
+            return string(Char(parse(UInt32, name[3:end]; base=16)))
+        elseif startswith(name, "#")
+            return string(Char(parse(UInt32, name[2:end])))
+        end
+        get(_XML_ENTITIES, name, entity)
+    end)
+end
 
-list of objects in a container.
-"""
-function Base.readdir(c::AzContainer; filterlist=true)
-    marker = ""
+function xmlelement(body::String, tag, i)
+    r = findnext("<$tag>", body, i)
+    r === nothing && return nothing, i
+    _r = findnext("</$tag>", body, last(r)+1)
+    _r === nothing && error("AzStorage: malformed list response, missing </$tag>")
+    xmlunescape(SubString(body, last(r)+1, first(_r)-1)), last(_r)+1
+end
+
+function listpage(body::String, strip)
     names = String[]
+    i = 1
     while true
-        r = @retry c.nretry HTTP.request(
+        name,i = xmlelement(body, "Name", i)
+        name === nothing && break
+        push!(names, strip == "" ? name : replace(name, strip=>"", count=1))
+    end
+    marker,_ = xmlelement(body, "NextMarker", 1)
+    names, marker === nothing ? "" : marker
+end
+
+struct AzListIterator{A<:AzSessionAbstract}
+    url::String
+    session::A
+    nretry::Int
+    strip::String
+end
+
+function listpage_async(it::AzListIterator, marker)
+    channel = Channel{Any}(1)
+    @async put!(channel, try
+        r = @retry it.nretry HTTP.request(
             "GET",
-            "https://$(c.storageaccount).blob.core.windows.net/$(c.containername)?restype=container&comp=list&marker=$marker",
+            "$(it.url)&marker=$(HTTP.escapeuri(marker))",
             Dict(
-                "Authorization" => "Bearer $(token(c.session))",
+                "Authorization" => "Bearer $(token(it.session))",
                 "x-ms-version" => API_VERSION),
             retry = false)
-        xroot = root(parse_string(String(r.body)))
-        blobs = xroot["Blobs"][1]["Blob"]
-        _names = [content(blob["Name"][1]) for blob in blobs]
-        if filterlist && c.prefix != ""
-            _names = replace.(filter(_name->startswith(_name, c.prefix), _names), _normpath(c.prefix*"/")=>"")
-        end
-        names = [names; _names]
-        marker = content(xroot["NextMarker"][1])
-        marker == "" && break
+        listpage(String(r.body), it.strip)
+    catch e
+        e
+    end)
+    channel
+end
+
+Base.IteratorSize(::Type{<:AzListIterator}) = Base.SizeUnknown()
+Base.eltype(::Type{<:AzListIterator}) = String
+
+Base.iterate(it::AzListIterator) = iterate(it, (String[], 0, listpage_async(it, "")))
+
+function Base.iterate(it::AzListIterator, state)
+    names,i,channel = state
+    while i == length(names)
+        channel === nothing && return nothing
+        page = take!(channel)
+        isa(page, Exception) && throw(page)
+        names,marker = page
+        channel = marker == "" ? nothing : listpage_async(it, marker)
+        i = 0
     end
-    names
+    names[i+1], (names, i+1, channel)
 end
 
+"""
+    eachblob(container[; prefix="", delimiter="", maxresults=0])
+
+Returns an iterator over the names of the blobs in `container::AzContainer`.  The listing is fetched
+page-by-page, with the next page fetched in the background while the current page is consumed.
+Hence, listing a large container uses constant memory.  See `readdir` for a description of the
+keyword arguments.
+
+# Example
+```
+for name in eachblob(AzContainer("mycontainer";storageaccount="mystorageaccount"); prefix="shots/")
+    println(name)
+end
+```
+"""
+function eachblob(c::AzContainer; filterlist=true, prefix="", delimiter="", maxresults=0)
+    _prefix = (filterlist && c.prefix != "") ? _normpath(c.prefix*"/")*prefix : prefix
+    query = "restype=container&comp=list"
+    _prefix == "" || (query *= "&prefix=$(HTTP.escapeuri(_prefix))")
+    delimiter == "" || (query *= "&delimiter=$(HTTP.escapeuri(delimiter))")
+    maxresults > 0 && (query *= "&maxresults=$maxresults")
+    strip = (filterlist && c.prefix != "") ? _normpath(c.prefix*"/") : ""
+    AzListIterator("$(endpoint(c.storageaccount))/$(c.containername)?$query", c.session, c.nretry, strip)
+end
+
+"""
+    readdir(container[; prefix="", delimiter="", maxresults=0])
+
+list of objects in a container.  The listing is filtered by the service, such that only
+the blobs whose name (relative to the container's prefix) start with `prefix` are returned.
+If `delimiter` is given (e.g. `delimiter="/"`), then the blobs are listed as a pseudo-directory
+hierarchy: blobs whose names contain `delimiter` after `prefix` are collapsed into a single
+entry that ends with `delimiter`.  `maxresults` sets the number of results per page (0 uses
+the service default of 5000).
+"""
+Base.readdir(c::AzContainer; filterlist=true, prefix="", delimiter="", maxresults=0) =
+    collect(eachblob(c; filterlist=filterlist, prefix=prefix, delimiter=delimiter, maxresults=maxresults))
+
 """
     dirname(container)
 
@@ -562,7 +2260,21 @@ AbstractStorage.minimaldict(c::AzContainer) = Dict("storageaccount"=>c.storageac
 
 Returns true if the blob "blobname" exists in `container::AzContainer`.
 """
-Base.isfile(c::AzContainer, object::AbstractString) = object ∈ readdir(c)
+function Base.isfile(c::AzContainer, object::AbstractString)
+    try
+        @retry c.nretry HTTP.request(
+            "HEAD",
+            "$(endpoint(c.storageaccount))/$(c.containername)/$(addprefix(c,object))",
+            Dict(
+                "Authorization" => "Bearer $(token(c.session))",
+                "x-ms-version" => API_VERSION),
+            retry = false)
+    catch e
+        (isa(e, HTTP.StatusError) && e.status == 404) && return false
+        rethrow(e)
+    end
+    true
+end
 
 """
     isfile(object::AzObject)
@@ -571,7 +2283,26 @@ Returns true if the blob corresponding to `object` exists.
 """
 Base.isfile(o::AzObject) = isfile(o.container, o.name)
 
-iscontainer(c::AzContainer) = c.containername ∈ containers(storageaccount=c.storageaccount, session=c.session, nretry=c.nretry)
+function iscontainer(c::AzContainer)
+    if c.cachettl > 0
+        t = lock(() -> get(_CONTAINER_CACHE, cachekey(c), 0.0), _CACHE_LOCK)
+        time() - t < c.cachettl && return true
+    end
+    try
+        @retry c.nretry HTTP.request(
+            "HEAD",
+            "$(endpoint(c.storageaccount))/$(c.containername)?restype=container",
+            Dict(
+                "Authorization" => "Bearer $(token(c.session))",
+                "x-ms-version" => API_VERSION),
+            retry = false)
+    catch e
+        (isa(e, HTTP.StatusError) && e.status == 404) && return false
+        rethrow(e)
+    end
+    c.cachettl > 0 && lock(() -> _CONTAINER_CACHE[cachekey(c)] = time(), _CACHE_LOCK)
+    true
+end
 
 """
     isdir(container)
@@ -585,7 +2316,7 @@ function Base.isdir(c::AzContainer)
     if c.prefix == ""
         return true
     end
-    !isempty(readdir(c::AzContainer))
+    iterate(eachblob(c; maxresults=1)) !== nothing
 end
 
 """
@@ -594,23 +2325,7 @@ end
 list all containers in a given storage account.
 """
 function containers(;storageaccount, session=AzSession(;lazy=true, scope=__OAUTH_SCOPE), nretry=5)
-    marker = ""
-    names = String[]
-    while true
-        r = @retry nretry HTTP.request(
-            "GET",
-            "https://$storageaccount.blob.core.windows.net/?comp=list&marker=$marker",
-            Dict(
-                "Authorization" => "Bearer $(token(session))",
-                "x-ms-version" => API_VERSION),
-            retry = false)
-        xroot = root(parse_string(String(r.body)))
-        containers = xroot["Containers"][1]["Container"]
-        names = [names; [content(container["Name"][1]) for container in containers]]
-        marker = content(xroot["NextMarker"][1])
-        marker == "" && break
-    end
-    names
+    collect(AzListIterator("$(endpoint(storageaccount))/?comp=list", session, nretry, ""))
 end
 
 """
@@ -619,9 +2334,20 @@ end
 Returns the size of the blob "blobname" that is in `container::AzContainer`
 """
 function Base.filesize(c::AzContainer, o::AbstractString)
+    if c.compression != ""
+        index = codecindex(c, o)
+        index === nothing || return index.nbytes
+    end
+    properties(c, o).size
+end
+
+function properties(c::AzContainer, o::AbstractString)
+    properties = cachedproperties(c, o)
+    properties === nothing || return properties
+
     r = @retry c.nretry HTTP.request(
         "HEAD",
-        "https://$(c.storageaccount).blob.core.windows.net/$(c.containername)/$(addprefix(c,o))",
+        "$(endpoint(c.storageaccount))/$(c.containername)/$(addprefix(c,o))",
         Dict(
             "Authorization" => "Bearer $(token(c.session))",
             "x-ms-version" => API_VERSION),
@@ -632,7 +2358,7 @@ function Base.filesize(c::AzContainer, o::AbstractString)
             n = parse(Int, header.second)
         end
     end
-    n
+    cacheproperties!(c, o, BlobProperties(r, n))
 end
 
 """
@@ -648,10 +2374,11 @@ Base.filesize(o::AzObject) = filesize(o.container, o.name)
 remove the blob "blobname" from `container::AzContainer`.
 """
 function Base.rm(c::AzContainer, o::AbstractString)
+    invalidate!(c, o)
     try
         @retry c.nretry HTTP.request(
             "DELETE",
-            "https://$(c.storageaccount).blob.core.windows.net/$(c.containername)/$(addprefix(c,o))",
+            "$(endpoint(c.storageaccount))/$(c.containername)/$(addprefix(c,o))",
             Dict(
                 "Authorization" => "Bearer $(token(c.session))",
                 "x-ms-version" => API_VERSION),
@@ -672,57 +2399,404 @@ Base.rm(o::AzObject) = rm(o.container, o.name)
 """
     rm(container)
 
-remove `container::AzContainer` and all of its blobs.
+remove `container::AzContainer` and all of its blobs.  If `container` has a prefix, then only the
+blobs under that prefix are removed (in batches, see `rm(container, names)`), and the container itself
+is removed if it is left empty.  Returns a vector of `AzStorage.BatchFailure` with the blobs that
+could not be removed.  An error listing the blobs, or a batch request that fails after `nretry`
+retries, is thrown, and an error removing the container itself is only a warning.
 """
 function Base.rm(c::AzContainer)
     function _rm(c::AzContainer)
         @retry c.nretry HTTP.request(
             "DELETE",
-            "https://$(c.storageaccount).blob.core.windows.net/$(c.containername)?restype=container",
+            "$(endpoint(c.storageaccount))/$(c.containername)?restype=container",
             Dict(
                 "Authorization" => "Bearer $(token(c.session))",
                 "x-ms-version" => API_VERSION),
             retry = false)
     end
 
-    try
-        if c.prefix == ""
-            _rm(c)
-        else
-            for o in readdir(c)
-                rm(c, o)
-            end
-            isempty(readdir(c; filterlist=false)) && _rm(c)
+    invalidate!(c)
+    # errors listing or removing the blobs are thrown, so that an empty result means that the blobs are removed
+    if c.prefix != ""
+        failures = rm(c, eachblob(c))
+        if !isempty(failures)
+            @warn "error removing $(length(failures)) blobs from $(c.containername)/$(c.prefix)"
+            return failures
         end
+        iterate(eachblob(c; filterlist=false, maxresults=1)) === nothing || return BatchFailure[]
+    end
+
+    try
+        _rm(c)
     catch
         @warn "error removing $(c.containername)"
     end
 
-    nothing
+    BatchFailure[]
+end
+
+"""
+    rm(container, names)
+
+remove the blobs `names` (any iterable of blob names, for example `eachblob(container)`) from
+`container::AzContainer` using the Blob Batch API.  Names are sent in batches of up to 256 delete
+sub-requests, and up to `nrequests` (or `nthreads`) batches are in flight at a time.  Blobs that do
+not exist are not considered failures.  Returns a vector of `AzStorage.BatchFailure`, with one entry
+`(name, status, errorcode)` for each blob that could not be removed.
+
+# Example
+```
+failures = rm(container, ["foo.bin", "bar.bin"])
+```
+"""
+function Base.rm(c::AzContainer, os)
+    failures = asyncmap(Iterators.partition(os, _MAXREQUESTS_PER_BATCH); ntasks=nconcurrent(c)) do batch
+        rmbatch(c, collect(batch))
+    end
+    BatchFailure[failure for _failures in failures for failure in _failures]
+end
+
+struct BatchFailure
+    name::String
+    status::Int
+    errorcode::String
+end
+
+const _MAXREQUESTS_PER_BATCH = 256
+
+# https://docs.microsoft.com/en-us/rest/api/storageservices/blob-batch
+function rmbatch(c::AzContainer, os)
+    foreach(o->invalidate!(c, o), os)
+    failures = BatchFailure[]
+    for i = 1:c.nretry
+        _failures = BatchFailure[]
+        t = token(c.session)
+        boundary = "batch_$(string(rand(UInt128); base=16))"
+        io = IOBuffer()
+        for (j,o) in enumerate(os)
+            path = join([HTTP.escapeuri(s) for s in split(addprefix(c,o), '/')], '/')
+            write(io, "--$boundary\r\n",
+                "Content-Type: application/http\r\n",
+                "Content-Transfer-Encoding: binary\r\n",
+                "Content-ID: $(j-1)\r\n\r\n",
+                "DELETE /$(c.containername)/$path HTTP/1.1\r\n",
+                "Authorization: Bearer $t\r\n",
+                "Content-Length: 0\r\n\r\n")
+        end
+        write(io, "--$boundary--\r\n")
+        body = take!(io)
+
+        r = @retry c.nretry HTTP.request(
+            "POST",
+            "$(endpoint(c.storageaccount))/$(c.containername)?restype=container&comp=batch",
+            Dict(
+                "Authorization" => "Bearer $t",
+                "x-ms-version" => API_VERSION,
+                "Content-Type" => "multipart/mixed; boundary=$boundary",
+                "Content-Length" => "$(length(body))"),
+            body,
+            retry = false)
+
+        m = match(r"boundary=([^;\s]+)", HTTP.header(r, "Content-Type"))
+        m === nothing && error("AzStorage: malformed batch response, missing boundary")
+        for part in split(String(r.body), "--$(m.captures[1])")
+            id = match(r"Content-ID:\s*(\d+)"i, part)
+            status = match(r"HTTP/1\.1 (\d+)", part)
+            (id === nothing || status === nothing) && continue
+            _status = parse(Int, status.captures[1])
+            (_status < 300 || _status == 404) && continue
+            errorcode = match(r"x-ms-error-code:\s*(\S+)"i, part)
+            push!(_failures, BatchFailure(os[parse(Int, id.captures[1])+1], _status, errorcode === nothing ? "" : errorcode.captures[1]))
+        end
+
+        # only the sub-requests that failed with a retryable error are sent again
+        retryable = filter(failure->failure.status ∈ RETRYABLE_HTTP_ERRORS, _failures)
+        append!(failures, filter(failure->failure.status ∉ RETRYABLE_HTTP_ERRORS, _failures))
+        if isempty(retryable) || i == c.nretry
+            append!(failures, retryable)
+            break
+        end
+        os = [failure.name for failure in retryable]
+        sleep(min(2.0^(i-1), 256) + rand())
+    end
+    failures
 end
 
 """
     cp(container_src, container_dst)
 
-copy `container_src::AzContainer` and its blobs to `container_dst::AzContainer`.
+copy `container_src::AzContainer` and its blobs to `container_dst::AzContainer`.  The copies are
+server-side.  Blobs that are smaller than 256 MiB are copied with Copy Blob (or Copy Blob From URL
+across storage accounts), up to `nrequests` (or `nthreads`) of them at a time, and `cp` waits for
+pending copies to complete.  Larger blobs are
+copied one after the other, each in parallel blocks (see `cp(container_src, blob_src, container_dst, blob_dst)`).
 """
 function Base.cp(src::AzContainer, dst::AzContainer)
     mkpath(dst)
 
+    # small blobs are copied with Copy Blob, and large blobs are set aside to be copied block-by-block
     blobs = readdir(src)
-    for blob in blobs
-        @retry dst.nretry HTTP.request(
-            "PUT",
-            "https://$(dst.storageaccount).blob.core.windows.net/$(dst.containername)/$(addprefix(dst,blob))",
+    large = asyncmap(blobs; ntasks=nconcurrent(dst)) do blob
+        properties = AzStorage.properties(src, blob)
+        properties.size < _MINBYTES_COPY_PER_BLOCK && (copyblob(src, blob, dst, blob); return nothing)
+        blob, properties
+    end
+    filter!(x->x !== nothing, large)
+
+    # each large blob uses all of the threads of the copy engine
+    for (blob,properties) in large
+        copyblocks(src, blob, dst, blob, properties)
+    end
+    nothing
+end
+
+"""
+    cp(container_src, blob_src, container_dst, blob_dst)
+
+server-side copy of the blob `blob_src` in `container_src::AzContainer` to the blob `blob_dst` in
+`container_dst::AzContainer`, where the containers may belong to different storage accounts.  A blob
+that is smaller than 256 MiB is copied with Copy Blob (within a storage account, and `cp` waits for
+the copy to complete), or with Copy Blob From URL (across storage accounts, such that the service is
+given the credentials of `container_src`).  A larger blob is copied with Put Block From URL in blocks of up to 100 MiB, with up to `nrequests` (or
+`nthreads`) of the blocks of `container_dst` in flight at a time, and the blocks are then committed.
+In either case, the data does not pass through this host.
+
+# Example
+```julia
+src = AzContainer("foo"; storageaccount="bar", session=AzSession())
+dst = AzContainer("fiz"; storageaccount="baz", session=AzSession())
+cp(src, "a", dst, "b")
+```
+"""
+function Base.cp(src::AzContainer, srcblob::AbstractString, dst::AzContainer, dstblob::AbstractString)
+    properties = AzStorage.properties(src, srcblob)
+    if properties.size < _MINBYTES_COPY_PER_BLOCK
+        copyblob(src, srcblob, dst, dstblob)
+    else
+        copyblocks(src, srcblob, dst, dstblob, properties)
+    end
+    nothing
+end
+
+const _MINBYTES_COPY_PER_BLOCK = 256*1024*1024
+const _MAXBYTES_COPY_PER_BLOCK = 100*1024*1024
+
+# Copy Blob, and poll x-ms-copy-status until the (possibly asynchronous) copy completes.  Across storage accounts, the
+# (asynchronous) Copy Blob can not be given the credentials of the source, so the (synchronous) Copy Blob From URL is
+# used instead, which is limited to blobs of up to 256 MiB (_MINBYTES_COPY_PER_BLOCK).
+function copyblob(src::AzContainer, srcblob, dst::AzContainer, dstblob)
+    invalidate!(dst, dstblob)
+    url = "$(endpoint(dst.storageaccount))/$(dst.containername)/$(addprefix(dst,dstblob))"
+    fromurl = src.storageaccount != dst.storageaccount
+    r = @retry dst.nretry HTTP.request(
+        "PUT",
+        url,
+        Dict(
+            "Authorization" => "Bearer $(token(dst.session))",
+            "x-ms-version" => API_VERSION,
+            "x-ms-copy-source" => "$(endpoint(src.storageaccount))/$(src.containername)/$(addprefix(src,srcblob))",
+            (fromurl ? ("x-ms-requires-sync" => "true", "x-ms-copy-source-authorization" => "Bearer $(token(src.session))") : ())...),
+        retry = false)
+    status = HTTP.header(r, "x-ms-copy-status")
+    i = 0
+    while status == "pending"
+        sleep(min(0.1*2.0^i, 10.0))
+        i += 1
+        r = @retry dst.nretry HTTP.request(
+            "HEAD",
+            url,
             Dict(
                 "Authorization" => "Bearer $(token(dst.session))",
-                "x-ms-version" => API_VERSION,
-                "x-ms-copy-source" => "https://$(src.storageaccount).blob.core.windows.net/$(src.containername)/$(addprefix(src,blob))"),
+                "x-ms-version" => API_VERSION),
             retry = false)
+        status = HTTP.header(r, "x-ms-copy-status")
     end
+    status ∈ ("", "success") || error("AzStorage: copy of $srcblob to $dstblob did not succeed, x-ms-copy-status=$status, $(HTTP.header(r, "x-ms-copy-status-description"))")
     nothing
 end
 
-export AzContainer, containers, readdlm, writedlm
+# Put Block From URL, the service copies bytes [firstbyte, lastbyte) of the source into the uncommitted block
+function copyblock(src::AzContainer, srcblob, dst::AzContainer, dstblob, blockid, firstbyte, lastbyte)
+    @retry dst.nretry HTTP.request(
+        "PUT",
+        "$(endpoint(dst.storageaccount))/$(dst.containername)/$(addprefix(dst,dstblob))?comp=block&blockid=$(HTTP.escapeuri(blockid))",
+        Dict(
+            "Authorization" => "Bearer $(token(dst.session))",
+            "x-ms-version" => API_VERSION,
+            "x-ms-copy-source" => "$(endpoint(src.storageaccount))/$(src.containername)/$(addprefix(src,srcblob))",
+            "x-ms-copy-source-authorization" => "Bearer $(token(src.session))",
+            "x-ms-source-range" => "bytes=$firstbyte-$(lastbyte-1)",
+            "Content-Length" => "0"),
+        retry = false)
+    nothing
+end
+
+# Put Block From URL for all of the blocks of the blob (with the threaded engine of libAzStorage, and a second chance,
+# on fresh connections, for the blocks that failed), followed by Put Block List
+function copyblocks(src::AzContainer, srcblob, dst::AzContainer, dstblob, properties)
+    invalidate!(dst, dstblob)
+    _nblocks = cld(properties.size, _MAXBYTES_COPY_PER_BLOCK)
+    _nblocks > _MAXBLOCKS_PER_BLOB && nblocks_error()
+    _blockids = blockids(_nblocks)
+    __blockids = [HTTP.escapeuri(blockid) for blockid in _blockids]
+    copysource = "$(endpoint(src.storageaccount))/$(src.containername)/$(addprefix(src,srcblob))"
+    nthreads = clamp(nconcurrent(dst), 1, _nblocks)
+
+    skip = falses(_nblocks)
+    blockcodes = Vector{ResponseCodes}(undef, _nblocks)
+    local r
+    for fresh in (0, 1)
+        _skip = UInt8.(skip)
+        r = GC.@preserve _skip blockcodes transfer_refreshed(dst, src) do slot, cond
+            ccall((:curl_copyblocks_async, libAzStorage), Ptr{Cvoid},
+                (Cstring,    Ptr{Cvoid}, Cstring,            Cstring,           Cstring,                Ptr{Cstring}, Cstring,    Cstring,          Csize_t,         Cint,     Cint,     Ptr{UInt8}, Ptr{ResponseCodes}, Cint,  Cint,       Cint,        Ptr{Cvoid},             Ptr{Cvoid}),
+                 slot.token, slot.ptr,   dst.storageaccount, dst.containername, addprefix(dst,dstblob), __blockids,   copysource, slot.sourcetoken, properties.size, nthreads, _nblocks, _skip,      blockcodes,         fresh, dst.nretry, dst.verbose, cglobal(:uv_async_send), cond.handle)
+        end
+        isfailure(r) || break
+        skip = [!isfailure(blockcode) for blockcode in blockcodes]
+        @debug "copyblocks: second chance for blocks $(findall(!, skip)), http=$(r.http), curl=$(r.curl)"
+    end
+    r.http >= 300 && error("cp: error code $(r.http), failed blocks: $(findall(!, skip))")
+    r.curl > 0 && error("curl error, code=$(r.curl), failed blocks: $(findall(!, skip))")
+
+    putblocklist(dst, dstblob, _blockids; contenttype=properties.contenttype)
+end
+
+#
+# Transfer statistics, counted by the C layer (i.e. the threaded, curl_multi and asynchronous transfers, but
+# not the requests that are made with HTTP.jl).  The layout of the counters matches `curl_stats` in AzStorage.c.
+#
+const _STATS_NHISTOGRAM = 24
+const _STATS_NHTTP = 600
+const _STATS_NCURL = 100
+const _STATS_LENGTH = 10 + _STATS_NHISTOGRAM + _STATS_NHTTP + _STATS_NCURL
+
+struct TransferStats
+    nrequests::Int
+    nbytesup::Int
+    nbytesdown::Int
+    nretries::Int
+    backofftime::Float64
+    dnstime::Float64
+    connecttime::Float64
+    tlstime::Float64
+    ttfbtime::Float64
+    totaltime::Float64
+    histogram::Vector{Int}
+    retries_http::Dict{Int,Int}
+    retries_curl::Dict{Int,Int}
+end
+
+function TransferStats(x::Vector{Clong})
+    histogram = x[11:10+_STATS_NHISTOGRAM]
+    retries_http = x[11+_STATS_NHISTOGRAM:10+_STATS_NHISTOGRAM+_STATS_NHTTP]
+    retries_curl = x[11+_STATS_NHISTOGRAM+_STATS_NHTTP:_STATS_LENGTH]
+    TransferStats(x[1], x[2], x[3], x[4], (x[5:10] ./ 1e6)...,
+        histogram,
+        Dict(i-1 => n for (i,n) in enumerate(retries_http) if n > 0),
+        Dict(i-1 => n for (i,n) in enumerate(retries_curl) if n > 0))
+end
+
+function Base.:-(a::TransferStats, b::TransferStats)
+    _diff(x, y) = filter(kv->kv.second != 0, Dict(k => get(x, k, 0) - get(y, k, 0) for k in union(keys(x), keys(y))))
+    TransferStats(a.nrequests-b.nrequests, a.nbytesup-b.nbytesup, a.nbytesdown-b.nbytesdown, a.nretries-b.nretries,
+        a.backofftime-b.backofftime, a.dnstime-b.dnstime, a.connecttime-b.connecttime, a.tlstime-b.tlstime,
+        a.ttfbtime-b.ttfbtime, a.totaltime-b.totaltime, a.histogram .- b.histogram,
+        _diff(a.retries_http, b.retries_http), _diff(a.retries_curl, b.retries_curl))
+end
+
+function Base.show(io::IO, ::MIME"text/plain", s::TransferStats)
+    _mean(t) = s.nrequests > 0 ? round(1000*t/s.nrequests; digits=2) : 0.0
+    println(io, "AzStorage.TransferStats")
+    println(io, "  requests: $(s.nrequests), retries: $(s.nretries), backoff: $(round(s.backofftime; digits=2)) s")
+    println(io, "  bytes up: $(s.nbytesup), bytes down: $(s.nbytesdown)")
+    println(io, "  mean per request (ms): dns=$(_mean(s.dnstime)), connect=$(_mean(s.connecttime)), tls=$(_mean(s.tlstime)), ttfb=$(_mean(s.ttfbtime)), total=$(_mean(s.totaltime))")
+    isempty(s.retries_http) || println(io, "  retries by http code: $(sort(collect(s.retries_http)))")
+    isempty(s.retries_curl) || println(io, "  retries by curl code: $(sort(collect(s.retries_curl)))")
+    print(io, "  latency histogram (ms, upper bin edge => count): ")
+    print(io, join(["$(2^(i-1))=>$n" for (i,n) in enumerate(s.histogram) if n > 0], ", "))
+end
+
+"""
+    AzStorage.stats()
+
+Returns the transfer statistics (an `AzStorage.TransferStats`) that are collected by the C layer since the last
+call to `AzStorage.reset_stats!()`.  This includes the number of requests, the bytes moved, the retries by HTTP
+and curl code, the time slept in back-off, and the summed DNS, connect, TLS, time-to-first-byte and total request
+times (in seconds), along with a latency histogram of the total request times (power-of-two bins, in ms).
+
+    AzStorage.stats(f)
+
+Calls `f()`, and returns its result together with the statistics of the transfers that were made while it ran.
+Note that concurrent transfers (e.g. from other tasks) are included.
+
+# Example
+```
+x,s = AzStorage.stats(() -> read!(container, "foo.bin", Vector{Float32}(undef, 1_000_000)))
+s.nretries
+```
+"""
+function stats()
+    x = Vector{Clong}(undef, _STATS_LENGTH)
+    ccall((:curl_stats, libAzStorage), Cint, (Ptr{Clong},), x)
+    TransferStats(x)
+end
+
+function stats(f::Function)
+    a = stats()
+    y = f()
+    y, stats() - a
+end
+
+"""
+    AzStorage.reset_stats!()
+
+Reset the transfer statistics that are returned by `AzStorage.stats()` and `AzStorage.thread_stats()`.
+"""
+reset_stats!() = ccall((:curl_stats_reset, libAzStorage), Cvoid, ())
+
+# the layout of the counters matches `curl_stats_threads` in AzStorage.c
+const _STATS_THREAD_LENGTH = 6
+
+struct ThreadStats
+    nrequests::Int
+    nbytesup::Int
+    nbytesdown::Int
+    totaltime::Float64
+    cpu::Int
+    node::Int
+end
+
+throughput(s::ThreadStats) = s.totaltime > 0 ? (s.nbytesup + s.nbytesdown)/s.totaltime : 0.0
+
+Base.show(io::IO, s::ThreadStats) = print(io, "AzStorage.ThreadStats(node=$(s.node), cpu=$(s.cpu), ",
+    "requests=$(s.nrequests), throughput=$(round(throughput(s)/1e6; digits=2)) MB/s)")
+
+"""
+    AzStorage.thread_stats()
+
+Returns the transfer statistics (an `AzStorage.ThreadStats`) of each thread of the C layer that made requests since
+the last call to `AzStorage.reset_stats!()`: the number of requests, the bytes moved, the summed request time (in
+seconds), and the cpu (and its NUMA node, or -1 if not known) of the last request of the thread.  The throughput of a
+thread, `AzStorage.throughput(s)`, is the bytes that it moved per second of request time, so that an imbalance between
+the threads (e.g. across sockets, see `AzStorage.set_affinity!`) shows as a spread in their throughputs.
+
+# Example
+```
+AzStorage.reset_stats!()
+read!(container, "foo.bin", Vector{Float32}(undef, 1_000_000_000))
+AzStorage.thread_stats()
+```
+"""
+function thread_stats()
+    n = ccall((:curl_stats_threads, libAzStorage), Cint, (Ptr{Clong}, Cint), C_NULL, 0)
+    x = Vector{Clong}(undef, _STATS_THREAD_LENGTH*n)
+    n = min(n, ccall((:curl_stats_threads, libAzStorage), Cint, (Ptr{Clong}, Cint), x, n))
+    stats = [ThreadStats(x[i+1], x[i+2], x[i+3], x[i+4]/1e6, x[i+5], x[i+6]) for i in _STATS_THREAD_LENGTH .* (0:n-1)]
+    filter(s->s.nrequests > 0, stats)
+end
+
+export AzContainer, containers, eachblob, read_async!, readdlm, readv!, upload, write_async, writedlm
 
 end
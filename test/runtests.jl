@@ -15,10 +15,10 @@ end
 sleep(60)
 
 @testset "Error codes" begin
-    @test unsafe_load(cglobal((:N_HTTP_RETRY_CODES, AzStorage.libAzStorage), Cint)) == 2
+    @test unsafe_load(cglobal((:N_HTTP_RETRY_CODES, AzStorage.libAzStorage), Cint)) == 3
     x = unsafe_load(cglobal((:HTTP_RETRY_CODES, AzStorage.libAzStorage), Ptr{Clong}))
-    y = unsafe_wrap(Array, x, (2,); own=false)
-    @test y == [500,503]
+    y = unsafe_wrap(Array, x, (3,); own=false)
+    @test y == [429,500,503]
 
     @test unsafe_load(cglobal((:N_CURL_RETRY_CODES, AzStorage.libAzStorage), Cint)) == 4
     x = unsafe_load(cglobal((:CURL_RETRY_CODES, AzStorage.libAzStorage), Ptr{Clong}))
@@ -26,6 +26,75 @@ sleep(60)
     @test y == [7,28,55,56]
 end
 
+@testset "Rate controller" begin
+    window,inflight,nthrottled = Ref{Cdouble}(0), Ref{Cint}(0), Ref{Clong}(0)
+    ccall((:curl_rate_state, AzStorage.libAzStorage), Cvoid, (Ref{Cdouble}, Ref{Cint}, Ref{Clong}), window, inflight, nthrottled)
+    @test window[] >= 1
+    @test inflight[] == 0
+
+    # a throttling response shrinks the window, and successful responses grow it back
+    @test ccall((:rate_tryacquire, AzStorage.libAzStorage), Cint, ()) == 1
+    ccall((:rate_release, AzStorage.libAzStorage), Cvoid, (Ptr{Cvoid}, Clong), C_NULL, 503)
+    ccall((:curl_rate_state, AzStorage.libAzStorage), Cvoid, (Ref{Cdouble}, Ref{Cint}, Ref{Clong}), window, inflight, nthrottled)
+    @test window[] == 1
+    @test nthrottled[] == 1
+    for i = 1:10
+        @test ccall((:rate_tryacquire, AzStorage.libAzStorage), Cint, ()) == 1
+        ccall((:rate_release, AzStorage.libAzStorage), Cvoid, (Ptr{Cvoid}, Clong), C_NULL, 200)
+    end
+    ccall((:curl_rate_state, AzStorage.libAzStorage), Cvoid, (Ref{Cdouble}, Ref{Cint}, Ref{Clong}), window, inflight, nthrottled)
+    @test window[] > 1
+    @test inflight[] == 0
+    ccall((:curl_rate_reset, AzStorage.libAzStorage), Cvoid, ())
+end
+
+@testset "Transfer statistics" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+42)))
+    c = AzContainer("foo-$r-f", storageaccount=storageaccount, session=session, nthreads=2)
+    mkpath(c)
+    AzStorage.reset_stats!()
+    x = rand(UInt8, 70_000_000)
+    _,s = AzStorage.stats(() -> AzStorage.writebytes_block(c, "bar", x, 4))
+    @test s.nrequests == 4
+    @test s.nbytesup == length(x)
+    @test sum(s.histogram) == 4
+    @test s.totaltime > 0
+    y = Vector{UInt8}(undef, length(x))
+    _,s = AzStorage.stats(() -> read!(c, "bar", y; chunksize=17_500_000))
+    @test s.nbytesdown == length(x)
+    @test AzStorage.stats().nrequests == 8
+    AzStorage.reset_stats!()
+    @test AzStorage.stats().nrequests == 0
+    rm(c)
+end
+
+@testset "Thread statistics and affinity" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+50)))
+    c = AzContainer("foo-$r-h", storageaccount=storageaccount, session=session, nthreads=2)
+    mkpath(c)
+    AzStorage.reset_stats!()
+    x = rand(UInt8, 70_000_000)
+    AzStorage.writebytes_block(c, "bar", x, 4)
+    s = AzStorage.thread_stats()
+    @test sum(t->t.nrequests, s) == 4
+    @test sum(t->t.nbytesup, s) == length(x)
+    @test all(t->AzStorage.throughput(t) > 0, s)
+
+    if Sys.islinux()
+        AzStorage.set_affinity!(0)
+        AzStorage.reset_stats!()
+        @test read!(c, "bar", Vector{UInt8}(undef, length(x))) == x
+        @test all(t->t.node ∈ (-1, 0), AzStorage.thread_stats())
+        AzStorage.set_affinity!(-1)
+    end
+    @test_throws ArgumentError AzStorage.set_affinity!("not-a-nic")
+    AzStorage.reset_stats!()
+    @test isempty(AzStorage.thread_stats())
+    rm(c)
+end
+
 @testset "Containers, list" begin
     sleep(1)
     r = lowercase(randstring(MersenneTwister(millisecond(now())+0)))
@@ -94,6 +163,26 @@ end
     @test !isdir(c)
 end
 
+@testset "Containers, list, prefix and delimiter, prefix=$prefix" for prefix in ("", "prefix")
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+34)))
+    suffix = prefix == "" ? "-foo" : "-bar"
+    c = AzContainer("foo-$r-x$suffix", prefix=prefix, storageaccount=storageaccount, session=session)
+    mkpath(c)
+
+    write(c, "bar", "one")
+    write(c, "baz/a", "two")
+    write(c, "baz/b", "three")
+    write(c, "fiz", "four")
+
+    @test sort(readdir(c; prefix="ba")) == ["bar", "baz/a", "baz/b"]
+    @test sort(readdir(c; delimiter="/")) == ["bar", "baz/", "fiz"]
+    @test sort(readdir(c; maxresults=1)) == ["bar", "baz/a", "baz/b", "fiz"]
+    @test sort(collect(eachblob(c; maxresults=1))) == ["bar", "baz/a", "baz/b", "fiz"]
+    @test collect(eachblob(c; prefix="fi")) == ["fiz"]
+    rm(c)
+end
+
 @testset "Containers, dirname" begin
     sleep(1)
     r = lowercase(randstring(MersenneTwister(millisecond(now())+3)))
@@ -145,6 +234,89 @@ end
     rm(c)
 end
 
+@testset "Containers, bytes, chunked threaded read" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+26)))
+    c = AzContainer("foo-$r-p", storageaccount=storageaccount, session=session, nthreads=2)
+    mkpath(c)
+
+    N = round(Int, AzStorage._MINBYTES_PER_BLOCK * 3 / 8)
+    x = rand(N)
+    write(c, "bar", x)
+    y = read!(c, "bar", Vector{Float64}(undef, N); chunksize=1_000_003)
+    @test x ≈ y
+    rm(c)
+end
+
+@testset "Containers, bytes, curl_multi engine, http2=$http2" for http2 in (false, true)
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+27)))
+    suffix = http2 ? "-foo" : "-bar"
+    c = AzContainer("foo-$r-q$suffix", storageaccount=storageaccount, session=session, nthreads=1, nrequests=4, http2=http2)
+    mkpath(c)
+
+    N = round(Int, AzStorage._MINBYTES_PER_BLOCK * 5 / 8)
+    x = rand(N)
+    write(c, "bar", x)
+    y = read!(c, "bar", Vector{Float64}(undef, N); chunksize=8_000_000)
+    @test x ≈ y
+    rm(c)
+end
+
+@testset "Containers, bytes, async, nthreads=$nthreads" for nthreads in (1, 2)
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+28)))
+    c = AzContainer("foo-$r-r$nthreads", storageaccount=storageaccount, session=session, nthreads=nthreads)
+    mkpath(c)
+
+    N = round(Int, AzStorage._MINBYTES_PER_BLOCK * 3 / 8)
+    x = rand(N)
+    t = write_async(c, "bar", x)
+    @test t isa Task
+    wait(t)
+    y = Vector{Float64}(undef, N)
+    t = read_async!(c, "bar", y)
+    @test t isa Task
+    wait(t)
+    @test x ≈ y
+    rm(c)
+end
+
+@testset "Containers, bytes, vectored read, maxgap=$maxgap" for maxgap in (0, 1_000)
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+32)))
+    c = AzContainer("foo-$r-v$maxgap", storageaccount=storageaccount, session=session, nthreads=2)
+    mkpath(c)
+
+    x = rand(Float32, 100_000)
+    write(c, "bar", x)
+    offsets = [50_000, 10, 20, 25, 99_990, 3_000]
+    buffers = [Vector{Float32}(undef, n) for n in (100, 10, 10, 10, 10, 0)]
+    readv!(c, "bar", offsets, buffers; maxgap=maxgap)
+    for i in eachindex(offsets)
+        @test buffers[i] ≈ x[offsets[i]+1:offsets[i]+length(buffers[i])]
+    end
+    rm(c)
+end
+
+@testset "Containers, bytes, batched, prefix=$prefix" for prefix in ("", "prefix")
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+33)))
+    suffix = prefix == "" ? "-foo" : "-bar"
+    c = AzContainer("foo-$r-w$suffix", prefix=prefix, storageaccount=storageaccount, session=session, nthreads=4)
+    mkpath(c)
+
+    names = ["bar$i" for i = 1:20]
+    xs = [rand(i) for i = 1:20]
+    write(c, names, xs)
+    @test filesize(c, "bar20") == 20*8
+    ys = read!(c, names, [zeros(i) for i = 1:20])
+    for i = 1:20
+        @test xs[i] ≈ ys[i]
+    end
+    rm(c)
+end
+
 @testset "Containers, bytes, nested folder, prefix=$prefix" for prefix in ("","prefix")
     sleep(1)
     r = lowercase(randstring(MersenneTwister(millisecond(now())+7)))
@@ -200,6 +372,313 @@ end
     rm(c)
 end
 
+@testset "Containers, resumable write" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+40)))
+    c = AzContainer("foo-$r-d", storageaccount=storageaccount, session=session, nthreads=2)
+    mkpath(c)
+    x = rand(UInt8, 1000)
+    _blockids = AzStorage.blockids(4)
+    __blockids = [AzStorage.HTTP.escapeuri(blockid) for blockid in _blockids]
+
+    # simulate a failed write that uploaded the first two blocks
+    skip = [false, false, true, true]
+    r,failed = AzStorage.putblocks(c, "bar", x, 4, __blockids, skip)
+    @test r.http < 300
+    @test isempty(failed)
+    @test AzStorage.uploadedblocks(c, "bar", _blockids, length(x)) == [true, true, false, false]
+    @test AzStorage.uploadedblocks(c, "bar", AzStorage.blockids(3), length(x)) == [false, false, false]
+
+    AzStorage.writebytes_block(c, "bar", x, 4; resume=true)
+    @test read!(c, "bar", Vector{UInt8}(undef, 1000)) == x
+    @test isempty(AzStorage.uncommittedblocks(c, "bar"))
+
+    y = rand(UInt8, 100_000_000)
+    write(c, "baz", y; resume=true)
+    @test read!(c, "baz", Vector{UInt8}(undef, length(y))) == y
+    rm(c)
+end
+
+@testset "Containers, second-chance read of failed chunks" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+41)))
+    c = AzContainer("foo-$r-e", storageaccount=storageaccount, session=session, nthreads=2)
+    mkpath(c)
+    x = rand(UInt8, 1003)
+    write(c, "bar", x)
+
+    # pretend that chunks 2 and 4 (of 4) failed in the first pass
+    y = zeros(UInt8, 1000)
+    chunkcodes = [AzStorage.ResponseCodes(200,0), AzStorage.ResponseCodes(503,0), AzStorage.ResponseCodes(200,0), AzStorage.ResponseCodes(200,28)]
+    r = AzStorage.rereadchunks!(c, "bar", y, 3, chunkcodes)
+    @test !AzStorage.isfailure(r)
+    @test y[251:500] == x[254:503]
+    @test y[751:1000] == x[754:1003]
+    @test all(y[1:250] .== 0)
+    @test all(y[501:750] .== 0)
+    rm(c)
+end
+
+@testset "Containers, integrity, nrequests=$nrequests" for nrequests in (0, 4)
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+43+nrequests)))
+    c = AzContainer("foo-$r-f", storageaccount=storageaccount, session=session, nthreads=2, nrequests=nrequests, integrity=true)
+    mkpath(c)
+
+    @test AzStorage.crc64(UInt8[]) == 0
+    @test AzStorage.crc64(transcode(UInt8, "123456789")) == 0xae8b14860a799888
+    x = rand(UInt8, 10_000_001)
+    @test AzStorage.crc64(x[3_000_001:end], AzStorage.crc64(x[1:3_000_000])) == AzStorage.crc64(x)
+    @test AzStorage.crc64combine([AzStorage.crc64(x[1:5_000_001]), AzStorage.crc64(x[5_000_002:end])], length(x)) == AzStorage.crc64(x)
+
+    # single put blob, multiple blocks, and the streaming writer
+    write(c, "small", x[1:1000])
+    @test AzStorage.crc64(c, "small") == AzStorage.crc64(x[1:1000])
+    AzStorage.writebytes_block(c, "blocks", x, 3)
+    @test AzStorage.crc64(c, "blocks") == AzStorage.crc64(x)
+    open(c, "stream"; write=true, blocksize=4_000_000) do io
+        write(io, x)
+    end
+    @test AzStorage.crc64(c, "stream") == AzStorage.crc64(x)
+
+    # reads are verified in ranges of at most 4 MiB
+    y = zeros(UInt8, length(x))
+    @test read!(c, "blocks", y; chunksize=6_000_000) == x
+    @test read!(c, "stream", zeros(UInt8, 1000); offset=5) == x[6:1005]
+    @test read(c, "blocks", String) == String(copy(x))
+    @test read!(c, ["small", "blocks"], [zeros(UInt8, 1000), zeros(UInt8, length(x))]) == [x[1:1000], x]
+
+    # the asynchronous methods and batched writes
+    fetch(write_async(c, "async", x))
+    @test AzStorage.crc64(c, "async") == AzStorage.crc64(x)
+    @test fetch(read_async!(c, "async", zeros(UInt8, length(x)))) == x
+    write(c, ["batch1", "batch2"], [x[1:1000], x[1001:3000]])
+    @test AzStorage.crc64(c, "batch2") == AzStorage.crc64(x[1001:3000])
+
+    # blobs that are written without integrity checking have no stored CRC64
+    _c = AzContainer("foo-$r-f", storageaccount=storageaccount, session=session, nthreads=2)
+    write(_c, "nocrc", x[1:1000])
+    @test AzStorage.crc64(c, "nocrc") === nothing
+    rm(c)
+end
+
+@testset "Containers, compression" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+45)))
+    @test_throws ArgumentError AzContainer("foo-$r-g", storageaccount=storageaccount, session=session, compression="foo")
+    c = AzContainer("foo-$r-g", storageaccount=storageaccount, session=session, nthreads=2, compression="zstd")
+    mkpath(c)
+
+    # two compressed blocks of shuffled Float32's
+    x = Float32[sin(i/1000) for i = 1:10_000_000]
+    write(c, "x", x)
+    @test filesize(c, "x") == sizeof(x)
+    @test AzStorage.properties(c, "x").size < sizeof(x)
+    @test length(AzStorage.codecindex(c, "x").blockoffsets) == 3
+    @test read!(c, "x", similar(x)) == x
+    @test read!(c, "x", Vector{Float32}(undef, 1000); offset=4_999_500) == x[4_999_501:5_000_500]
+    @test read!(c, "x", Vector{Float32}(undef, 10); offset=10) == x[11:20]
+    @test_throws EOFError read!(c, "x", Vector{Float32}(undef, 10); offset=length(x)-5)
+
+    # the asynchronous reads, the reader and download also decompress, and readv! throws
+    @test fetch(read_async!(c, "x", similar(x))) == x
+    @test fetch(read_async!(c, "x", Vector{Float32}(undef, 1000); offset=4_999_500)) == x[4_999_501:5_000_500]
+    io = open(c, "x"; read=true)
+    @test filesize(io) == sizeof(x)
+    @test read!(io, Vector{Float32}(undef, length(x))) == x
+    close(io)
+    localpath = tempname()
+    download(c, "x", localpath; chunksize=sizeof(x) ÷ 3)
+    @test read!(localpath, similar(x)) == x
+    rm(localpath)
+    @test_throws ErrorException readv!(c, "x", [0], [Vector{Float32}(undef, 10)])
+
+    # single block, and blobs that are not compressed
+    write(c, "y", "hello world")
+    @test read(c, "y", String) == "hello world"
+    _c = AzContainer("foo-$r-g", storageaccount=storageaccount, session=session, nthreads=2)
+    write(_c, "z", x[1:1000])
+    @test AzStorage.codecindex(c, "z") === nothing
+    @test read!(c, "z", Vector{Float32}(undef, 1000)) == x[1:1000]
+    @test filesize(_c, "x") < sizeof(x)
+    rm(c)
+end
+
+@testset "Containers, local block cache" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+47)))
+    cachedir = mktempdir()
+    B = AzStorage._DISKCACHE_BLOCKSIZE
+    c = AzContainer("foo-$r-h", storageaccount=storageaccount, session=session, nthreads=2, cachedir=cachedir, cachesize=3*B)
+    mkpath(c)
+    x = rand(UInt8, 2*B + 1000)
+    write(c, "x", x)
+
+    # a read that straddles the first two blocks fills both of them, once, from concurrent tasks
+    ys = asyncmap(i->read!(c, "x", Vector{UInt8}(undef, 2000); offset=B-1000), 1:4)
+    @test all(y->y == x[B-999:B+1000], ys)
+    cache = AzStorage.diskcache(c)
+    @test length(cache.blocks) == 2
+    @test isempty(cache.filling)
+    @test read!(c, "x", Vector{UInt8}(undef, length(x))) == x
+    @test length(cache.blocks) == 3
+    @test cache.nbytes == length(x)
+    @test read(c, "x", String) == String(copy(x))
+
+    # a changed blob has a new ETag, and so does not hit the stale blocks
+    x = rand(UInt8, 2*B + 1000)
+    write(c, "x", x)
+    @test read!(c, "x", Vector{UInt8}(undef, 1000)) == x[1:1000]
+
+    # the least recently used blocks are evicted
+    @test cache.nbytes <= 3*B
+    @test length(cache.blocks) == 3
+    @test sum(filesize(joinpath(root, file)) for (root,dirs,files) in walkdir(cachedir) for file in files) == cache.nbytes
+    @test_throws EOFError read!(c, "x", Vector{UInt8}(undef, 10); offset=length(x)-5)
+    rm(c)
+    rm(cachedir; recursive=true)
+end
+
+@testset "Containers, upload and download" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+48)))
+    c = AzContainer("foo-$r-i", storageaccount=storageaccount, session=session, nthreads=2)
+    mkpath(c)
+    dir = mktempdir()
+    for n in (0, 100, 3*AzStorage._MINBYTES_PER_BLOCK + 1000)
+        x = rand(UInt8, n)
+        write(joinpath(dir, "x"), x)
+        upload(c, "x-$n", joinpath(dir, "x"))
+        @test read!(c, "x-$n", Vector{UInt8}(undef, n)) == x
+        @test download(c, "x-$n", joinpath(dir, "y"); chunksize=AzStorage._MINBYTES_PER_BLOCK) == joinpath(dir, "y")
+        @test read(joinpath(dir, "y")) == x
+    end
+
+    # an existing (larger) file is replaced
+    write(joinpath(dir, "y"), rand(UInt8, 1000))
+    download(c, "x-100", joinpath(dir, "y"))
+    @test filesize(joinpath(dir, "y")) == 100
+    rm(c)
+    rm(dir; recursive=true)
+end
+
+@testset "Containers, token refresh" begin
+    sleep(1)
+    slot = AzStorage.TokenSlot(session)
+    @test slot.ptr != C_NULL
+    @test ccall((:curl_token_stale, AzStorage.libAzStorage), Cint, (Ptr{Cvoid},), slot.ptr) == 0
+    AzStorage.refresh!(slot, session)
+    @test slot.token == AzStorage.token(session)
+    close(slot)
+    @test slot.ptr == C_NULL
+    AzStorage.refresh!(slot, session)
+
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+49)))
+    for nrequests in (0, 4)
+        c = AzContainer("foo-$r-w$nrequests", storageaccount=storageaccount, session=session, nthreads=2, nrequests=nrequests)
+        mkpath(c)
+        x = rand(UInt8, 3*AzStorage._MINBYTES_PER_BLOCK + 1000)
+        write(c, "x", x)
+        @test read!(c, "x", Vector{UInt8}(undef, length(x))) == x
+        @test fetch(read_async!(c, "x", Vector{UInt8}(undef, length(x)))) == x
+        rm(c)
+    end
+
+    # a request that is rejected (401/403) with the token in the slot is retried once the slot is refreshed
+    c = AzContainer("foo-$r-a", storageaccount=storageaccount, session=session, nthreads=2)
+    mkpath(c)
+    x = rand(UInt8, 3*AzStorage._MINBYTES_PER_BLOCK + 1000)
+    write(c, "x", x)
+    y = Vector{UInt8}(undef, length(x))
+    slot = AzStorage.TokenSlot(session)
+    @test ccall((:curl_token_set, AzStorage.libAzStorage), Cint, (Ptr{Cvoid}, Cstring, Cstring), slot.ptr, "bogus", "") == 0
+    cond = Base.AsyncCondition()
+    r,s = AzStorage.stats() do
+        GC.@preserve y AzStorage.wait_transfer(ccall((:curl_readbytes_async, AzStorage.libAzStorage), Ptr{Cvoid},
+            (Cstring, Ptr{Cvoid}, Cstring, Cstring, Cstring, Ptr{UInt8}, Csize_t, Csize_t, Csize_t, Cint, Cint, Cint, Ptr{AzStorage.ResponseCodes}, Cint, Cint, Cint, Ptr{Cvoid}, Ptr{Cvoid}),
+            "bogus", slot.ptr, c.storageaccount, c.containername, "x", y, 0, length(y), AzStorage._MINBYTES_PER_BLOCK, 2, 0, 0, C_NULL, 0, c.nretry, c.verbose, cglobal(:uv_async_send), cond.handle), cond)
+    end
+    close(slot)
+    @test !AzStorage.isfailure(r)
+    @test y == x
+    @test get(s.retries_http, 401, 0) + get(s.retries_http, 403, 0) > 0
+
+    # the file transfers and the codec reads also take their token from a slot
+    localpath = tempname()
+    download(c, "x", localpath)
+    @test read(localpath) == x
+    upload(c, "y", localpath)
+    @test read!(c, "y", Vector{UInt8}(undef, length(x))) == x
+    rm(localpath)
+    rm(c)
+end
+
+@testset "Containers, autotune" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+39)))
+    ENV["AZSTORAGE_TUNING_FILE"] = joinpath(mktempdir(), "tuning")
+    c = AzContainer("foo-$r-c", storageaccount=storageaccount, session=session, nthreads=2, autotune=true)
+    mkpath(c)
+    blocksize,n,throughput = AzStorage.calibrate!(c; nbytes=100_000_000, ntrials=4)
+    @test AzStorage._MINBYTES_PER_TUNEDBLOCK <= blocksize <= AzStorage._MAXBYTES_PER_BLOCK
+    @test n >= 1
+    @test throughput > 0
+    @test isfile(ENV["AZSTORAGE_TUNING_FILE"])
+    @test isempty(readdir(c))
+
+    x = rand(UInt8, 100_000_000)
+    write(c, "bar", x)
+    @test read!(c, "bar", Vector{UInt8}(undef, length(x))) == x
+    rm(c)
+    delete!(ENV, "AZSTORAGE_TUNING_FILE")
+end
+
+@testset "Containers, autotune outliers" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+51)))
+    ENV["AZSTORAGE_TUNING_FILE"] = joinpath(mktempdir(), "tuning")
+    c = AzContainer("foo-$r-c", storageaccount="azstorage-tuner-$r", session=session, nthreads=2, autotune=true)
+    t = AzStorage.tuner(c)
+    blocksize,n = t.blocksize,t.nconcurrent
+
+    # a partial last wave counts as a full one
+    AzStorage.measure!(c, blocksize, n, n+1, 1.0)
+    @test t.throughput ≈ 2*n*blocksize
+    t.trialblocksize,t.trialnconcurrent = blocksize,n
+    AzStorage.measure!(c, blocksize, n, 2n, 1.0)
+    @test t.throughput ≈ 2*n*blocksize
+
+    # an outlier for the best setting decays as the trials that follow fail
+    t.trialblocksize,t.trialnconcurrent = blocksize,n
+    AzStorage.measure!(c, blocksize, n, n, 1e-6)
+    outlier = t.throughput
+    for i = 1:100
+        AzStorage.measure!(c, t.trialblocksize, t.trialnconcurrent, t.trialnconcurrent, 1.0)
+    end
+    @test t.throughput < outlier / 100
+    delete!(AzStorage._TUNERS, c.storageaccount)
+    delete!(ENV, "AZSTORAGE_TUNING_FILE")
+end
+
+@testset "Containers, batch delete" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+38)))
+    c = AzContainer("foo-$r-b", storageaccount=storageaccount, session=session)
+    mkpath(c)
+    names = ["bar $i" for i=1:300]
+    write(c, names, [rand(UInt8,10) for i=1:300])
+    write(c, "baz", "baz")
+    failures = rm(c, [names; "notanobject"])
+    @test isempty(failures)
+    @test readdir(c) == ["baz"]
+
+    _c = AzContainer("foo-$r-b/prefix", storageaccount=storageaccount, session=session)
+    write(_c, names, [rand(UInt8,10) for i=1:300])
+    @test isempty(rm(_c))
+    @test readdir(c) == ["baz"]
+    rm(c)
+end
+
 @testset "Containers, cp, prefix=$prefix" for prefix in ("", "prefix")
     sleep(1)
     r = lowercase(randstring(MersenneTwister(millisecond(now())+11)))
@@ -221,6 +700,60 @@ end
     rm(dst)
 end
 
+@testset "Containers, cp, put block from url" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+36)))
+    src = AzContainer("foo-$r-z", storageaccount=storageaccount, session=session)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+37)))
+    dst = AzContainer("foo-$r-a", storageaccount=storageaccount, session=session)
+    mkpath(src)
+    mkpath(dst)
+
+    x = rand(UInt8, 1000)
+    write(src, "bar", x)
+    _blockids = AzStorage.blockids(3)
+    for (i,(firstbyte,lastbyte)) in enumerate(((0,400), (400,800), (800,1000)))
+        AzStorage.copyblock(src, "bar", dst, "baz", _blockids[i], firstbyte, lastbyte)
+    end
+    AzStorage.putblocklist(dst, "baz", _blockids)
+    @test read!(dst, "baz", Vector{UInt8}(undef, 1000)) == x
+
+    AzStorage.copyblob(src, "bar", dst, "fiz")
+    @test read!(dst, "fiz", Vector{UInt8}(undef, 1000)) == x
+
+    AzStorage.copyblocks(src, "bar", dst, "buz", AzStorage.properties(src, "bar"))
+    @test read!(dst, "buz", Vector{UInt8}(undef, 1000)) == x
+
+    cp(src, "bar", dst, "fuz")
+    @test read!(dst, "fuz", Vector{UInt8}(undef, 1000)) == x
+
+    rm(src)
+    rm(dst)
+end
+
+@testset "Containers, metadata cache" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+35)))
+    c = AzContainer("foo-$r-y", storageaccount=storageaccount, session=session, cachettl=60)
+    mkpath(c)
+    @test AzStorage.iscontainer(c)
+
+    write(c, "bar", rand(UInt8,10))
+    @test filesize(c, "bar") == 10
+    @test AzStorage.cachedproperties(c, "bar").size == 10
+    write(c, "bar", rand(UInt8,11))
+    @test AzStorage.cachedproperties(c, "bar") === nothing
+    @test filesize(c, "bar") == 11
+
+    write(c, "baz", "hello world")
+    @test read(c, "baz", String) == "hello world"
+    @test AzStorage.cachedproperties(c, "baz").size == 11
+    write(c, "empty", "")
+    @test read(c, "empty", String) == ""
+    rm(c)
+    @test !AzStorage.iscontainer(c)
+end
+
 @testset "Containers, json" begin
     sleep(1)
     r = lowercase(randstring(MersenneTwister(millisecond(now())+13)))
@@ -270,6 +803,55 @@ end
     @test x == "hello"
 end
 
+@testset "Object, streaming write" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+29)))
+    c = AzContainer("foo-$r-s", storageaccount=storageaccount, session=session, nthreads=2, nretry=10)
+    x = rand(1000, 10)
+    open(c, "bar"; write=true, blocksize=1_003, ninflight=2) do io
+        for i = 1:size(x,2)
+            write(io, x[:,i])
+        end
+    end
+    @test filesize(c, "bar") == sizeof(x)
+    @test read!(c, "bar", zeros(1000, 10)) ≈ x
+
+    open(c, "baz"; write=true) do io
+        write(io, "hello")
+    end
+    @test read(c, "baz", String) == "hello"
+
+    y = rand(100, 10)
+    io = AzStorage.AzObjectWriter(joinpath(c, "fiz"); blocksize=1_000, ninflight=1, contenttype="text/plain")
+    writedlm(io, y)
+    close(io)
+    @test readdlm(c, "fiz") ≈ y
+    rm(c)
+end
+
+@testset "Object, streaming read" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+30)))
+    c = AzContainer("foo-$r-t", storageaccount=storageaccount, session=session, nthreads=2, nretry=10)
+    x = rand(1000, 10)
+    write(c, "bar", x)
+    io = open(c, "bar"; read=true, blocksize=1_003, nprefetch=2)
+    @test position(io) == 0
+    y = zeros(1000, 10)
+    for i = 1:size(x,2)
+        y[:,i] = read!(io, zeros(1000))
+    end
+    @test eof(io)
+    @test y ≈ x
+    seek(io, 8*1000*5)
+    @test read!(io, zeros(1000)) ≈ x[:,6]
+    @test position(io) == 8*1000*6
+    seekstart(io)
+    @test read(io, UInt8) == reinterpret(UInt8, x[1:1])[1]
+    close(io)
+    rm(c)
+end
+
 @testset "Object, isfile" begin
     sleep(1)
     r = lowercase(randstring(MersenneTwister(millisecond(now())+17)))
@@ -314,6 +896,20 @@ end
     @test x.b ≈ _x.b
 end
 
+@testset "Containers, serialization, multiple blocks" begin
+    sleep(1)
+    r = lowercase(randstring(MersenneTwister(millisecond(now())+31)))
+    c = AzContainer("foo-$r-u", storageaccount=storageaccount, session=session, nthreads=2, nretry=10)
+    mkpath(c)
+    x = (a=rand(div(AzStorage._MINBYTES_PER_BLOCK,8)), b=rand(div(AzStorage._MINBYTES_PER_BLOCK,8)+1))
+    serialize(c, "bar", x)
+    @test filesize(c, "bar") > 2*AzStorage._MINBYTES_PER_BLOCK
+    _x = deserialize(c, "bar")
+    @test x.a ≈ _x.a
+    @test x.b ≈ _x.b
+    rm(c)
+end
+
 @testset "Object, number of blocks calculation" begin
     nthreads = 16
     @test AzStorage.nblocks(nthreads, nthreads*AzStorage._MAXBYTES_PER_BLOCK) == nthreads